@@ -0,0 +1,389 @@
+// Synthetic dataset generator
+//
+// Writes a CSV in the schema of yok_atlas.csv (ID, university, department,
+// score) with any number of rows, for loading and querying main.c at sizes
+// the real file cannot reach:
+//
+//   gen_dataset.exe <rows> [departments] [skew] [uniform|normal|atlas]
+//                   [sorted|reverse|random] [output_path] [seed]
+//
+// Row r (0-based) is the row with the r-th highest score and gets ID r + 1,
+// as in the real file. Its score is the quantile of the score distribution
+// at rank r, and its department and university come from a hash of r and
+// the seed. A row therefore depends only on its rank, and the insertion
+// order only decides in which order the ranks are written:
+//   sorted   descending score, like yok_atlas.csv
+//   reverse  ascending score
+//   random   a pseudo random permutation of the ranks
+// No row is kept in memory, so the output can be larger than RAM.
+//
+// Departments are drawn with a Zipfian skew: the department of popularity
+// rank d is picked with probability proportional to 1 / (d + 1)^skew, and
+// skew 0 spreads rows evenly. Department and university names are the ones
+// of yok_atlas.csv when it is in the working directory. Departments past its
+// distinct names get a number appended, so names keep realistic lengths and
+// shared prefixes. Score distributions:
+//   uniform  evenly between the lowest and highest score of the real file
+//   normal   a normal with the mean and deviation of the real file
+//   atlas    the score quantiles of yok_atlas.csv itself
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define ATLAS_PATH "yok_atlas.csv"
+#define CSV_HEADER "ID,Üniversite,Bölüm,En Küçük Puan\n"
+#define MAX_NAME_LEN 100
+#define MAX_ATLAS_ROWS 100000
+#define OUTPUT_BUFFER_SIZE (1 << 20)
+
+// used when yok_atlas.csv is not available
+#define FALLBACK_MIN_SCORE 105.0
+#define FALLBACK_MAX_SCORE 580.0
+#define FALLBACK_MEAN_SCORE 350.0
+#define FALLBACK_SCORE_SD 100.0
+
+typedef enum {
+    SCORE_UNIFORM,
+    SCORE_NORMAL,
+    SCORE_ATLAS,
+} score_distribution;
+
+typedef enum {
+    ORDER_SORTED,
+    ORDER_REVERSE,
+    ORDER_RANDOM,
+} row_order;
+
+// Distinct names and the sorted scores read from yok_atlas.csv
+typedef struct atlas {
+    char (*departments)[MAX_NAME_LEN];
+    int department_count;
+    char (*universities)[MAX_NAME_LEN];
+    int university_count;
+    double *scores; // ascending
+    int score_count;
+    double mean, sd;
+} atlas;
+
+// Bijection of [0, n) built from a Feistel network over the smallest even
+// number of bits that covers n. Values past n are walked through the
+// network again until they land in range, which takes under four rounds
+// on average.
+typedef struct permutation {
+    uint64_t n;
+    int half_bits;
+    uint64_t half_mask;
+    uint64_t keys[4];
+} permutation;
+
+uint64_t splitmix64(uint64_t x) {
+    x += 0x9e3779b97f4a7c15ull;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+    return x ^ (x >> 31);
+}
+
+// Uniform double in [0, 1) from a hash
+double hashUniform(uint64_t h) {
+    return (h >> 11) * (1.0 / 9007199254740992.0);
+}
+
+void permutationInit(permutation *p, uint64_t n, uint64_t seed) {
+    int bits = 2;
+    while (bits < 64 && (1ull << bits) < n)
+        bits += 2;
+    p->n = n;
+    p->half_bits = bits / 2;
+    p->half_mask = (1ull << p->half_bits) - 1;
+    for (int i = 0; i < 4; i++)
+        p->keys[i] = splitmix64(seed + i);
+}
+
+uint64_t permutationApply(const permutation *p, uint64_t x) {
+    do {
+        uint64_t left = x >> p->half_bits, right = x & p->half_mask;
+        for (int i = 0; i < 4; i++) {
+            uint64_t next = left ^ (splitmix64(right ^ p->keys[i]) & p->half_mask);
+            left = right;
+            right = next;
+        }
+        x = left << p->half_bits | right;
+    } while (x >= p->n);
+    return x;
+}
+
+// Add name to the list unless it is already there. Names holding a comma
+// are quoted in the real file and skipped, so the output needs no quoting.
+void addName(char (**names)[MAX_NAME_LEN], int *count, const char *name, size_t len) {
+    if (len == 0 || len >= MAX_NAME_LEN || memchr(name, '"', len) != NULL)
+        return;
+    for (int i = 0; i < *count; i++)
+        if (strncmp((*names)[i], name, len) == 0 && (*names)[i][len] == '\0')
+            return;
+    if ((*count & (*count - 1)) == 0) {
+        int capacity = *count == 0 ? 1 : *count * 2;
+        char (*grown)[MAX_NAME_LEN] = realloc(*names, capacity * sizeof(**names));
+        if (grown == NULL) {
+            perror("Atlas names.");
+            exit(EXIT_FAILURE);
+        }
+        *names = grown;
+    }
+    memcpy((*names)[*count], name, len);
+    (*names)[*count][len] = '\0';
+    (*count)++;
+}
+
+int compareDoubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Read names and scores from the real file, false when it cannot be read
+bool readAtlas(atlas *a, const char *path) {
+    memset(a, 0, sizeof(*a));
+    FILE *file = fopen(path, "r");
+    if (file == NULL)
+        return false;
+    a->scores = malloc(MAX_ATLAS_ROWS * sizeof(double));
+    if (a->scores == NULL) {
+        perror("Atlas scores.");
+        exit(EXIT_FAILURE);
+    }
+    char line[1024];
+    bool header = true;
+    while (fgets(line, sizeof(line), file) != NULL && a->score_count < MAX_ATLAS_ROWS) {
+        if (header) {
+            header = false;
+            continue;
+        }
+        char *university = strchr(line, ',');
+        char *department = university ? strchr(university + 1, ',') : NULL;
+        char *score = department ? strrchr(department + 1, ',') : NULL;
+        if (score == NULL)
+            continue;
+        addName(&a->universities, &a->university_count, university + 1,
+                department - university - 1);
+        addName(&a->departments, &a->department_count, department + 1,
+                score - department - 1);
+        a->scores[a->score_count++] = atof(score + 1);
+    }
+    fclose(file);
+    if (a->score_count == 0 || a->department_count == 0 || a->university_count == 0)
+        return false;
+    qsort(a->scores, a->score_count, sizeof(double), compareDoubles);
+    double sum = 0, squares = 0;
+    for (int i = 0; i < a->score_count; i++)
+        sum += a->scores[i];
+    a->mean = sum / a->score_count;
+    for (int i = 0; i < a->score_count; i++)
+        squares += (a->scores[i] - a->mean) * (a->scores[i] - a->mean);
+    a->sd = sqrt(squares / a->score_count);
+    return true;
+}
+
+// Inverse of the standard normal CDF, P. J. Acklam's rational
+// approximation (relative error below 1.2e-9)
+double normalQuantile(double p) {
+    static const double a[] = {-3.969683028665376e+01, 2.209460984245205e+02,
+                               -2.759285104469687e+02, 1.383577518672690e+02,
+                               -3.066479806614716e+01, 2.506628277459239e+00};
+    static const double b[] = {-5.447609879822406e+01, 1.615858368580409e+02,
+                               -1.556989798598866e+02, 6.680131188771972e+01,
+                               -1.328068155288572e+01};
+    static const double c[] = {-7.784894002430293e-03, -3.223964580411365e-01,
+                               -2.400758277161838e+00, -2.549671010615857e+00,
+                               4.374664141464968e+00, 2.938163982698783e+00};
+    static const double d[] = {7.784695709041462e-03, 3.224671290700398e-01,
+                               2.445134137142996e+00, 3.754408661907416e+00};
+    const double low = 0.02425;
+    double q, r;
+    if (p < low) {
+        q = sqrt(-2 * log(p));
+        return (((((c[0] * q + c[1]) * q + c[2]) * q + c[3]) * q + c[4]) * q + c[5]) /
+               ((((d[0] * q + d[1]) * q + d[2]) * q + d[3]) * q + 1);
+    }
+    if (p > 1 - low) {
+        q = sqrt(-2 * log(1 - p));
+        return -(((((c[0] * q + c[1]) * q + c[2]) * q + c[3]) * q + c[4]) * q + c[5]) /
+               ((((d[0] * q + d[1]) * q + d[2]) * q + d[3]) * q + 1);
+    }
+    q = p - 0.5;
+    r = q * q;
+    return (((((a[0] * r + a[1]) * r + a[2]) * r + a[3]) * r + a[4]) * r + a[5]) * q /
+           (((((b[0] * r + b[1]) * r + b[2]) * r + b[3]) * r + b[4]) * r + 1);
+}
+
+// Score at quantile p of the distribution
+double scoreAt(score_distribution dist, const atlas *a, bool have_atlas, double p) {
+    double low = have_atlas ? a->scores[0] : FALLBACK_MIN_SCORE;
+    double high = have_atlas ? a->scores[a->score_count - 1] : FALLBACK_MAX_SCORE;
+    double score;
+    switch (dist) {
+    case SCORE_NORMAL:
+        score = (have_atlas ? a->mean : FALLBACK_MEAN_SCORE) +
+                (have_atlas ? a->sd : FALLBACK_SCORE_SD) * normalQuantile(p);
+        break;
+    case SCORE_ATLAS:
+        if (!have_atlas) {
+            score = low + p * (high - low);
+            break;
+        }
+        double x = p * (a->score_count - 1);
+        int i = (int)x;
+        if (i >= a->score_count - 1)
+            return high;
+        return a->scores[i] + (x - i) * (a->scores[i + 1] - a->scores[i]);
+    default:
+        score = low + p * (high - low);
+        break;
+    }
+    return score < 0 ? 0 : score;
+}
+
+// Cumulative popularity of departments 0 .. d, the last entry is 1
+double *zipfTable(int count, double skew) {
+    double *cdf = malloc(count * sizeof(double));
+    if (cdf == NULL) {
+        perror("Department table.");
+        exit(EXIT_FAILURE);
+    }
+    double sum = 0;
+    for (int d = 0; d < count; d++)
+        cdf[d] = sum += 1.0 / pow(d + 1, skew);
+    for (int d = 0; d < count; d++)
+        cdf[d] /= sum;
+    cdf[count - 1] = 1.0;
+    return cdf;
+}
+
+// First department whose cumulative popularity exceeds u
+int zipfPick(const double *cdf, int count, double u) {
+    int lo = 0, hi = count - 1;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (cdf[mid] > u)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    return lo;
+}
+
+void departmentName(char *out, const atlas *a, bool have_atlas, int d) {
+    if (!have_atlas) {
+        snprintf(out, MAX_NAME_LEN, "Department %d", d + 1);
+        return;
+    }
+    int base = d % a->department_count, round = d / a->department_count;
+    if (round == 0)
+        snprintf(out, MAX_NAME_LEN, "%s", a->departments[base]);
+    else
+        snprintf(out, MAX_NAME_LEN, "%s %d", a->departments[base], round + 1);
+}
+
+void universityName(char *out, const atlas *a, bool have_atlas, uint64_t h) {
+    if (!have_atlas) {
+        snprintf(out, MAX_NAME_LEN, "UNIVERSITY %d", (int)(h % 200) + 1);
+        return;
+    }
+    snprintf(out, MAX_NAME_LEN, "%s", a->universities[h % a->university_count]);
+}
+
+void printUsage(const char *program) {
+    printf("Usage: %s <rows> [departments] [skew] [uniform|normal|atlas] "
+           "[sorted|reverse|random] [output_path] [seed]\n", program);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        printUsage(argv[0]);
+        return 1;
+    }
+    long long rows = atoll(argv[1]);
+    int department_count = argc > 2 ? atoi(argv[2]) : 0;
+    double skew = argc > 3 ? atof(argv[3]) : 0.8;
+    score_distribution dist = SCORE_ATLAS;
+    row_order order = ORDER_SORTED;
+    const char *output_path = argc > 6 ? argv[6] : "synthetic.csv";
+    uint64_t seed = argc > 7 ? strtoull(argv[7], NULL, 10) : 42;
+
+    if (argc > 4) {
+        if (strcmp(argv[4], "uniform") == 0)
+            dist = SCORE_UNIFORM;
+        else if (strcmp(argv[4], "normal") == 0)
+            dist = SCORE_NORMAL;
+        else if (strcmp(argv[4], "atlas") != 0) {
+            printUsage(argv[0]);
+            return 1;
+        }
+    }
+    if (argc > 5) {
+        if (strcmp(argv[5], "reverse") == 0)
+            order = ORDER_REVERSE;
+        else if (strcmp(argv[5], "random") == 0)
+            order = ORDER_RANDOM;
+        else if (strcmp(argv[5], "sorted") != 0) {
+            printUsage(argv[0]);
+            return 1;
+        }
+    }
+    // IDs are parsed as int by main.c
+    if (rows < 1 || rows > INT32_MAX || department_count < 0 || skew < 0) {
+        printUsage(argv[0]);
+        return 1;
+    }
+
+    atlas a;
+    bool have_atlas = readAtlas(&a, ATLAS_PATH);
+    if (!have_atlas)
+        fprintf(stderr, "%s not found, using generated names and scores\n", ATLAS_PATH);
+    if (department_count == 0)
+        department_count = have_atlas ? a.department_count : 1000;
+    double *cdf = zipfTable(department_count, skew);
+    permutation perm;
+    permutationInit(&perm, (uint64_t)rows, seed);
+
+    FILE *out = strcmp(output_path, "-") == 0 ? stdout : fopen(output_path, "w");
+    if (out == NULL) {
+        perror("Error opening output");
+        return 1;
+    }
+    setvbuf(out, NULL, _IOFBF, OUTPUT_BUFFER_SIZE);
+    fputs(CSV_HEADER, out);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    char department[MAX_NAME_LEN], university[MAX_NAME_LEN];
+    for (long long i = 0; i < rows; i++) {
+        uint64_t rank = order == ORDER_SORTED ? (uint64_t)i
+                      : order == ORDER_REVERSE ? (uint64_t)(rows - 1 - i)
+                      : permutationApply(&perm, (uint64_t)i);
+        uint64_t h = splitmix64(rank ^ seed);
+        // rank 0 has the highest score, so it sits at the top quantile
+        double score = scoreAt(dist, &a, have_atlas, 1.0 - (rank + 0.5) / rows);
+        departmentName(department, &a, have_atlas, zipfPick(cdf, department_count, hashUniform(h)));
+        universityName(university, &a, have_atlas, splitmix64(h));
+        fprintf(out, "%llu,%s,%s,%.5f\n", (unsigned long long)rank + 1, university,
+                department, score);
+    }
+    if (fflush(out) != 0 || (out != stdout && fclose(out) != 0)) {
+        perror("Error writing output");
+        return 1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    fprintf(stderr, "%lld rows, %d departments, skew %.2f in %.2f s\n", rows,
+            department_count, skew, seconds);
+
+    free(cdf);
+    free(a.departments);
+    free(a.universities);
+    free(a.scores);
+    return 0;
+}
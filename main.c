@@ -1,16 +1,36 @@
 // Searching on a B+ Tree in C
 
+#include <limits.h>
+#include <malloc.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
 #include <time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 // Default order
 #define ORDER 5
 #define MAX_KEY_LEN 100 
 
+// Node blocks are padded to whole cache lines. When NODE_CACHE_LINES is
+// non-zero, main() uses the largest order that fits in that many lines
+// instead of ORDER.
+#define CACHE_LINE_SIZE 64
+#ifndef NODE_CACHE_LINES
+#define NODE_CACHE_LINES 0
+#endif
+#define MAX_TREE_HEIGHT 64
+
 // CSV record structure
 typedef struct {
     int id;
@@ -19,90 +39,641 @@ typedef struct {
     float score;
 } CSVRecord;
 
+// Rows of one key in a single array, highest score first once
+// postingsSort() has run, so the row at rank n is rows[n - 1]. See
+// postingsAppend.
 typedef struct {
-    CSVRecord record; // The CSV record
-    struct CSVRecordNode* next; // Pointer to the next node in the linked list   
-} CSVRecordNode;
+    CSVRecord *rows;
+    int count;
+    int capacity;
+    int sorted; // rows[0 .. sorted) are in score order
+} postings;
+
+#define POSTINGS_FIRST_CAPACITY 1
+#define POSTINGS_CLASSES 28
 
 int csv_record_count = 0;
 CSVRecord* records = NULL; // Dynamic array to hold CSV records
 
 
 typedef struct record {
-  CSVRecordNode* value;
+  postings rows;
+  bool deleted; // tombstone left by deleteLazy
 } record;
 
 // Node
+// The header, pointers and keys share one cache-line aligned block.
+// Leaves link to the next leaf through pointers[order - 1]; parents are
+// remembered on the descent path instead of being stored in the nodes.
 typedef struct node {
-  void **pointers;
-  int *keys;
-  struct node *parent;
+  int *keys; // points into the block, after pointers
   bool is_leaf;
   int num_keys;
-  struct node *next;
+  void *pointers[];
 } node;
 
 int order = ORDER;
-node *queue = NULL;
 bool verbose_output = false;
 int number_of_splits =0;
 
-// Enqueue
-void enqueue(node *new_node);
-
-// Dequeue
-node *dequeue(void);
 int height(node *const root);
-int pathToLeaves(node *const root, node *child);
 void printLeaves(node *const root);
 void printTree(node *const root);
 void findAndPrint(node *const root, int key, bool verbose);
 void findAndPrintRange(node *const root, int range1, int range2, bool verbose);
 int findRange(node *const root, int key_start, int key_end, bool verbose,
-        int returned_keys[], void *returned_pointers[]);
+        int returned_keys[], void *returned_pointers[], int max_found);
 node *findLeaf(node *const root, int key, bool verbose);
+
+// Position of a range scan, see rangeOpen
+typedef struct range_cursor {
+  node *leaf; // NULL once the range is exhausted
+  int slot; // next entry of leaf
+  int key_start;
+  int key_end;
+  bool reverse;
+  node *path[MAX_TREE_HEIGHT]; // inner nodes above leaf, for reverse scans
+  int indexes[MAX_TREE_HEIGHT]; // child taken at each of them
+  int depth;
+} range_cursor;
+
+#define RANGE_PRINT_BATCH 64
+
+void rangeOpen(range_cursor *cursor, node *root, int key_start, int key_end,
+               bool reverse);
+int rangeNextBatch(range_cursor *cursor, int keys[], record *records[], int max);
+void rangeClose(range_cursor *cursor);
+node *findLeafWithPath(node *const root, int key, node *path[], int *depth);
 record *find(node *root, int key, bool verbose, node **leaf_out);
+void findBatch(node *root, const int keys[], int n, record *out[]);
 int cut(int length);
 
-record *makeRecord(CSVRecordNode* value);
-node *makeNode(void);
-node *makeLeaf(void);
+// Every function that creates or frees part of a node tree takes the
+// tree_memory of that tree, see the tree memory section
+typedef struct tree_memory tree_memory;
+
+record *makeRecord(tree_memory *mem);
+size_t nodeSize(void);
+int orderForCacheLines(int lines);
+node *makeNode(tree_memory *mem);
+node *makeLeaf(tree_memory *mem);
 int getLeftIndex(node *parent, node *left);
 node *insertIntoLeaf(node *leaf, int key, record *pointer);
-node *insertIntoLeafAfterSplitting(node *root, node *leaf, int key,
-                   record *pointer);
+node *insertIntoLeafAfterSplitting(tree_memory *mem, node *root, node *path[],
+                   int depth, node *leaf, int key, record *pointer);
 node *insertIntoNode(node *root, node *parent,
            int left_index, int key, node *right);
-node *insertIntoNodeAfterSplitting(node *root, node *parent,
-                   int left_index,
+node *insertIntoNodeAfterSplitting(tree_memory *mem, node *root, node *path[],
+                   int depth, node *parent, int left_index,
                    int key, node *right);
-node *insertIntoParent(node *root, node *left, int key, node *right);
-node *insertIntoNewRoot(node *left, int key, node *right);
-node *startNewTree(int key, record *pointer);
-node *insert(node *root, int key, CSVRecordNode* value);
-
-// Enqueue
-void enqueue(node *new_node) {
-  node *c;
-  if (queue == NULL) {
-    queue = new_node;
-    queue->next = NULL;
-  } else {
-    c = queue;
-    while (c->next != NULL) {
-      c = c->next;
+node *insertIntoParent(tree_memory *mem, node *root, node *path[], int depth,
+                   node *left, int key, node *right);
+node *insertIntoNewRoot(tree_memory *mem, node *left, int key, node *right);
+node *startNewTree(tree_memory *mem, int key, record *pointer);
+node *upsert(tree_memory *mem, node *root, int key, record **record_out);
+node *insert(tree_memory *mem, node *root, int key, const CSVRecord *row);
+node *insertBatch(tree_memory *mem, node *root, const int keys[],
+                  const CSVRecord *const rows[], int n);
+node *deleteEntry(tree_memory *mem, node *root, node *path[], int depth,
+                  node *n, int key, void *pointer);
+node *delete(tree_memory *mem, node *root, int key);
+bool deleteLazy(tree_memory *mem, node *root, int key);
+node *compactTombstones(tree_memory *mem, node *root, int budget);
+
+// Metrics
+//
+// Built with -DTREE_METRICS, the node tree and the bulk loaded tree count
+// what their hot paths do: lookups, nodes visited, key comparisons in the
+// node searches, splits per level, allocations and leaf chain hops of range
+// scans. Every TREE_METRICS_SAMPLE_EVERY-th lookup is also timed into a
+// histogram of power of two buckets. Counters are per thread and cost one
+// increment of thread-local memory each. metricsFlush() adds the calling
+// thread's counters into the process total, and threads call it before
+// they exit. A trace hook, when set, sees every split and every sampled
+// lookup as it happens.
+//
+// Without the flag the METRIC_ macros expand to nothing and the counters
+// do not exist.
+
+#ifdef TREE_METRICS
+
+#ifndef TREE_METRICS_SAMPLE_EVERY
+#define TREE_METRICS_SAMPLE_EVERY 64 // 0 turns latency sampling off
+#endif
+#define METRICS_LATENCY_BUCKETS 40 // bucket b holds [2^(b-1), 2^b) ns
+
+typedef struct tree_metrics {
+  unsigned long long lookups;
+  unsigned long long node_visits;
+  unsigned long long key_comparisons;
+  unsigned long long splits[MAX_TREE_HEIGHT]; // by level, leaves are level 0
+  unsigned long long allocations; // nodes, records and postings arrays handed out
+  unsigned long long system_allocations; // arena blocks and bulk loaded nodes
+  unsigned long long leaf_hops;
+  unsigned long long latency[METRICS_LATENCY_BUCKETS]; // sampled lookups
+} tree_metrics;
+
+typedef enum {
+  METRICS_EVENT_SPLIT, // value is the level
+  METRICS_EVENT_LOOKUP, // value is the sampled latency in ns
+} metrics_event;
+
+_Thread_local tree_metrics metrics_local;
+tree_metrics metrics_total;
+pthread_mutex_t metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+void (*metrics_trace)(metrics_event event, int key, unsigned long long value) = NULL;
+
+#define METRIC_ADD(counter, n) (metrics_local.counter += (n))
+#define METRIC_INC(counter) METRIC_ADD(counter, 1)
+#define METRIC_TRACE(event, key, value) \
+  (metrics_trace != NULL ? metrics_trace(event, key, value) : (void)0)
+// count nodes split at once at level, key being the one that caused it
+#define METRIC_SPLIT(level, count, key) \
+  (METRIC_ADD(splits[(level) < MAX_TREE_HEIGHT ? (level) : MAX_TREE_HEIGHT - 1], count), \
+   METRIC_TRACE(METRICS_EVENT_SPLIT, key, level))
+// Start of a lookup, sample is 0 unless this one is timed
+#define METRIC_LOOKUP_BEGIN(sample) uint64_t sample = metricsLookupBegin()
+#define METRIC_LOOKUP_END(sample, key) metricsLookupEnd(sample, key)
+#define METRIC_FLUSH() metricsFlush()
+
+uint64_t metricsClock(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+uint64_t metricsLookupBegin(void) {
+#if TREE_METRICS_SAMPLE_EVERY > 0
+  if (metrics_local.lookups++ % TREE_METRICS_SAMPLE_EVERY == 0)
+    return metricsClock();
+#else
+  metrics_local.lookups++;
+#endif
+  return 0;
+}
+
+void metricsLookupEnd(uint64_t sample, int key) {
+  if (sample == 0)
+    return;
+  uint64_t ns = metricsClock() - sample;
+  int bucket = 0;
+  while (bucket < METRICS_LATENCY_BUCKETS - 1 && (1ull << bucket) <= ns)
+    bucket++;
+  metrics_local.latency[bucket]++;
+  METRIC_TRACE(METRICS_EVENT_LOOKUP, key, ns);
+}
+
+// every field of tree_metrics is a counter
+void metricsAdd(tree_metrics *to, const tree_metrics *from) {
+  unsigned long long *t = (unsigned long long *)to;
+  const unsigned long long *f = (const unsigned long long *)from;
+  for (size_t i = 0; i < sizeof(tree_metrics) / sizeof(unsigned long long); i++)
+    t[i] += f[i];
+}
+
+// Move the calling thread's counters into the process total
+void metricsFlush(void) {
+  pthread_mutex_lock(&metrics_lock);
+  metricsAdd(&metrics_total, &metrics_local);
+  pthread_mutex_unlock(&metrics_lock);
+  memset(&metrics_local, 0, sizeof(metrics_local));
+}
+
+// Process total so far, including the calling thread
+void metricsRead(tree_metrics *out) {
+  pthread_mutex_lock(&metrics_lock);
+  *out = metrics_total;
+  pthread_mutex_unlock(&metrics_lock);
+  metricsAdd(out, &metrics_local);
+}
+
+// Zero the total and the calling thread's counters
+void metricsReset(void) {
+  pthread_mutex_lock(&metrics_lock);
+  memset(&metrics_total, 0, sizeof(metrics_total));
+  pthread_mutex_unlock(&metrics_lock);
+  memset(&metrics_local, 0, sizeof(metrics_local));
+}
+
+void printMetrics(FILE *out, const char *label, const tree_metrics *m) {
+  fprintf(out, "%s: %llu lookups", label, m->lookups);
+  if (m->lookups > 0)
+    fprintf(out, ", %.2f nodes and %.2f key comparisons per lookup",
+            (double)m->node_visits / m->lookups, (double)m->key_comparisons / m->lookups);
+  fprintf(out, "\n");
+  fprintf(out, "  %llu node visits, %llu key comparisons in all, %llu leaf hops\n",
+          m->node_visits, m->key_comparisons, m->leaf_hops);
+  fprintf(out, "  %llu allocations, %llu system allocations\n  splits by level:",
+          m->allocations, m->system_allocations);
+  for (int l = 0; l < MAX_TREE_HEIGHT; l++)
+    if (m->splits[l] > 0)
+      fprintf(out, " %d: %llu", l, m->splits[l]);
+  fprintf(out, "\n  sampled lookups (ns):");
+  for (int b = 0; b < METRICS_LATENCY_BUCKETS; b++)
+    if (m->latency[b] > 0)
+      fprintf(out, " <%llu: %llu", 1ull << b, m->latency[b]);
+  fprintf(out, "\n");
+}
+
+#else
+
+#define METRIC_ADD(counter, n) ((void)0)
+#define METRIC_INC(counter) ((void)0)
+#define METRIC_TRACE(event, key, value) ((void)0)
+#define METRIC_SPLIT(level, count, key) ((void)0)
+#define METRIC_LOOKUP_BEGIN(sample) ((void)0)
+#define METRIC_LOOKUP_END(sample, key) ((void)0)
+#define METRIC_FLUSH() ((void)0)
+
+#endif
+
+// Node search kernels
+//
+// nodeLowerBound() returns the number of keys smaller than key, which is the
+// slot of key in a leaf. nodeUpperBound() returns the number of keys smaller
+// than or equal to key, which is the child to follow in an inner node.
+// The vector kernels narrow the range with a branchless binary search and
+// then count the last SEARCH_WINDOW keys with one compare. main() picks the
+// kernel from the CPU features before any thread starts; until then the
+// scalar binary search is used.
+
+#define SEARCH_WINDOW 8
+
+typedef enum {
+  SEARCH_LINEAR,
+  SEARCH_BINARY,
+  SEARCH_SSE4,
+  SEARCH_AVX2,
+  SEARCH_KERNEL_COUNT
+} search_kernel;
+
+const char *search_kernel_names[SEARCH_KERNEL_COUNT] = {
+  "linear", "binary", "sse4", "avx2"
+};
+
+int lowerBoundLinear(const int *keys, int n, int key) {
+  int i = 0;
+  while (i < n && keys[i] < key)
+    i++;
+  METRIC_ADD(key_comparisons, i < n ? i + 1 : i);
+  return i;
+}
+
+int lowerBoundBinary(const int *keys, int n, int key) {
+  const int *base = keys;
+  int len = n;
+  if (len == 0)
+    return 0;
+  while (len > 1) {
+    int half = len / 2;
+    METRIC_INC(key_comparisons);
+    base = base[half] < key ? base + half : base;
+    len -= half;
+  }
+  METRIC_INC(key_comparisons);
+  return (int)(base - keys) + (*base < key);
+}
+
+// Narrow to a window of SEARCH_WINDOW keys that ends inside the array,
+// the keys in front of the window are all smaller than key
+const int *searchWindow(const int *keys, int n, int key) {
+  const int *base = keys;
+  int len = n;
+  while (len > SEARCH_WINDOW) {
+    int half = len / 2;
+    METRIC_INC(key_comparisons);
+    base = base[half] < key ? base + half : base;
+    len -= half;
+  }
+  // counted once per key of the window compare that follows
+  METRIC_ADD(key_comparisons, SEARCH_WINDOW);
+  if (base + SEARCH_WINDOW > keys + n)
+    base = keys + n - SEARCH_WINDOW;
+  return base;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+__attribute__((target("sse4.2,popcnt")))
+int lowerBoundSse4(const int *keys, int n, int key) {
+  if (n < SEARCH_WINDOW)
+    return lowerBoundBinary(keys, n, key);
+  const int *base = searchWindow(keys, n, key);
+  __m128i needle = _mm_set1_epi32(key);
+  __m128i lo = _mm_cmpgt_epi32(needle, _mm_loadu_si128((const __m128i *)base));
+  __m128i hi = _mm_cmpgt_epi32(needle, _mm_loadu_si128((const __m128i *)(base + 4)));
+  int mask = _mm_movemask_ps(_mm_castsi128_ps(lo)) |
+             (_mm_movemask_ps(_mm_castsi128_ps(hi)) << 4);
+  return (int)(base - keys) + __builtin_popcount(mask);
+}
+
+__attribute__((target("avx2,popcnt")))
+int lowerBoundAvx2(const int *keys, int n, int key) {
+  if (n < SEARCH_WINDOW)
+    return lowerBoundBinary(keys, n, key);
+  const int *base = searchWindow(keys, n, key);
+  __m256i less = _mm256_cmpgt_epi32(_mm256_set1_epi32(key),
+                                    _mm256_loadu_si256((const __m256i *)base));
+  int mask = _mm256_movemask_ps(_mm256_castsi256_ps(less));
+  return (int)(base - keys) + __builtin_popcount(mask);
+}
+
+bool nodeSearchSupported(search_kernel kernel) {
+  __builtin_cpu_init();
+  switch (kernel) {
+  case SEARCH_SSE4:
+    return __builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("popcnt");
+  case SEARCH_AVX2:
+    return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt");
+  default:
+    return kernel >= 0 && kernel < SEARCH_KERNEL_COUNT;
+  }
+}
+#else
+bool nodeSearchSupported(search_kernel kernel) {
+  return kernel == SEARCH_LINEAR || kernel == SEARCH_BINARY;
+}
+#endif
+
+int (*nodeLowerBound)(const int *keys, int n, int key) = lowerBoundBinary;
+search_kernel node_search_kernel = SEARCH_BINARY;
+
+// Returns false and keeps the current kernel if the CPU lacks support
+bool setNodeSearchKernel(search_kernel kernel) {
+  if (!nodeSearchSupported(kernel))
+    return false;
+  switch (kernel) {
+  case SEARCH_LINEAR:
+    nodeLowerBound = lowerBoundLinear;
+    break;
+#if defined(__x86_64__) || defined(__i386__)
+  case SEARCH_SSE4:
+    nodeLowerBound = lowerBoundSse4;
+    break;
+  case SEARCH_AVX2:
+    nodeLowerBound = lowerBoundAvx2;
+    break;
+#endif
+  default:
+    nodeLowerBound = lowerBoundBinary;
+    break;
+  }
+  node_search_kernel = kernel;
+  return true;
+}
+
+// Best kernel for this CPU, the scalar binary search is always available
+search_kernel bestNodeSearchKernel(void) {
+  if (nodeSearchSupported(SEARCH_AVX2))
+    return SEARCH_AVX2;
+  if (nodeSearchSupported(SEARCH_SSE4))
+    return SEARCH_SSE4;
+  return SEARCH_BINARY;
+}
+
+int nodeUpperBound(const int *keys, int n, int key) {
+  if (key == INT_MAX)
+    return n;
+  return nodeLowerBound(keys, n, key + 1);
+}
+
+// Tree memory
+//
+// Nodes, records and postings arrays are carved out of large arena blocks
+// that belong to the tree. Each object size has a slab with a free list so
+// freed objects are reused. Blocks double in size, so releasing a whole tree costs
+// a handful of free() calls no matter how many objects it holds.
+//
+// Every tree has its own tree_memory, zeroed before the first insert, and
+// the caller hands it to each function that changes the tree next to the
+// root. destroyTree() releases that tree and no other.
+
+#define ARENA_FIRST_BLOCK (64 * 1024)
+#define ARENA_MAX_BLOCK (64 * 1024 * 1024)
+
+typedef struct arena_block {
+  struct arena_block *next;
+  size_t size;
+  size_t used;
+} arena_block;
+
+typedef struct slab {
+  size_t object_size;
+  size_t align;
+  void *free_list;
+} slab;
+
+struct tree_memory {
+  arena_block *blocks;
+  size_t next_block_size;
+  slab nodes;
+  slab records;
+  slab postings[POSTINGS_CLASSES]; // one per array capacity
+  slab str_nodes;
+  void *scratch; // split buffers, see splitScratch
+  size_t scratch_size;
+  int *tombstones; // keys of this tree marked by deleteLazy, see compactTombstones
+  int tombstone_count;
+  int tombstone_capacity;
+  unsigned long long system_allocations; // malloc calls made
+  unsigned long long object_allocations; // objects handed out
+  unsigned long long bytes_reserved;
+};
+
+void *arenaAlloc(tree_memory *mem, size_t size, size_t align) {
+  arena_block *b = mem->blocks;
+  size_t offset;
+
+  if (b != NULL) {
+    offset = (b->used + align - 1) & ~(align - 1);
+    if (offset + size <= b->size) {
+      b->used = offset + size;
+      return (char *)b + offset;
+    }
+  }
+
+  size_t block_size = mem->next_block_size ? mem->next_block_size : ARENA_FIRST_BLOCK;
+  while (block_size < CACHE_LINE_SIZE + size + align)
+    block_size *= 2;
+  b = aligned_alloc(CACHE_LINE_SIZE, block_size);
+  if (b == NULL) {
+    perror("Arena block.");
+    exit(EXIT_FAILURE);
+  }
+  b->next = mem->blocks;
+  b->size = block_size;
+  b->used = CACHE_LINE_SIZE; // keep the header on its own line
+  mem->blocks = b;
+  mem->system_allocations++;
+  METRIC_INC(system_allocations);
+  mem->bytes_reserved += block_size;
+  if (block_size < ARENA_MAX_BLOCK)
+    mem->next_block_size = block_size * 2;
+
+  offset = (b->used + align - 1) & ~(align - 1);
+  b->used = offset + size;
+  return (char *)b + offset;
+}
+
+// Objects of a slab must be at least pointer sized for the free list
+void *slabAlloc(tree_memory *mem, slab *s, size_t object_size, size_t align) {
+  void *object;
+  if (s->object_size != object_size) {
+    // size changed (e.g. a new order), old free objects no longer fit
+    s->object_size = object_size;
+    s->align = align;
+    s->free_list = NULL;
+  }
+  mem->object_allocations++;
+  METRIC_INC(allocations);
+  if (s->free_list != NULL) {
+    object = s->free_list;
+    s->free_list = *(void **)object;
+    return object;
+  }
+  return arenaAlloc(mem, object_size, align);
+}
+
+void slabFree(slab *s, void *object) {
+  *(void **)object = s->free_list;
+  s->free_list = object;
+}
+
+// Scratch area shared by the split functions: order + 1 pointers followed by
+// order keys. Splits finish with it before recursing into the parent.
+void splitScratch(tree_memory *mem, int **keys, void ***pointers) {
+  size_t pointer_bytes = (order + 1) * sizeof(void *);
+  size_t size = pointer_bytes + order * sizeof(int);
+  if (mem->scratch_size < size) {
+    free(mem->scratch);
+    mem->scratch = malloc(size);
+    if (mem->scratch == NULL) {
+      perror("Split scratch area.");
+      exit(EXIT_FAILURE);
     }
-    c->next = new_node;
-    new_node->next = NULL;
+    mem->scratch_size = size;
+    mem->system_allocations++;
   }
+  *pointers = mem->scratch;
+  *keys = (int *)((char *)mem->scratch + pointer_bytes);
 }
 
-// Dequeue
-node *dequeue(void) {
-  node *n = queue;
-  queue = queue->next;
-  n->next = NULL;
-  return n;
+// Release every node, record and postings array of the tree at once
+void destroyTree(tree_memory *mem) {
+  arena_block *b = mem->blocks;
+  while (b != NULL) {
+    arena_block *next = b->next;
+    free(b);
+    b = next;
+  }
+  free(mem->scratch);
+  free(mem->tombstones);
+  memset(mem, 0, sizeof(*mem));
+}
+
+// Postings
+//
+// Arrays double when full. The outgrown array goes back to the slab of its
+// capacity, where the next key to reach that size picks it up. An append
+// always goes to the end and costs amortized O(1). The CSV is already in
+// score order, so the rows normally stay sorted as they come; when one
+// arrives out of order, postingsSort() sorts the array once, the next time
+// a reader needs the order.
+
+int postingsClass(int capacity) {
+  int c = 0;
+  while ((POSTINGS_FIRST_CAPACITY << c) < capacity)
+    c++;
+  return c;
+}
+
+// Append a row at the end of the array
+CSVRecord *postingsAppend(tree_memory *mem, postings *p, const CSVRecord *row) {
+  if (p->count == p->capacity) {
+    int capacity = p->capacity ? p->capacity * 2 : POSTINGS_FIRST_CAPACITY;
+    int c = postingsClass(capacity);
+    if (c >= POSTINGS_CLASSES) {
+      fprintf(stderr, "Postings array: more than %d rows for one key.\n", p->count);
+      exit(EXIT_FAILURE);
+    }
+    CSVRecord *rows = slabAlloc(mem, &mem->postings[c],
+                                capacity * sizeof(CSVRecord), _Alignof(CSVRecord));
+    if (p->count > 0) {
+      memcpy(rows, p->rows, p->count * sizeof(CSVRecord));
+      slabFree(&mem->postings[postingsClass(p->capacity)], p->rows);
+    }
+    p->rows = rows;
+    p->capacity = capacity;
+  }
+  if (p->sorted == p->count &&
+      (p->count == 0 || p->rows[p->count - 1].score >= row->score))
+    p->sorted++;
+  p->rows[p->count] = *row;
+  return &p->rows[p->count++];
+}
+
+// Stable merge of the runs src[lo .. mid) and src[mid .. hi) into dst,
+// highest score first
+void postingsMerge(const CSVRecord *src, int lo, int mid, int hi, CSVRecord *dst) {
+  int i = lo, j = mid, k = lo;
+  while (i < mid && j < hi)
+    dst[k++] = src[j].score > src[i].score ? src[j++] : src[i++];
+  while (i < mid)
+    dst[k++] = src[i++];
+  while (j < hi)
+    dst[k++] = src[j++];
+}
+
+// Sort the rows by descending score, rows with equal scores stay in
+// arrival order. Only the rows after the sorted prefix are merge sorted,
+// then merged with the prefix, O(n log n) once instead of a shift per
+// append.
+void postingsSort(postings *p) {
+  if (p->sorted == p->count)
+    return;
+  int n = p->count, sorted = p->sorted;
+  CSVRecord *buffer = malloc(n * sizeof(CSVRecord));
+  if (buffer == NULL) {
+    perror("Postings sort buffer.");
+    exit(EXIT_FAILURE);
+  }
+  CSVRecord *src = p->rows, *dst = buffer;
+  for (int width = 1; width < n - sorted; width *= 2) {
+    for (int lo = sorted; lo < n; lo += 2 * width) {
+      int mid = lo + width < n ? lo + width : n;
+      int hi = lo + 2 * width < n ? lo + 2 * width : n;
+      postingsMerge(src, lo, mid, hi, dst);
+    }
+    CSVRecord *swap = src;
+    src = dst;
+    dst = swap;
+  }
+  // the tail is in src, the prefix still in p->rows
+  if (src == p->rows) {
+    postingsMerge(p->rows, 0, sorted, n, buffer);
+    memcpy(p->rows, buffer, n * sizeof(CSVRecord));
+  } else {
+    memcpy(buffer, p->rows, sorted * sizeof(CSVRecord));
+    postingsMerge(buffer, 0, sorted, n, p->rows);
+  }
+  free(buffer);
+  p->sorted = n;
+}
+
+// Give the array back to its slab and leave p empty
+void postingsFree(tree_memory *mem, postings *p) {
+  if (p->capacity > 0)
+    slabFree(&mem->postings[postingsClass(p->capacity)], p->rows);
+  memset(p, 0, sizeof(*p));
+}
+
+// Row at rank (1 is the highest score), NULL when out of range
+const CSVRecord *postingsRank(postings *p, int rank) {
+  if (rank < 1 || rank > p->count)
+    return NULL;
+  postingsSort(p);
+  return &p->rows[rank - 1];
 }
 
 // Print the leaves
@@ -143,58 +714,58 @@ int height(node *const root) {
   return h;
 }
 
-// Get path to root
-int pathToLeaves(node *const root, node *child) {
-  int length = 0;
-  node *c = child;
-  while (c != root) {
-    c = c->parent;
-    length++;
-  }
-  return length;
-}
-
-// Print the tree
+// Print the tree, one level per line
 void printTree(node *const root) {
-  node *n = NULL;
-  int i = 0;
-  int rank = 0;
-  int new_rank = 0;
+  node **level, **next_level;
+  int level_count, next_count, i, j;
 
   if (root == NULL) {
     printf("Empty tree.\n");
     return;
   }
-  queue = NULL;
-  enqueue(root);
-  while (queue != NULL) {
-    n = dequeue();
-    if (n->parent != NULL && n == n->parent->pointers[0]) {
-      new_rank = pathToLeaves(root, n);
-      if (new_rank != rank) {
-        rank = new_rank;
-        printf("\n");
-      }
+  level = malloc(sizeof(node *));
+  if (level == NULL) {
+    perror("Print level array.");
+    exit(EXIT_FAILURE);
+  }
+  level[0] = root;
+  level_count = 1;
+  while (level_count > 0) {
+    next_count = 0;
+    for (i = 0; i < level_count; i++)
+      if (!level[i]->is_leaf)
+        next_count += level[i]->num_keys + 1;
+    next_level = next_count > 0 ? malloc(next_count * sizeof(node *)) : NULL;
+    if (next_count > 0 && next_level == NULL) {
+      perror("Print level array.");
+      exit(EXIT_FAILURE);
     }
-    if (verbose_output)
-      printf("(%p)", n);
-    for (i = 0; i < n->num_keys; i++) {
+    next_count = 0;
+    for (i = 0; i < level_count; i++) {
+      node *n = level[i];
       if (verbose_output)
-        printf("%p ", n->pointers[i]);
-      printf("%d ", n->keys[i]);
-    }
-    if (!n->is_leaf)
-      for (i = 0; i <= n->num_keys; i++)
-        enqueue(n->pointers[i]);
-    if (verbose_output) {
-      if (n->is_leaf)
-        printf("%p ", n->pointers[order - 1]);
-      else
-        printf("%p ", n->pointers[n->num_keys]);
+        printf("(%p)", (void *)n);
+      for (j = 0; j < n->num_keys; j++) {
+        if (verbose_output)
+          printf("%p ", n->pointers[j]);
+        printf("%d ", n->keys[j]);
+      }
+      if (!n->is_leaf)
+        for (j = 0; j <= n->num_keys; j++)
+          next_level[next_count++] = n->pointers[j];
+      if (verbose_output) {
+        if (n->is_leaf)
+          printf("%p ", n->pointers[order - 1]);
+        else
+          printf("%p ", n->pointers[n->num_keys]);
+      }
+      printf("| ");
     }
-    printf("| ");
+    printf("\n");
+    free(level);
+    level = next_level;
+    level_count = next_count;
   }
-  printf("\n");
 }
 
 // Find the node and print it
@@ -204,56 +775,162 @@ void findAndPrint(node *const root, int key, bool verbose) {
   if (r == NULL)
     printf("Record not found under key %d.\n", key);
   else
-    printf("Record at %p -- key %d, value %d.\n",
-         r, key, r->value);
+    printf("Record at %p -- key %d, %d rows.\n",
+         r, key, r->rows.count);
 }
 
-// Find and print the range
+// Find and print the range, streamed through a cursor in batches
 void findAndPrintRange(node *const root, int key_start, int key_end,
              bool verbose) {
-    int i;
-    int array_size = key_end - key_start + 1;
-    int *returned_keys = malloc(array_size * sizeof(int));
-    void **returned_pointers = malloc(array_size * sizeof(void *));
-    int num_found = findRange(root, key_start, key_end, verbose,
-                returned_keys, returned_pointers);
-    if (!num_found)
+    int keys[RANGE_PRINT_BATCH];
+    record *records[RANGE_PRINT_BATCH];
+    range_cursor cursor;
+    long long total = 0;
+    int i, count;
+
+    if (verbose)
+      findLeaf(root, key_start, true);
+    rangeOpen(&cursor, root, key_start, key_end, false);
+    while ((count = rangeNextBatch(&cursor, keys, records, RANGE_PRINT_BATCH)) > 0) {
+      for (i = 0; i < count; i++)
+        printf("Key: %d   Location: %p  Rows: %d\n",
+             keys[i], (void *)records[i], records[i]->rows.count);
+      total += count;
+    }
+    rangeClose(&cursor);
+    if (total == 0)
       printf("None found.\n");
-    else {
-      for (i = 0; i < num_found; i++)
-        printf("Key: %d   Location: %p  Value: %d\n",
-             returned_keys[i],
-             returned_pointers[i],
-             ((record *)
-              returned_pointers[i])
-               ->value);
-  }
 }
 
-// Find the range
+// Find the range, at most max_found entries are written
 int findRange(node *const root, int key_start, int key_end, bool verbose,
-        int returned_keys[], void *returned_pointers[]) {
+        int returned_keys[], void *returned_pointers[], int max_found) {
   int i, num_found;
   num_found = 0;
   node *n = findLeaf(root, key_start, verbose);
   if (n == NULL)
     return 0;
-  for (i = 0; i < n->num_keys && n->keys[i] < key_start; i++)
-    ;
-  if (i == n->num_keys)
-    return 0;
+  // the first key may be in the next leaf when key_start is past the last
+  // key of this one
+  i = nodeLowerBound(n->keys, n->num_keys, key_start);
   while (n != NULL) {
-    for (; i < n->num_keys && n->keys[i] <= key_end; i++) {
+    for (; i < n->num_keys; i++) {
+      if (n->keys[i] > key_end || num_found == max_found)
+        return num_found;
+      if (((record *)n->pointers[i])->deleted)
+        continue;
       returned_keys[num_found] = n->keys[i];
       returned_pointers[num_found] = n->pointers[i];
       num_found++;
     }
     n = n->pointers[order - 1];
+    METRIC_INC(leaf_hops);
     i = 0;
   }
   return num_found;
 }
 
+// Range cursor
+//
+// Streams the records of [key_start, key_end] in batches of the caller's
+// size with a fixed amount of memory. Forward scans follow the leaf links;
+// reverse scans step back through the descent path kept in the cursor,
+// since leaves only link forward. Tombstones are skipped. The tree must
+// not change while a cursor is open.
+
+void rangeOpen(range_cursor *cursor, node *root, int key_start, int key_end,
+               bool reverse) {
+  node *c = root;
+  int i;
+
+  cursor->key_start = key_start;
+  cursor->key_end = key_end;
+  cursor->reverse = reverse;
+  cursor->depth = 0;
+  cursor->leaf = NULL;
+  cursor->slot = 0;
+  if (root == NULL || key_start > key_end)
+    return;
+  // a reverse scan starts at the last key <= key_end
+  int target = reverse ? key_end : key_start;
+  while (!c->is_leaf) {
+    i = nodeUpperBound(c->keys, c->num_keys, target);
+    cursor->path[cursor->depth] = c;
+    cursor->indexes[cursor->depth++] = i;
+    c = c->pointers[i];
+  }
+  cursor->leaf = c;
+  if (reverse)
+    cursor->slot = nodeUpperBound(c->keys, c->num_keys, key_end) - 1;
+  else
+    cursor->slot = nodeLowerBound(c->keys, c->num_keys, key_start);
+}
+
+// Move a reverse cursor to the last entry of the previous leaf, leaf is
+// NULL at the start of the tree
+void rangePreviousLeaf(range_cursor *cursor) {
+  int d = cursor->depth - 1;
+  while (d >= 0 && cursor->indexes[d] == 0)
+    d--;
+  if (d < 0) {
+    cursor->leaf = NULL;
+    return;
+  }
+  node *c = cursor->path[d]->pointers[--cursor->indexes[d]];
+  for (d++; !c->is_leaf; d++) {
+    cursor->path[d] = c;
+    cursor->indexes[d] = c->num_keys;
+    c = c->pointers[c->num_keys];
+  }
+  cursor->leaf = c;
+  cursor->slot = c->num_keys - 1;
+}
+
+// Write up to max entries of the range, in descending key order for a
+// reverse cursor. Returns 0 once the range is exhausted.
+int rangeNextBatch(range_cursor *cursor, int keys[], record *records[], int max) {
+  int found = 0;
+
+  while (found < max && cursor->leaf != NULL) {
+    node *leaf = cursor->leaf;
+    if (cursor->reverse) {
+      if (cursor->slot < 0) {
+        rangePreviousLeaf(cursor);
+        continue;
+      }
+      if (leaf->keys[cursor->slot] < cursor->key_start) {
+        cursor->leaf = NULL;
+        break;
+      }
+    } else {
+      if (cursor->slot >= leaf->num_keys) {
+        cursor->leaf = leaf->pointers[order - 1];
+        cursor->slot = 0;
+        METRIC_INC(leaf_hops);
+        continue;
+      }
+      if (leaf->keys[cursor->slot] > cursor->key_end) {
+        cursor->leaf = NULL;
+        break;
+      }
+    }
+    int slot = cursor->slot;
+    cursor->slot += cursor->reverse ? -1 : 1;
+    record *r = leaf->pointers[slot];
+    if (r->deleted)
+      continue;
+    keys[found] = leaf->keys[slot];
+    records[found++] = r;
+  }
+  return found;
+}
+
+// Stop a scan early; a cursor holds no memory of its own
+void rangeClose(range_cursor *cursor) {
+  cursor->leaf = NULL;
+  cursor->depth = 0;
+}
+
 // Find the leaf
 node *findLeaf(node *const root, int key, bool verbose) {
   if (root == NULL) {
@@ -263,6 +940,7 @@ node *findLeaf(node *const root, int key, bool verbose) {
   }
   int i = 0;
   node *c = root;
+  METRIC_INC(node_visits);
   while (!c->is_leaf) {
     if (verbose) {
       printf("[");
@@ -270,16 +948,11 @@ node *findLeaf(node *const root, int key, bool verbose) {
         printf("%d ", c->keys[i]);
       printf("%d] ", c->keys[i]);
     }
-    i = 0;
-    while (i < c->num_keys) {
-      if (key >= c->keys[i])
-        i++;
-      else
-        break;
-    }
+    i = nodeUpperBound(c->keys, c->num_keys, key);
     if (verbose)
       printf("%d ->\n", i);
     c = (node *)c->pointers[i];
+    METRIC_INC(node_visits);
   }
   if (verbose) {
     printf("Leaf [");
@@ -290,6 +963,24 @@ node *findLeaf(node *const root, int key, bool verbose) {
   return c;
 }
 
+// Find the leaf and record the inner nodes passed on the way down,
+// path[depth - 1] is the parent of the returned leaf
+node *findLeafWithPath(node *const root, int key, node *path[], int *depth) {
+  int i;
+  node *c = root;
+  *depth = 0;
+  if (c == NULL)
+    return NULL;
+  METRIC_INC(node_visits);
+  while (!c->is_leaf) {
+    i = nodeUpperBound(c->keys, c->num_keys, key);
+    path[(*depth)++] = c;
+    c = (node *)c->pointers[i];
+    METRIC_INC(node_visits);
+  }
+  return c;
+}
+
 record *find(node *root, int key, bool verbose, node **leaf_out) {
   if (root == NULL) {
     if (leaf_out != NULL) {
@@ -300,19 +991,93 @@ record *find(node *root, int key, bool verbose, node **leaf_out) {
 
   int i = 0;
   node *leaf = NULL;
+  record *result = NULL;
+  METRIC_LOOKUP_BEGIN(sample);
 
   leaf = findLeaf(root, key, verbose);
 
-  for (i = 0; i < leaf->num_keys; i++)
-    if (leaf->keys[i] == key)
-      break;
+  i = nodeLowerBound(leaf->keys, leaf->num_keys, key);
   if (leaf_out != NULL) {
     *leaf_out = leaf;
   }
-  if (i == leaf->num_keys)
-    return NULL;
-  else
-    return (record *)leaf->pointers[i];
+  if (i < leaf->num_keys && leaf->keys[i] == key &&
+      !((record *)leaf->pointers[i])->deleted)
+    result = (record *)leaf->pointers[i];
+  METRIC_LOOKUP_END(sample, key);
+  return result;
+}
+
+// Batched lookups
+//
+// findBatch() walks up to FIND_BATCH_LANES lookups down the tree together,
+// one level at a time. Each step picks the child of every lane and
+// prefetches it, so by the time a lane reads its child the other lanes
+// have given the miss time to complete, and the misses of one level
+// overlap instead of being paid one after another.
+
+#define FIND_BATCH_LANES 64
+// prefetch at most this many cache lines of a node's keys
+#define FIND_BATCH_KEY_LINES 4
+
+// Start loading the header and the keys of a node block
+void prefetchNode(const node *n) {
+  const char *keys = (const char *)(n->pointers + order);
+  size_t key_bytes = (order - 1) * sizeof(int);
+  __builtin_prefetch(n);
+  for (size_t line = 0; line < key_bytes && line < FIND_BATCH_KEY_LINES * CACHE_LINE_SIZE;
+       line += CACHE_LINE_SIZE)
+    __builtin_prefetch(keys + line);
+}
+
+// out[i] = find(root, keys[i], false, NULL) for every i
+void findBatch(node *root, const int keys[], int n, record *out[]) {
+  node *lanes[FIND_BATCH_LANES];
+  int slots[FIND_BATCH_LANES];
+
+  // nothing to overlap a single lookup with
+  if (n == 1) {
+    out[0] = find(root, keys[0], false, NULL);
+    return;
+  }
+  for (int first = 0; first < n; first += FIND_BATCH_LANES) {
+    int count = n - first < FIND_BATCH_LANES ? n - first : FIND_BATCH_LANES;
+    const int *k = keys + first;
+    record **o = out + first;
+    if (root == NULL) {
+      for (int i = 0; i < count; i++)
+        o[i] = NULL;
+      continue;
+    }
+    for (int i = 0; i < count; i++)
+      lanes[i] = root;
+    METRIC_ADD(lookups, count);
+    METRIC_ADD(node_visits, count);
+    // every leaf is at the same depth, so all lanes reach the leaves together
+    while (!lanes[0]->is_leaf) {
+      for (int i = 0; i < count; i++) {
+        node *c = lanes[i];
+        c = c->pointers[nodeUpperBound(c->keys, c->num_keys, k[i])];
+        prefetchNode(c);
+        lanes[i] = c;
+      }
+      METRIC_ADD(node_visits, count);
+    }
+    // find the slots first and prefetch the records, then check them
+    for (int i = 0; i < count; i++) {
+      node *leaf = lanes[i];
+      int slot = nodeLowerBound(leaf->keys, leaf->num_keys, k[i]);
+      if (slot < leaf->num_keys && leaf->keys[slot] == k[i]) {
+        __builtin_prefetch(leaf->pointers[slot]);
+        slots[i] = slot;
+      } else {
+        slots[i] = -1;
+      }
+    }
+    for (int i = 0; i < count; i++) {
+      record *r = slots[i] < 0 ? NULL : lanes[i]->pointers[slots[i]];
+      o[i] = r != NULL && !r->deleted ? r : NULL;
+    }
+  }
 }
 
 int cut(int length) {
@@ -322,43 +1087,39 @@ int cut(int length) {
     return length / 2 + 1;
 }
 
-record *makeRecord(CSVRecordNode* value) {
-  record *new_record = (record *)malloc(sizeof(record));
-  if (new_record == NULL) {
-    perror("Record creation.");
-    exit(EXIT_FAILURE);
-  } else {
-    new_record->value = value;
-  }
+record *makeRecord(tree_memory *mem) {
+  record *new_record = slabAlloc(mem, &mem->records,
+                                 sizeof(record), _Alignof(record));
+  memset(new_record, 0, sizeof(*new_record));
   return new_record;
 }
 
-node *makeNode(void) {
+// Bytes of one node block, rounded up to whole cache lines
+size_t nodeSize(void) {
+  size_t size = sizeof(node) + order * sizeof(void *) +
+                (order - 1) * sizeof(int);
+  return (size + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE * CACHE_LINE_SIZE;
+}
+
+// Largest order whose node block fits in the given number of cache lines
+int orderForCacheLines(int lines) {
+  size_t budget = lines * CACHE_LINE_SIZE - sizeof(node) + sizeof(int);
+  return (int)(budget / (sizeof(void *) + sizeof(int)));
+}
+
+node *makeNode(tree_memory *mem) {
   node *new_node;
-  new_node = malloc(sizeof(node));
-  if (new_node == NULL) {
-    perror("Node creation.");
-    exit(EXIT_FAILURE);
-  }
-  new_node->keys = malloc((order - 1) * sizeof(int));
-  if (new_node->keys == NULL) {
-    perror("New node keys array.");
-    exit(EXIT_FAILURE);
-  }
-  new_node->pointers = malloc(order * sizeof(void *));
-  if (new_node->pointers == NULL) {
-    perror("New node pointers array.");
-    exit(EXIT_FAILURE);
-  }
+  size_t size = nodeSize();
+  new_node = slabAlloc(mem, &mem->nodes, size, CACHE_LINE_SIZE);
+  memset(new_node, 0, size);
+  new_node->keys = (int *)(new_node->pointers + order);
   new_node->is_leaf = false;
   new_node->num_keys = 0;
-  new_node->parent = NULL;
-  new_node->next = NULL;
   return new_node;
 }
 
-node *makeLeaf(void) {
-  node *leaf = makeNode();
+node *makeLeaf(tree_memory *mem) {
+  node *leaf = makeNode(mem);
   leaf->is_leaf = true;
   return leaf;
 }
@@ -374,9 +1135,7 @@ int getLeftIndex(node *parent, node *left) {
 node *insertIntoLeaf(node *leaf, int key, record *pointer) {
   int i, insertion_point;
 
-  insertion_point = 0;
-  while (insertion_point < leaf->num_keys && leaf->keys[insertion_point] < key)
-    insertion_point++;
+  insertion_point = nodeLowerBound(leaf->keys, leaf->num_keys, key);
 
   for (i = leaf->num_keys; i > insertion_point; i--) {
     leaf->keys[i] = leaf->keys[i - 1];
@@ -388,30 +1147,20 @@ node *insertIntoLeaf(node *leaf, int key, record *pointer) {
   return leaf;
 }
 
-node *insertIntoLeafAfterSplitting(node *root, node *leaf, int key, record *pointer) {
+node *insertIntoLeafAfterSplitting(tree_memory *mem, node *root, node *path[],
+                   int depth, node *leaf, int key, record *pointer) {
   number_of_splits++;
+  METRIC_SPLIT(0, 1, key);
   node *new_leaf;
   int *temp_keys;
   void **temp_pointers;
   int insertion_index, split, new_key, i, j;
 
-  new_leaf = makeLeaf();
+  new_leaf = makeLeaf(mem);
 
-  temp_keys = malloc(order * sizeof(int));
-  if (temp_keys == NULL) {
-    perror("Temporary keys array.");
-    exit(EXIT_FAILURE);
-  }
-
-  temp_pointers = malloc(order * sizeof(void *));
-  if (temp_pointers == NULL) {
-    perror("Temporary pointers array.");
-    exit(EXIT_FAILURE);
-  }
+  splitScratch(mem, &temp_keys, &temp_pointers);
 
-  insertion_index = 0;
-  while (insertion_index < order - 1 && leaf->keys[insertion_index] < key)
-    insertion_index++;
+  insertion_index = nodeLowerBound(leaf->keys, order - 1, key);
 
   for (i = 0, j = 0; i < leaf->num_keys; i++, j++) {
     if (j == insertion_index)
@@ -439,9 +1188,6 @@ node *insertIntoLeafAfterSplitting(node *root, node *leaf, int key, record *poin
     new_leaf->num_keys++;
   }
 
-  free(temp_pointers);
-  free(temp_keys);
-
   new_leaf->pointers[order - 1] = leaf->pointers[order - 1];
   leaf->pointers[order - 1] = new_leaf;
 
@@ -450,10 +1196,9 @@ node *insertIntoLeafAfterSplitting(node *root, node *leaf, int key, record *poin
   for (i = new_leaf->num_keys; i < order - 1; i++)
     new_leaf->pointers[i] = NULL;
 
-  new_leaf->parent = leaf->parent;
   new_key = new_leaf->keys[0];
 
-  return insertIntoParent(root, leaf, new_key, new_leaf);
+  return insertIntoParent(mem, root, path, depth, leaf, new_key, new_leaf);
 }
 
 node *insertIntoNode(node *root, node *n,
@@ -470,22 +1215,17 @@ node *insertIntoNode(node *root, node *n,
   return root;
 }
 
-node *insertIntoNodeAfterSplitting(node *root, node *old_node, int left_index,
+node *insertIntoNodeAfterSplitting(tree_memory *mem, node *root, node *path[],
+                   int depth, node *old_node, int left_index,
                    int key, node *right) {
   number_of_splits++;
+  METRIC_SPLIT(height(old_node), 1, key);
   int i, j, split, k_prime;
-  node *new_node, *child;
+  node *new_node;
   int *temp_keys;
-  node **temp_pointers;
+  void **temp_pointers;
 
-  temp_pointers = malloc((order + 1) * sizeof(node *));
-  if (temp_pointers == NULL) {
-    exit(EXIT_FAILURE);
-  }
-  temp_keys = malloc(order * sizeof(int));
-  if (temp_keys == NULL) {
-    exit(EXIT_FAILURE);
-  }
+  splitScratch(mem, &temp_keys, &temp_pointers);
 
   for (i = 0, j = 0; i < old_node->num_keys + 1; i++, j++) {
     if (j == left_index + 1)
@@ -503,7 +1243,7 @@ node *insertIntoNodeAfterSplitting(node *root, node *old_node, int left_index,
   temp_keys[left_index] = key;
 
   split = cut(order);
-  new_node = makeNode();
+  new_node = makeNode(mem);
   old_node->num_keys = 0;
   for (i = 0; i < split - 1; i++) {
     old_node->pointers[i] = temp_pointers[i];
@@ -518,340 +1258,7624 @@ node *insertIntoNodeAfterSplitting(node *root, node *old_node, int left_index,
     new_node->num_keys++;
   }
   new_node->pointers[j] = temp_pointers[i];
-  free(temp_pointers);
-  free(temp_keys);
-  new_node->parent = old_node->parent;
-  for (i = 0; i <= new_node->num_keys; i++) {
-    child = new_node->pointers[i];
-    child->parent = new_node;
-  }
 
-  return insertIntoParent(root, old_node, k_prime, new_node);
+  return insertIntoParent(mem, root, path, depth, old_node, k_prime, new_node);
 }
 
-node *insertIntoParent(node *root, node *left, int key, node *right) {
+// path[0 .. depth - 1] are the ancestors of left, nearest last
+node *insertIntoParent(tree_memory *mem, node *root, node *path[], int depth,
+                   node *left, int key, node *right) {
   int left_index;
   node *parent;
 
-  parent = left->parent;
+  if (depth == 0)
+    return insertIntoNewRoot(mem, left, key, right);
 
-  if (parent == NULL)
-    return insertIntoNewRoot(left, key, right);
+  parent = path[depth - 1];
 
   left_index = getLeftIndex(parent, left);
 
   if (parent->num_keys < order - 1)
     return insertIntoNode(root, parent, left_index, key, right);
 
-  return insertIntoNodeAfterSplitting(root, parent, left_index, key, right);
+  return insertIntoNodeAfterSplitting(mem, root, path, depth - 1, parent,
+                                      left_index, key, right);
 }
 
-node *insertIntoNewRoot(node *left, int key, node *right) {
-  node *root = makeNode();
+node *insertIntoNewRoot(tree_memory *mem, node *left, int key, node *right) {
+  node *root = makeNode(mem);
   root->keys[0] = key;
   root->pointers[0] = left;
   root->pointers[1] = right;
   root->num_keys++;
-  root->parent = NULL;
-  left->parent = root;
-  right->parent = root;
   return root;
 }
 
-node *startNewTree(int key, record *pointer) {
-  node *root = makeLeaf();
+node *startNewTree(tree_memory *mem, int key, record *pointer) {
+  node *root = makeLeaf(mem);
   root->keys[0] = key;
   root->pointers[0] = pointer;
   root->pointers[order - 1] = NULL;
-  root->parent = NULL;
   root->num_keys++;
   return root;
 }
 
-node *insert(node *root, int key, CSVRecordNode* value) {
+// Find or create the record of key with a single descent. The record is
+// returned through record_out; a new one has empty postings for the caller
+// to fill in.
+node *upsert(tree_memory *mem, node *root, int key, record **record_out) {
   record *record_pointer = NULL;
   node *leaf = NULL;
+  node *path[MAX_TREE_HEIGHT];
+  int depth, i;
 
-  record_pointer = find(root, key, false, NULL);
-  if (record_pointer != NULL) {
-    record_pointer->value = value;
-    return root;
+  if (root == NULL) {
+    record_pointer = makeRecord(mem);
+    *record_out = record_pointer;
+    return startNewTree(mem, key, record_pointer);
   }
 
-  record_pointer = makeRecord(value);
+  leaf = findLeafWithPath(root, key, path, &depth);
 
-  if (root == NULL)
-    return startNewTree(key, record_pointer);
+  i = nodeLowerBound(leaf->keys, leaf->num_keys, key);
+  if (i < leaf->num_keys && leaf->keys[i] == key) {
+    // a tombstone comes back to life with no rows
+    *record_out = (record *)leaf->pointers[i];
+    (*record_out)->deleted = false;
+    return root;
+  }
 
-  leaf = findLeaf(root, key, false);
+  record_pointer = makeRecord(mem);
+  *record_out = record_pointer;
 
   if (leaf->num_keys < order - 1) {
     leaf = insertIntoLeaf(leaf, key, record_pointer);
     return root;
   }
 
-  return insertIntoLeafAfterSplitting(root, leaf, key, record_pointer);
+  return insertIntoLeafAfterSplitting(mem, root, path, depth, leaf, key,
+                                      record_pointer);
 }
 
+// Insert key and append row to its postings when row is not NULL
+node *insert(tree_memory *mem, node *root, int key, const CSVRecord *row) {
+  record *record_pointer = NULL;
 
-void read_file(){
-    FILE *file = fopen("yok_atlas.csv", "r");
-    if (file == NULL) {
-        perror("Error opening file");
-        return;
-    }
+  root = upsert(mem, root, key, &record_pointer);
+  if (row != NULL)
+    postingsAppend(mem, &record_pointer->rows, row);
+  return root;
+}
 
-    char buffer[512];
-    int line_count = 0;
-    while (fgets(buffer, sizeof(buffer), file) != NULL) {
-        if(line_count != 0){
-            // skip header and process data
+// Batch insertion
+//
+// insertBatch() sorts the batch and fills one leaf at a time: it descends
+// to the leaf of the next key, merges every batch key below the leaf's
+// upper bound into it, and when they do not fit spreads the entries over
+// as many new leaves as needed at once. The separators of those leaves go
+// up in one insert into the parent, which splits into several nodes in the
+// same way when it overflows. A leaf costs one descent and at most one
+// round of splits however many keys land in it.
+
+typedef struct batch_entry {
+  int key;
+  int index; // position in the batch, keeps the rows of a key in order
+} batch_entry;
+
+int compareBatchEntries(const void *a, const void *b) {
+  const batch_entry *x = a, *y = b;
+  if (x->key != y->key)
+    return x->key < y->key ? -1 : 1;
+  return x->index - y->index;
+}
 
-            CSVRecord record; // initialize record
-            char *line = buffer;
+// Split buffers of one insertBatch() call, allocated once for the call.
+// The separators and new nodes a level hands to its parent alternate
+// between two sets, so a level reads one set while it fills the other.
+typedef struct batch_scratch {
+  node **new_nodes[2];
+  void **temp_pointers;
+  int *separators[2];
+  int *temp_keys;
+  void *block;
+} batch_scratch;
 
-            char *token = strsep(&line, ",");
-            if (token != NULL) {
-                record.id = atoi(token);
-            }
+node *insertIntoParentBulk(tree_memory *mem, batch_scratch *scratch, node *root,
+                           node *path[], int depth, node *left, const int keys[],
+                           node *const rights[], int count);
 
-            token = strsep(&line, ",");
-            if (token != NULL) {
-                strncpy(record.university, token, MAX_KEY_LEN);
-            }
+void *batchAlloc(size_t size) {
+  void *p = malloc(size);
+  if (p == NULL) {
+    perror("Batch insert.");
+    exit(EXIT_FAILURE);
+  }
+  return p;
+}
 
-            token = strsep(&line, ",");
-            if (token != NULL) {
-                strncpy(record.department, token, MAX_KEY_LEN);
-            }
+// A batch of n keys makes at most 1 + n / (order - 1) new leaves, rounded
+// up, and no level above gets more new children than that
+void batchScratchInit(batch_scratch *scratch, int n) {
+  size_t capacity = order + 1 + (n + order - 2) / (order - 1);
+  scratch->block = batchAlloc(capacity * (3 * sizeof(void *) + 3 * sizeof(int)));
+  scratch->new_nodes[0] = scratch->block;
+  scratch->new_nodes[1] = scratch->new_nodes[0] + capacity;
+  scratch->temp_pointers = (void **)(scratch->new_nodes[1] + capacity);
+  scratch->separators[0] = (int *)(scratch->temp_pointers + capacity);
+  scratch->separators[1] = scratch->separators[0] + capacity;
+  scratch->temp_keys = scratch->separators[1] + capacity;
+}
 
-            token = strsep(&line, ",");
-            if (token != NULL) {
-                record.score = atof(token);
-            }
+// Insert count keys and right children after the child at left_index of
+// n, splitting n into as many nodes as needed. path[0 .. depth - 1] are
+// the ancestors of n, nearest last.
+node *insertIntoNodeBulk(tree_memory *mem, batch_scratch *scratch, node *root,
+                         node *path[], int depth, node *n, int left_index,
+                         const int keys[], node *const rights[], int count) {
+  int total = n->num_keys + count;
+  int i, j;
+
+  if (total <= order - 1) {
+    memmove(n->keys + left_index + count, n->keys + left_index,
+            (n->num_keys - left_index) * sizeof(int));
+    memmove(n->pointers + left_index + 1 + count, n->pointers + left_index + 1,
+            (n->num_keys - left_index) * sizeof(void *));
+    memcpy(n->keys + left_index, keys, count * sizeof(int));
+    memcpy(n->pointers + left_index + 1, rights, count * sizeof(void *));
+    n->num_keys = total;
+    return root;
+  }
 
-            // add record to records array
-            records = (CSVRecord *)realloc(records, sizeof(CSVRecord) * (csv_record_count + 1));
-            if (records == NULL) {
-                perror("Error reallocating memory");
-                fclose(file);
-                return;
-            }
+  int *temp_keys = scratch->temp_keys;
+  void **temp_pointers = scratch->temp_pointers;
+  memcpy(temp_keys, n->keys, left_index * sizeof(int));
+  memcpy(temp_keys + left_index, keys, count * sizeof(int));
+  memcpy(temp_keys + left_index + count, n->keys + left_index,
+         (n->num_keys - left_index) * sizeof(int));
+  memcpy(temp_pointers, n->pointers, (left_index + 1) * sizeof(void *));
+  memcpy(temp_pointers + left_index + 1, rights, count * sizeof(void *));
+  memcpy(temp_pointers + left_index + 1 + count, n->pointers + left_index + 1,
+         (n->num_keys - left_index) * sizeof(void *));
+
+  // spread total + 1 children over nodes of at most order children, the
+  // key between two nodes moves up
+  int nodes = (total + 1 + order - 1) / order;
+  int set = keys == scratch->separators[0];
+  int *separators = scratch->separators[set];
+  node **new_nodes = scratch->new_nodes[set];
+  int child = 0;
+  for (i = 0; i < nodes; i++) {
+    int children = (total + 1) / nodes + (i < (total + 1) % nodes);
+    node *target = i == 0 ? n : makeNode(mem);
+    for (j = 0; j < children; j++) {
+      target->pointers[j] = temp_pointers[child + j];
+      if (j < children - 1)
+        target->keys[j] = temp_keys[child + j];
+    }
+    target->num_keys = children - 1;
+    for (j = children; j < order; j++)
+      target->pointers[j] = NULL;
+    if (i > 0) {
+      separators[i - 1] = temp_keys[child - 1];
+      new_nodes[i - 1] = target;
+    }
+    child += children;
+  }
+  number_of_splits += nodes - 1;
+  METRIC_SPLIT(height(n), nodes - 1, keys[0]);
+
+  return insertIntoParentBulk(mem, scratch, root, path, depth, n, separators,
+                              new_nodes, nodes - 1);
+}
+
+// Like insertIntoParent() for count new right siblings of left
+node *insertIntoParentBulk(tree_memory *mem, batch_scratch *scratch, node *root,
+                           node *path[], int depth, node *left, const int keys[],
+                           node *const rights[], int count) {
+  if (depth == 0) {
+    // left was the root, it becomes the only child of a new one
+    node *new_root = makeNode(mem);
+    new_root->pointers[0] = left;
+    return insertIntoNodeBulk(mem, scratch, new_root, path, 0, new_root, 0, keys,
+                              rights, count);
+  }
+  node *parent = path[depth - 1];
+  return insertIntoNodeBulk(mem, scratch, root, path, depth - 1, parent,
+                            getLeftIndex(parent, left), keys, rights, count);
+}
 
-            // Ensure strings are null-terminated
-            record.university[MAX_KEY_LEN - 1] = '\0';
-            record.department[MAX_KEY_LEN - 1] = '\0';
+// Insert keys[0 .. n) and append rows[i] to the postings of keys[i] when
+// rows and rows[i] are not NULL, as n calls to insert() would
+node *insertBatch(tree_memory *mem, node *root, const int keys[],
+                  const CSVRecord *const rows[], int n) {
+  node *path[MAX_TREE_HEIGHT + 1]; // path[depth] is the leaf
+  long long upper[MAX_TREE_HEIGHT + 1]; // keys of the subtree of path[d] are below upper[d]
+  int depth = 0, level = 0, i;
+
+  if (n == 0)
+    return root;
+  batch_entry *batch = batchAlloc(n * sizeof(batch_entry));
+  for (i = 0; i < n; i++)
+    batch[i] = (batch_entry){keys[i], i};
+  qsort(batch, n, sizeof(batch_entry), compareBatchEntries);
 
-            records[csv_record_count] = record;
-            csv_record_count++;
+  if (root == NULL)
+    root = makeLeaf(mem);
+  int *merged_keys = batchAlloc((order - 1 + n) * sizeof(int));
+  record **merged = batchAlloc((order - 1 + n) * sizeof(record *));
+  batch_scratch scratch;
+  batchScratchInit(&scratch, n);
+
+  int next = 0;
+  path[0] = root;
+  upper[0] = (long long)INT_MAX + 1;
+  while (next < n) {
+    // keys come in order, so the next leaf is found by climbing only as
+    // far as the last path covers the key and descending from there
+    while (level > 0 && batch[next].key >= upper[level])
+      level--;
+    node *leaf = path[level];
+    for (depth = level; !leaf->is_leaf; depth++) {
+      i = nodeUpperBound(leaf->keys, leaf->num_keys, batch[next].key);
+      upper[depth + 1] = i < leaf->num_keys ? leaf->keys[i] : upper[depth];
+      leaf = leaf->pointers[i];
+      path[depth + 1] = leaf;
+    }
+    level = depth;
+
+    // merge the leaf with every batch key below the bound
+    int count = 0, old = 0;
+    for (; next < n && batch[next].key < upper[depth]; next++) {
+      int key = batch[next].key;
+      if (count == 0 || merged_keys[count - 1] != key) {
+        while (old < leaf->num_keys && leaf->keys[old] < key) {
+          merged_keys[count] = leaf->keys[old];
+          merged[count++] = leaf->pointers[old++];
+        }
+        merged_keys[count] = key;
+        if (old < leaf->num_keys && leaf->keys[old] == key) {
+          // a tombstone comes back to life with no rows, as in upsert()
+          merged[count] = leaf->pointers[old++];
+          merged[count]->deleted = false;
+        } else {
+          merged[count] = makeRecord(mem);
         }
+        count++;
+      }
+      const CSVRecord *row = rows != NULL ? rows[batch[next].index] : NULL;
+      if (row != NULL)
+        postingsAppend(mem, &merged[count - 1]->rows, row);
+    }
+    for (; old < leaf->num_keys; old++) {
+      merged_keys[count] = leaf->keys[old];
+      merged[count++] = leaf->pointers[old];
+    }
 
-        line_count++;
+    // spread the entries over as few leaves as hold them
+    int leaves = (count + order - 2) / (order - 1);
+    int *separators = scratch.separators[0];
+    node **new_leaves = scratch.new_nodes[0];
+    node *target = leaf, *after = leaf->pointers[order - 1];
+    int entry = 0;
+    for (int l = 0; l < leaves; l++) {
+      int size = count / leaves + (l < count % leaves);
+      if (l > 0) {
+        node *new_leaf = makeLeaf(mem);
+        target->pointers[order - 1] = new_leaf;
+        target = new_leaf;
+        separators[l - 1] = merged_keys[entry];
+        new_leaves[l - 1] = new_leaf;
+      }
+      memcpy(target->keys, merged_keys + entry, size * sizeof(int));
+      memcpy(target->pointers, merged + entry, size * sizeof(void *));
+      for (i = size; i < order - 1; i++)
+        target->pointers[i] = NULL;
+      target->num_keys = size;
+      entry += size;
     }
+    target->pointers[order - 1] = after;
+    if (leaves > 1) {
+      // the splits change the nodes above, start the next leaf at the root
+      number_of_splits += leaves - 1;
+      METRIC_SPLIT(0, leaves - 1, separators[0]);
+      root = insertIntoParentBulk(mem, &scratch, root, path, depth, leaf,
+                                  separators, new_leaves, leaves - 1);
+      path[0] = root;
+      level = 0;
+    }
+  }
 
-    fclose(file);
+  free(scratch.block);
+  free(batch);
+  free(merged_keys);
+  free(merged);
+  return root;
 }
 
+// Deletion
+//
+// delete() removes a key at once. A node left with too few entries borrows
+// one from a sibling, or is merged into it when both fit in one node, and
+// the parent loses an entry in turn. Emptied nodes, records and their
+// postings go back to their slabs.
+//
+// deleteLazy() only marks the record as a tombstone, which find() and
+// findRange() skip, and queues the key in the tree_memory of that tree.
+// compactTombstones() does the real deletes later in batches, when the
+// caller has time for them. Each tree compacts only its own keys, and
+// destroyTree() drops the queue with the tree.
+
+void freeNode(tree_memory *mem, node *n) {
+  slabFree(&mem->nodes, n);
+}
 
-uint32_t DJB2_hash(const uint8_t *str)
-{
-    uint32_t hash = 5381;
-    uint8_t c;
-    while ((c = *str++))
-        hash = ((hash << 5) + hash) + c; /* hash * 33 + c */
-    return hash;
+void freeRecord(tree_memory *mem, record *r) {
+  postingsFree(mem, &r->rows);
+  slabFree(&mem->records, r);
 }
 
+// Index of the left sibling of n in parent, -1 when n is the leftmost child
+int getNeighborIndex(node *parent, node *n) {
+  return getLeftIndex(parent, n) - 1;
+}
 
-// B + tree with bulk load 
+node *removeEntryFromNode(node *n, int key, void *pointer) {
+  int i, num_pointers;
 
-typedef struct Node_bulkload {
-    bool is_leaf;
-    int num_keys;
-    int keys[ORDER - 1];
-    struct Node* children[ORDER];   // Internal: children; Leaf: unused
-    struct Node* next;             // Leaf node linked list
-    void* values[ORDER - 1];       // Leaf only
+  i = 0;
+  while (n->keys[i] != key)
+    i++;
+  for (++i; i < n->num_keys; i++)
+    n->keys[i - 1] = n->keys[i];
 
-     CSVRecordNode* linked_list_node; // Leaf only, used to store CSV records
+  num_pointers = n->is_leaf ? n->num_keys : n->num_keys + 1;
+  i = 0;
+  while (n->pointers[i] != pointer)
+    i++;
+  for (++i; i < num_pointers; i++)
+    n->pointers[i - 1] = n->pointers[i];
+
+  n->num_keys--;
+
+  // clear the freed slots, a leaf keeps its next pointer
+  if (n->is_leaf)
+    for (i = n->num_keys; i < order - 1; i++)
+      n->pointers[i] = NULL;
+  else
+    for (i = n->num_keys + 1; i < order; i++)
+      n->pointers[i] = NULL;
+  return n;
+}
+
+node *adjustRoot(tree_memory *mem, node *root) {
+  node *new_root;
+
+  if (root->num_keys > 0)
+    return root;
+
+  // an empty inner root hands over to its only child
+  if (!root->is_leaf)
+    new_root = root->pointers[0];
+  else
+    new_root = NULL;
+  freeNode(mem, root);
+  return new_root;
+}
+
+// Merge n with its neighbor; the node on the right is emptied into the one
+// on the left and removed from the parent
+node *coalesceNodes(tree_memory *mem, node *root, node *path[], int depth,
+                    node *n, node *neighbor, int neighbor_index, int k_prime) {
+  int i, j, neighbor_insertion_index, n_end;
+  node *tmp;
+
+  if (neighbor_index == -1) {
+    tmp = n;
+    n = neighbor;
+    neighbor = tmp;
+  }
+
+  neighbor_insertion_index = neighbor->num_keys;
+
+  if (!n->is_leaf) {
+    neighbor->keys[neighbor_insertion_index] = k_prime;
+    neighbor->num_keys++;
+    n_end = n->num_keys;
+    for (i = neighbor_insertion_index + 1, j = 0; j < n_end; i++, j++) {
+      neighbor->keys[i] = n->keys[j];
+      neighbor->pointers[i] = n->pointers[j];
+      neighbor->num_keys++;
+      n->num_keys--;
+    }
+    neighbor->pointers[i] = n->pointers[j];
+  } else {
+    for (i = neighbor_insertion_index, j = 0; j < n->num_keys; i++, j++) {
+      neighbor->keys[i] = n->keys[j];
+      neighbor->pointers[i] = n->pointers[j];
+      neighbor->num_keys++;
+    }
+    neighbor->pointers[order - 1] = n->pointers[order - 1];
+  }
+
+  root = deleteEntry(mem, root, path, depth - 1, path[depth - 1], k_prime, n);
+  freeNode(mem, n);
+  return root;
+}
+
+// Move one entry from neighbor into n through the parent key between them
+node *redistributeNodes(node *root, node *parent, node *n, node *neighbor,
+                        int neighbor_index, int k_prime_index, int k_prime) {
+  int i;
+
+  if (neighbor_index != -1) {
+    // neighbor is on the left, its last entry becomes n's first
+    if (!n->is_leaf)
+      n->pointers[n->num_keys + 1] = n->pointers[n->num_keys];
+    for (i = n->num_keys; i > 0; i--) {
+      n->keys[i] = n->keys[i - 1];
+      n->pointers[i] = n->pointers[i - 1];
+    }
+    if (!n->is_leaf) {
+      n->pointers[0] = neighbor->pointers[neighbor->num_keys];
+      neighbor->pointers[neighbor->num_keys] = NULL;
+      n->keys[0] = k_prime;
+      parent->keys[k_prime_index] = neighbor->keys[neighbor->num_keys - 1];
+    } else {
+      n->pointers[0] = neighbor->pointers[neighbor->num_keys - 1];
+      neighbor->pointers[neighbor->num_keys - 1] = NULL;
+      n->keys[0] = neighbor->keys[neighbor->num_keys - 1];
+      parent->keys[k_prime_index] = n->keys[0];
+    }
+  } else {
+    // neighbor is on the right, its first entry becomes n's last
+    if (n->is_leaf) {
+      n->keys[n->num_keys] = neighbor->keys[0];
+      n->pointers[n->num_keys] = neighbor->pointers[0];
+      parent->keys[k_prime_index] = neighbor->keys[1];
+    } else {
+      n->keys[n->num_keys] = k_prime;
+      n->pointers[n->num_keys + 1] = neighbor->pointers[0];
+      parent->keys[k_prime_index] = neighbor->keys[0];
+    }
+    for (i = 0; i < neighbor->num_keys - 1; i++) {
+      neighbor->keys[i] = neighbor->keys[i + 1];
+      neighbor->pointers[i] = neighbor->pointers[i + 1];
+    }
+    if (!n->is_leaf)
+      neighbor->pointers[i] = neighbor->pointers[i + 1];
+    neighbor->pointers[n->is_leaf ? i : i + 1] = NULL;
+  }
+
+  n->num_keys++;
+  neighbor->num_keys--;
+  return root;
+}
+
+// Remove key and pointer from n, then restore the minimum fill.
+// path[0 .. depth - 1] are the ancestors of n, nearest last.
+node *deleteEntry(tree_memory *mem, node *root, node *path[], int depth,
+                  node *n, int key, void *pointer) {
+  int min_keys, neighbor_index, k_prime_index, k_prime, capacity;
+  node *parent, *neighbor;
+
+  n = removeEntryFromNode(n, key, pointer);
+
+  if (n == root)
+    return adjustRoot(mem, root);
+
+  min_keys = n->is_leaf ? cut(order - 1) : cut(order) - 1;
+  if (n->num_keys >= min_keys)
+    return root;
+
+  parent = path[depth - 1];
+  neighbor_index = getNeighborIndex(parent, n);
+  k_prime_index = neighbor_index == -1 ? 0 : neighbor_index;
+  k_prime = parent->keys[k_prime_index];
+  neighbor = neighbor_index == -1 ? parent->pointers[1] :
+                                    parent->pointers[neighbor_index];
+
+  capacity = n->is_leaf ? order : order - 1;
+
+  if (neighbor->num_keys + n->num_keys < capacity)
+    return coalesceNodes(mem, root, path, depth, n, neighbor, neighbor_index,
+                         k_prime);
+  return redistributeNodes(root, parent, n, neighbor, neighbor_index,
+                           k_prime_index, k_prime);
+}
+
+node *delete(tree_memory *mem, node *root, int key) {
+  node *path[MAX_TREE_HEIGHT];
+  int depth, i;
+
+  node *leaf = findLeafWithPath(root, key, path, &depth);
+  if (leaf == NULL)
+    return root;
+  i = nodeLowerBound(leaf->keys, leaf->num_keys, key);
+  if (i == leaf->num_keys || leaf->keys[i] != key)
+    return root;
+
+  record *r = leaf->pointers[i];
+  root = deleteEntry(mem, root, path, depth, leaf, key, r);
+  freeRecord(mem, r);
+  return root;
+}
+
+// Mark key deleted and release its rows. Returns false when the key is not
+// in the tree or already marked.
+bool deleteLazy(tree_memory *mem, node *root, int key) {
+  record *r = find(root, key, false, NULL);
+  if (r == NULL)
+    return false;
+
+  postingsFree(mem, &r->rows);
+  r->deleted = true;
+
+  if (mem->tombstone_count == mem->tombstone_capacity) {
+    int capacity = mem->tombstone_capacity ? mem->tombstone_capacity * 2 : 1024;
+    int *keys = realloc(mem->tombstones, capacity * sizeof(int));
+    if (keys == NULL) {
+      perror("Tombstone queue.");
+      exit(EXIT_FAILURE);
+    }
+    mem->tombstones = keys;
+    mem->tombstone_capacity = capacity;
+    mem->system_allocations++;
+  }
+  mem->tombstones[mem->tombstone_count++] = key;
+  return true;
+}
+
+// Delete up to budget queued tombstones, newest first. Keys that were
+// inserted again after being marked are left alone.
+node *compactTombstones(tree_memory *mem, node *root, int budget) {
+  while (budget-- > 0 && mem->tombstone_count > 0) {
+    int key = mem->tombstones[--mem->tombstone_count];
+    node *leaf = findLeaf(root, key, false);
+    if (leaf == NULL)
+      continue;
+    int i = nodeLowerBound(leaf->keys, leaf->num_keys, key);
+    if (i < leaf->num_keys && leaf->keys[i] == key &&
+        ((record *)leaf->pointers[i])->deleted)
+      root = delete(mem, root, key);
+  }
+  return root;
+}
+
+
+uint32_t DJB2_hash(const uint8_t *str)
+{
+    uint32_t hash = 5381;
+    uint8_t c;
+    while ((c = *str++))
+        hash = ((hash << 5) + hash) + c; /* hash * 33 + c */
+    return hash;
+}
+
+// Same hash over the first len bytes, for strings that are not terminated
+uint32_t DJB2_hash_n(const uint8_t *str, size_t len)
+{
+    uint32_t hash = 5381;
+    for (size_t i = 0; i < len; i++)
+        hash = ((hash << 5) + hash) + str[i];
+    return hash;
+}
+
+
+// CSV ingestion
+//
+// The file is mapped read-only and parsed in place. Text fields come back
+// as views into the mapping and numbers are parsed straight from it, so
+// rows can be streamed into a tree without building the records array.
+
+#define CSV_PATH "yok_atlas.csv"
+// consumed input is handed back to the kernel in steps of this size
+#define CSV_DROP_CHUNK (64 * 1024 * 1024)
+
+typedef struct string_view {
+    const char *data;
+    size_t len;
+} string_view;
+
+typedef struct csv_row {
+    int id;
+    string_view university;
+    string_view department;
+    float score;
+} csv_row;
+
+typedef struct csv_file {
+    const char *data;
+    size_t size;
+} csv_file;
+
+typedef struct csv_cursor {
+    const char *pos;
+    const char *end;
+    const char *dropped; // input before this was released
+    bool drop_consumed;
+} csv_cursor;
+
+bool csvOpen(csv_file *file, const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror("Error opening file");
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        perror("Error reading file size");
+        close(fd);
+        return false;
+    }
+    file->size = (size_t)st.st_size;
+    file->data = NULL;
+    if (file->size > 0) {
+        void *data = mmap(NULL, file->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            perror("Error mapping file");
+            close(fd);
+            return false;
+        }
+        madvise(data, file->size, MADV_SEQUENTIAL);
+        file->data = data;
+    }
+    close(fd);
+    return true;
+}
+
+void csvClose(csv_file *file) {
+    if (file->data != NULL)
+        munmap((void *)file->data, file->size);
+    file->data = NULL;
+    file->size = 0;
+}
+
+// Cursor over the data rows of the file, the header line is skipped
+void csvCursorInit(csv_cursor *cursor, const csv_file *file) {
+    const char *end = file->data + file->size;
+    const char *header_end = file->size ? memchr(file->data, '\n', file->size) : NULL;
+    cursor->pos = header_end ? header_end + 1 : end;
+    cursor->end = end;
+    cursor->dropped = file->data;
+    cursor->drop_consumed = false;
+}
+
+// Release the pages of the rows before limit, keeps resident memory flat
+// when streaming files larger than RAM. The mapping is private and
+// read-only, so views into released pages stay valid: touching them again
+// faults the page back in from the file.
+void csvDropConsumed(csv_cursor *cursor, const char *limit) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    uintptr_t from = (uintptr_t)cursor->dropped & ~(page - 1);
+    uintptr_t to = (uintptr_t)limit & ~(page - 1);
+    if (to - from < CSV_DROP_CHUNK)
+        return;
+    madvise((void *)from, to - from, MADV_DONTNEED);
+    cursor->dropped = (const char *)to;
+}
+
+int parseIntView(string_view v) {
+    size_t i = 0;
+    int sign = 1, value = 0;
+    if (i < v.len && (v.data[i] == '-' || v.data[i] == '+'))
+        sign = v.data[i++] == '-' ? -1 : 1;
+    for (; i < v.len && v.data[i] >= '0' && v.data[i] <= '9'; i++)
+        value = value * 10 + (v.data[i] - '0');
+    return sign * value;
+}
+
+float parseFloatView(string_view v) {
+    size_t i = 0;
+    double sign = 1, value = 0, scale = 1;
+    if (i < v.len && (v.data[i] == '-' || v.data[i] == '+'))
+        sign = v.data[i++] == '-' ? -1 : 1;
+    for (; i < v.len && v.data[i] >= '0' && v.data[i] <= '9'; i++)
+        value = value * 10 + (v.data[i] - '0');
+    if (i < v.len && v.data[i] == '.')
+        for (i++; i < v.len && v.data[i] >= '0' && v.data[i] <= '9'; i++) {
+            scale /= 10;
+            value += (v.data[i] - '0') * scale;
+        }
+    return (float)(sign * value);
+}
+
+// Parse the next row, returns false at the end of the input.
+// Missing fields are left empty.
+bool csvNextRow(csv_cursor *cursor, csv_row *row) {
+    while (cursor->pos < cursor->end) {
+        const char *line = cursor->pos;
+        const char *eol = memchr(line, '\n', cursor->end - line);
+        if (eol == NULL)
+            eol = cursor->end;
+        cursor->pos = eol < cursor->end ? eol + 1 : cursor->end;
+        if (eol > line && eol[-1] == '\r')
+            eol--;
+        if (eol == line)
+            continue;
+
+        string_view fields[4] = {{line, 0}, {eol, 0}, {eol, 0}, {eol, 0}};
+        const char *p = line;
+        for (int f = 0; f < 4 && p <= eol; f++) {
+            const char *comma = f < 3 ? memchr(p, ',', eol - p) : NULL;
+            const char *field_end = comma ? comma : eol;
+            fields[f].data = p;
+            fields[f].len = field_end - p;
+            p = field_end + 1;
+        }
+        row->id = parseIntView(fields[0]);
+        row->university = fields[1];
+        row->department = fields[2];
+        row->score = parseFloatView(fields[3]);
+
+        // the caller is done with the rows before this one, not with this one
+        if (cursor->drop_consumed)
+            csvDropConsumed(cursor, line);
+        return true;
+    }
+    return false;
+}
+
+// Tree key of a row, the same as hashing the stored (truncated) department
+uint32_t csvRowKey(const csv_row *row) {
+    size_t len = row->department.len < MAX_KEY_LEN - 1 ? row->department.len : MAX_KEY_LEN - 1;
+    return DJB2_hash_n((const uint8_t *)row->department.data, len);
+}
+
+void copyView(char *dest, string_view v) {
+    size_t len = v.len < MAX_KEY_LEN - 1 ? v.len : MAX_KEY_LEN - 1;
+    memcpy(dest, v.data, len);
+    dest[len] = '\0';
+}
+
+void csvRowToRecord(const csv_row *row, CSVRecord *out) {
+    out->id = row->id;
+    copyView(out->university, row->university);
+    copyView(out->department, row->department);
+    out->score = row->score;
+}
+
+void postingsAppendRow(tree_memory *mem, postings *p, const csv_row *row) {
+    CSVRecord record;
+    csvRowToRecord(row, &record);
+    postingsAppend(mem, p, &record);
+}
+
+// Department keys of every row in file order, count is set to the number
+// of rows. The array grows geometrically.
+uint32_t *csvDepartmentKeys(const csv_file *file, size_t *count) {
+    csv_cursor cursor;
+    csv_row row;
+    size_t capacity = 1024;
+    uint32_t *keys = malloc(capacity * sizeof(uint32_t));
+    if (keys == NULL) {
+        perror("Key array.");
+        exit(EXIT_FAILURE);
+    }
+    *count = 0;
+    csvCursorInit(&cursor, file);
+    while (csvNextRow(&cursor, &row)) {
+        if (*count == capacity) {
+            capacity *= 2;
+            keys = realloc(keys, capacity * sizeof(uint32_t));
+            if (keys == NULL) {
+                perror("Key array.");
+                exit(EXIT_FAILURE);
+            }
+        }
+        keys[(*count)++] = csvRowKey(&row);
+    }
+    return keys;
+}
+
+// Load the whole file into the records array
+void read_file(){
+    csv_file file;
+    if (!csvOpen(&file, CSV_PATH)) {
+        return;
+    }
+
+    csv_cursor cursor;
+    csv_row row;
+    int capacity = 0;
+    csvCursorInit(&cursor, &file);
+    while (csvNextRow(&cursor, &row)) {
+        if (csv_record_count == capacity) {
+            // grow geometrically instead of once per row
+            capacity = capacity ? capacity * 2 : 1024;
+            records = (CSVRecord *)realloc(records, sizeof(CSVRecord) * capacity);
+            if (records == NULL) {
+                perror("Error reallocating memory");
+                csvClose(&file);
+                return;
+            }
+        }
+        csvRowToRecord(&row, &records[csv_record_count]);
+        csv_record_count++;
+    }
+
+    csvClose(&file);
+}
+
+
+// B + tree with bulk load 
+
+// Default fill factor for bulk loaded nodes (fraction of capacity)
+#define BULKLOAD_FILL_FACTOR 1.0
+
+typedef struct Node_bulkload {
+    bool is_leaf;
+    int num_keys;
+    uint32_t keys[ORDER - 1];
+    struct Node_bulkload* children[ORDER];   // Internal: children; Leaf: unused
+    struct Node_bulkload* next;             // Leaf node linked list
+    postings values[ORDER - 1];             // Leaf only, CSV rows per key
 } Node_bulkload;
 
 
-// Create a new node
-Node_bulkload* create_node_bulkload(bool is_leaf) {
-    Node_bulkload* node = (Node_bulkload*)malloc(sizeof(Node_bulkload));
-    node->is_leaf = is_leaf;
-    node->num_keys = 0;
-    node->next = NULL;
-    node->linked_list_node = NULL; // Initialize linked list node to NULL
-    for (int i = 0; i < ORDER; i++) {
-        node->children[i] = NULL;
+// Create a new node
+Node_bulkload* create_node_bulkload(bool is_leaf) {
+    Node_bulkload* node = (Node_bulkload*)malloc(sizeof(Node_bulkload));
+    if (node == NULL) {
+        perror("Bulk load node creation.");
+        exit(EXIT_FAILURE);
+    }
+    METRIC_INC(system_allocations);
+    node->is_leaf = is_leaf;
+    node->num_keys = 0;
+    node->next = NULL;
+    for (int i = 0; i < ORDER; i++) {
+        node->children[i] = NULL;
+    }
+    memset(node->values, 0, sizeof(node->values));
+    return node;
+}
+
+// Number of entries to pack per node for the given capacity. Nodes are never
+// filled below half capacity so the result is still a valid B+ tree.
+int bulkload_node_fill(int capacity, double fill_factor) {
+    int min_fill = (capacity + 1) / 2;
+    int fill = (int)(capacity * fill_factor + 0.5);
+    if (fill < min_fill) fill = min_fill;
+    if (fill > capacity) fill = capacity;
+    return fill;
+}
+
+// Bulk load sorted, unique keys bottom-up: pack the keys into leaves, then
+// build separator levels over them until a single root remains
+Node_bulkload* bulk_load(const uint32_t* keys, int count, double fill_factor) {
+    if (count <= 0) return NULL;
+
+    int per_leaf = bulkload_node_fill(ORDER - 1, fill_factor);
+    int level_count = (count + per_leaf - 1) / per_leaf;
+
+    // nodes of the level being built and the smallest key under each of them
+    Node_bulkload** level = malloc(level_count * sizeof(Node_bulkload*));
+    uint32_t* low_keys = malloc(level_count * sizeof(uint32_t));
+    if (level == NULL || low_keys == NULL) {
+        perror("Bulk load level arrays.");
+        exit(EXIT_FAILURE);
+    }
+
+    // Leaves: spread keys evenly so the last leaf does not underflow
+    int base = count / level_count;
+    int extra = count % level_count;
+    int i = 0;
+    Node_bulkload* prev = NULL;
+    for (int n = 0; n < level_count; n++) {
+        Node_bulkload* leaf = create_node_bulkload(true);
+        int take = base + (n < extra ? 1 : 0);
+        for (int j = 0; j < take; j++, i++) {
+            leaf->keys[j] = keys[i];
+            leaf->num_keys++;
+        }
+        if (prev) {
+            prev->next = leaf;
+        }
+        prev = leaf;
+        level[n] = leaf;
+        low_keys[n] = leaf->keys[0];
+    }
+
+    // Internal levels: each parent separates its children by their low keys
+    int per_inner = bulkload_node_fill(ORDER, fill_factor);
+    while (level_count > 1) {
+        int parent_count = (level_count + per_inner - 1) / per_inner;
+        base = level_count / parent_count;
+        extra = level_count % parent_count;
+        i = 0;
+        for (int n = 0; n < parent_count; n++) {
+            Node_bulkload* parent = create_node_bulkload(false);
+            int take = base + (n < extra ? 1 : 0);
+            uint32_t parent_low = low_keys[i];
+            for (int j = 0; j < take; j++, i++) {
+                parent->children[j] = level[i];
+                if (j > 0) {
+                    parent->keys[j - 1] = low_keys[i];
+                    parent->num_keys++;
+                }
+            }
+            // parents are written behind the read position, so reuse arrays
+            level[n] = parent;
+            low_keys[n] = parent_low;
+        }
+        level_count = parent_count;
+    }
+
+    Node_bulkload* root = level[0];
+    free(level);
+    free(low_keys);
+    return root;
+}
+
+// Descend to the leaf that may contain key
+Node_bulkload* findLeaf_bulkload(Node_bulkload* root, uint32_t key) {
+    Node_bulkload* c = root;
+    if (c == NULL) return NULL;
+    METRIC_INC(node_visits);
+    while (!c->is_leaf) {
+        int i = 0;
+        while (i < c->num_keys && key >= c->keys[i])
+            i++;
+        METRIC_ADD(key_comparisons, i < c->num_keys ? i + 1 : i);
+        c = c->children[i];
+        METRIC_INC(node_visits);
+    }
+    return c;
+}
+
+// Search key, returns the leaf node containing it or NULL
+Node_bulkload* search_bulkload(Node_bulkload* root, uint32_t key) {
+    Node_bulkload* result = NULL;
+    METRIC_LOOKUP_BEGIN(sample);
+    Node_bulkload* leaf = findLeaf_bulkload(root, key);
+    for (int i = 0; leaf != NULL && i < leaf->num_keys; i++) {
+        METRIC_INC(key_comparisons);
+        if (leaf->keys[i] == key) {
+            result = leaf;
+            break;
+        }
+    }
+    METRIC_LOOKUP_END(sample, (int)key);
+    return result;
+}
+
+// Find the value slot of key, NULL if the key is not in the tree
+postings* find_bulkload(Node_bulkload* root, uint32_t key) {
+    postings* result = NULL;
+    METRIC_LOOKUP_BEGIN(sample);
+    Node_bulkload* leaf = findLeaf_bulkload(root, key);
+    for (int i = 0; leaf != NULL && i < leaf->num_keys; i++) {
+        METRIC_INC(key_comparisons);
+        if (leaf->keys[i] == key) {
+            result = &leaf->values[i];
+            break;
+        }
+    }
+    METRIC_LOOKUP_END(sample, (int)key);
+    return result;
+}
+
+// Collect keys in [key_start, key_end] by walking the leaf chain,
+// at most max_found entries are written
+int findRange_bulkload(Node_bulkload* root, uint32_t key_start, uint32_t key_end,
+        int max_found, uint32_t returned_keys[], postings* returned_values[]) {
+    int num_found = 0;
+    Node_bulkload* n = findLeaf_bulkload(root, key_start);
+    int i = 0;
+    if (n == NULL) return 0;
+    while (i < n->num_keys && n->keys[i] < key_start)
+        i++;
+    while (n != NULL && num_found < max_found) {
+        for (; i < n->num_keys && num_found < max_found; i++) {
+            if (n->keys[i] > key_end)
+                return num_found;
+            returned_keys[num_found] = n->keys[i];
+            returned_values[num_found] = &n->values[i];
+            num_found++;
+        }
+        n = n->next;
+        METRIC_INC(leaf_hops);
+        i = 0;
+    }
+    return num_found;
+}
+
+int height_bulkload(Node_bulkload* root) {
+    int h = 0;
+    Node_bulkload* c = root;
+    while (c != NULL && !c->is_leaf) {
+        c = c->children[0];
+        h++;
+    }
+    return h;
+}
+
+// Free the tree nodes (CSV records are owned by the caller)
+void free_bulkload(Node_bulkload* root) {
+    if (root == NULL) return;
+    if (!root->is_leaf) {
+        for (int i = 0; i <= root->num_keys; i++) {
+            free_bulkload(root->children[i]);
+        }
+    }
+    free(root);
+}
+
+// B + tree with string keys
+//
+// Keyed by the department name itself, so different departments never share
+// a record. Every node stores its keys in a small byte heap: the prefix
+// common to all keys of the node is kept once and each key only stores the
+// rest. Inner nodes hold the shortest separator that still splits their
+// children instead of a full key. Nodes split when either the key slots or
+// the heap run out.
+
+#define STR_NODE_KEYS 32
+#define STR_HEAP_SIZE 1024
+#define STR_KEY_LEN (MAX_KEY_LEN - 1)
+
+typedef struct str_node {
+  bool is_leaf;
+  int num_keys;
+  uint16_t prefix_len;            // heap[0 .. prefix_len) is the shared prefix
+  uint16_t heap_used;
+  uint16_t offsets[STR_NODE_KEYS]; // suffix of key i in the heap
+  uint16_t lengths[STR_NODE_KEYS];
+  // Leaf: records, next leaf in pointers[STR_NODE_KEYS]. Inner: children.
+  void *pointers[STR_NODE_KEYS + 1];
+  char heap[STR_HEAP_SIZE];
+} str_node;
+
+// A key spelled out in full, used while a node is being rebuilt
+typedef struct str_key {
+  int len;
+  char bytes[STR_KEY_LEN];
+} str_key;
+
+int compareBytes(const char *a, int a_len, const char *b, int b_len) {
+  int c = memcmp(a, b, a_len < b_len ? a_len : b_len);
+  if (c != 0)
+    return c;
+  return (a_len > b_len) - (a_len < b_len);
+}
+
+int commonPrefix(const char *a, int a_len, const char *b, int b_len) {
+  int n = a_len < b_len ? a_len : b_len;
+  int i = 0;
+  while (i < n && a[i] == b[i])
+    i++;
+  return i;
+}
+
+str_node *makeStrNode(tree_memory *mem, bool is_leaf) {
+  str_node *n = slabAlloc(mem, &mem->str_nodes, sizeof(str_node),
+                          CACHE_LINE_SIZE);
+  n->is_leaf = is_leaf;
+  n->num_keys = 0;
+  n->prefix_len = 0;
+  n->heap_used = 0;
+  n->pointers[STR_NODE_KEYS] = NULL;
+  return n;
+}
+
+void strKeyAt(const str_node *n, int i, str_key *out) {
+  memcpy(out->bytes, n->heap, n->prefix_len);
+  memcpy(out->bytes + n->prefix_len, n->heap + n->offsets[i], n->lengths[i]);
+  out->len = n->prefix_len + n->lengths[i];
+}
+
+// Heap bytes needed to store keys[from .. to) in one node
+int strEncodedSize(const str_key keys[], int from, int to) {
+  if (to <= from)
+    return 0;
+  int prefix = commonPrefix(keys[from].bytes, keys[from].len,
+                            keys[to - 1].bytes, keys[to - 1].len);
+  int size = prefix;
+  for (int i = from; i < to; i++)
+    size += keys[i].len - prefix;
+  return size;
+}
+
+// Rewrite the node heap with sorted keys[from .. to). The shared prefix of
+// sorted keys is the common prefix of the first and the last one.
+void strNodeEncode(str_node *n, const str_key keys[], int from, int to) {
+  int count = to - from;
+  int prefix = count > 0 ? commonPrefix(keys[from].bytes, keys[from].len,
+                                        keys[to - 1].bytes, keys[to - 1].len) : 0;
+  memcpy(n->heap, keys[from].bytes, prefix);
+  int used = prefix;
+  for (int i = 0; i < count; i++) {
+    const str_key *k = &keys[from + i];
+    n->offsets[i] = used;
+    n->lengths[i] = k->len - prefix;
+    memcpy(n->heap + used, k->bytes + prefix, k->len - prefix);
+    used += k->len - prefix;
+  }
+  n->num_keys = count;
+  n->prefix_len = prefix;
+  n->heap_used = used;
+}
+
+// Number of keys in the node smaller than key, or smaller than or equal to
+// key when inclusive is set
+int strNodeSearch(const str_node *n, const char *key, int len, bool inclusive) {
+  int p = n->prefix_len;
+  int shared = commonPrefix(n->heap, p, key, len);
+  if (shared < p) {
+    // key leaves the prefix: it sorts before or after every key here
+    if (shared == len || (unsigned char)key[shared] < (unsigned char)n->heap[shared])
+      return 0;
+    return n->num_keys;
+  }
+  int lo = 0, hi = n->num_keys;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    int c = compareBytes(n->heap + n->offsets[mid], n->lengths[mid], key + p, len - p);
+    if (c < 0 || (inclusive && c == 0))
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+bool strKeyEquals(const str_node *n, int i, const char *key, int len) {
+  return n->prefix_len + n->lengths[i] == len &&
+         memcmp(n->heap, key, n->prefix_len) == 0 &&
+         memcmp(n->heap + n->offsets[i], key + n->prefix_len, n->lengths[i]) == 0;
+}
+
+str_node *strFindLeaf(str_node *root, const char *key, int len,
+                      str_node *path[], int *depth) {
+  str_node *c = root;
+  if (depth != NULL)
+    *depth = 0;
+  if (c == NULL)
+    return NULL;
+  while (!c->is_leaf) {
+    int i = strNodeSearch(c, key, len, true);
+    if (path != NULL)
+      path[(*depth)++] = c;
+    c = c->pointers[i];
+  }
+  return c;
+}
+
+record *strFind(str_node *root, const char *key, int len) {
+  if (len > STR_KEY_LEN)
+    len = STR_KEY_LEN;
+  str_node *leaf = strFindLeaf(root, key, len, NULL, NULL);
+  if (leaf == NULL)
+    return NULL;
+  int i = strNodeSearch(leaf, key, len, false);
+  if (i < leaf->num_keys && strKeyEquals(leaf, i, key, len))
+    return leaf->pointers[i];
+  return NULL;
+}
+
+// Split point for sorted keys[0 .. count) that balances the heap bytes of
+// both halves, the right half starts at the returned index
+int strChooseSplit(const str_key keys[], int count) {
+  int best = count / 2, best_size = INT_MAX;
+  for (int s = 1; s < count; s++) {
+    int left = strEncodedSize(keys, 0, s);
+    int right = strEncodedSize(keys, s, count);
+    int size = left > right ? left : right;
+    if (s <= STR_NODE_KEYS && count - s <= STR_NODE_KEYS && size < best_size) {
+      best = s;
+      best_size = size;
+    }
+  }
+  return best;
+}
+
+// Shortest key S with left < S <= right
+void strShortestSeparator(const str_key *left, const str_key *right, str_key *out) {
+  int shared = commonPrefix(left->bytes, left->len, right->bytes, right->len);
+  out->len = shared + 1 <= right->len ? shared + 1 : right->len;
+  memcpy(out->bytes, right->bytes, out->len);
+}
+
+str_node *strInsertIntoParent(tree_memory *mem, str_node *root, str_node *path[],
+                              int depth, str_node *left, const str_key *separator,
+                              str_node *right) {
+  str_key keys[STR_NODE_KEYS + 1];
+  void *children[STR_NODE_KEYS + 2];
+  int i, n, left_index;
+
+  if (depth == 0) {
+    str_node *new_root = makeStrNode(mem, false);
+    strNodeEncode(new_root, separator, 0, 1);
+    new_root->pointers[0] = left;
+    new_root->pointers[1] = right;
+    return new_root;
+  }
+
+  str_node *parent = path[depth - 1];
+  n = parent->num_keys;
+  left_index = 0;
+  while (left_index <= n && parent->pointers[left_index] != left)
+    left_index++;
+
+  for (i = 0; i < n; i++)
+    strKeyAt(parent, i, &keys[i < left_index ? i : i + 1]);
+  keys[left_index] = *separator;
+  for (i = 0; i <= n; i++)
+    children[i <= left_index ? i : i + 1] = parent->pointers[i];
+  children[left_index + 1] = right;
+  n++;
+
+  if (n <= STR_NODE_KEYS && strEncodedSize(keys, 0, n) <= STR_HEAP_SIZE) {
+    strNodeEncode(parent, keys, 0, n);
+    memcpy(parent->pointers, children, (n + 1) * sizeof(void *));
+    return root;
+  }
+
+  // keys[mid] moves up, the halves keep the keys on either side of it
+  int mid = strChooseSplit(keys, n);
+  if (mid >= n - 1)
+    mid = n - 2;
+  str_node *sibling = makeStrNode(mem, false);
+  str_key up = keys[mid];
+  strNodeEncode(parent, keys, 0, mid);
+  memcpy(parent->pointers, children, (mid + 1) * sizeof(void *));
+  strNodeEncode(sibling, keys, mid + 1, n);
+  memcpy(sibling->pointers, children + mid + 1, (n - mid) * sizeof(void *));
+  number_of_splits++;
+  return strInsertIntoParent(mem, root, path, depth - 1, parent, &up, sibling);
+}
+
+// Find or create the record of key, like upsert() for the hashed tree.
+// Keys longer than STR_KEY_LEN are truncated like the stored departments.
+str_node *strUpsert(tree_memory *mem, str_node *root, const char *key, int len,
+                    record **record_out) {
+  str_node *path[MAX_TREE_HEIGHT];
+  str_key keys[STR_NODE_KEYS + 1];
+  void *values[STR_NODE_KEYS + 1];
+  int depth, i, n;
+
+  if (len > STR_KEY_LEN)
+    len = STR_KEY_LEN;
+  *record_out = NULL;
+  if (root == NULL) {
+    root = makeStrNode(mem, true);
+    keys[0].len = len;
+    memcpy(keys[0].bytes, key, len);
+    strNodeEncode(root, keys, 0, 1);
+    root->pointers[0] = *record_out = makeRecord(mem);
+    return root;
+  }
+
+  str_node *leaf = strFindLeaf(root, key, len, path, &depth);
+  int at = strNodeSearch(leaf, key, len, false);
+  if (at < leaf->num_keys && strKeyEquals(leaf, at, key, len)) {
+    *record_out = leaf->pointers[at];
+    return root;
+  }
+
+  n = leaf->num_keys;
+  for (i = 0; i < n; i++) {
+    strKeyAt(leaf, i, &keys[i < at ? i : i + 1]);
+    values[i < at ? i : i + 1] = leaf->pointers[i];
+  }
+  keys[at].len = len;
+  memcpy(keys[at].bytes, key, len);
+  values[at] = *record_out = makeRecord(mem);
+  n++;
+
+  if (n <= STR_NODE_KEYS && strEncodedSize(keys, 0, n) <= STR_HEAP_SIZE) {
+    strNodeEncode(leaf, keys, 0, n);
+    memcpy(leaf->pointers, values, n * sizeof(void *));
+    return root;
+  }
+
+  int split = strChooseSplit(keys, n);
+  str_node *new_leaf = makeStrNode(mem, true);
+  strNodeEncode(leaf, keys, 0, split);
+  memcpy(leaf->pointers, values, split * sizeof(void *));
+  strNodeEncode(new_leaf, keys, split, n);
+  memcpy(new_leaf->pointers, values + split, (n - split) * sizeof(void *));
+  new_leaf->pointers[STR_NODE_KEYS] = leaf->pointers[STR_NODE_KEYS];
+  leaf->pointers[STR_NODE_KEYS] = new_leaf;
+  number_of_splits++;
+
+  str_key separator;
+  strShortestSeparator(&keys[split - 1], &keys[split], &separator);
+  return strInsertIntoParent(mem, root, path, depth, leaf, &separator, new_leaf);
+}
+
+// Records of every key starting with prefix, in key order. At most
+// max_found are written; keys_out may be NULL.
+int strFindPrefix(str_node *root, const char *prefix, int len, int max_found,
+                  record *returned_records[], str_key keys_out[]) {
+  str_key k;
+  int num_found = 0;
+  str_node *n = strFindLeaf(root, prefix, len, NULL, NULL);
+  if (n == NULL)
+    return 0;
+  int i = strNodeSearch(n, prefix, len, false);
+  while (n != NULL && num_found < max_found) {
+    for (; i < n->num_keys && num_found < max_found; i++) {
+      strKeyAt(n, i, &k);
+      if (k.len < len || memcmp(k.bytes, prefix, len) != 0)
+        return num_found;
+      returned_records[num_found] = n->pointers[i];
+      if (keys_out != NULL)
+        keys_out[num_found] = k;
+      num_found++;
+    }
+    n = n->pointers[STR_NODE_KEYS];
+    i = 0;
+  }
+  return num_found;
+}
+
+int strHeight(str_node *root) {
+  int h = 0;
+  str_node *c = root;
+  while (c != NULL && !c->is_leaf) {
+    c = c->pointers[0];
+    h++;
+  }
+  return h;
+}
+
+// Node count and heap bytes in use, for index size comparisons
+void strTreeSize(str_node *root, unsigned long long *nodes,
+                 unsigned long long *heap_bytes) {
+  if (root == NULL)
+    return;
+  (*nodes)++;
+  *heap_bytes += root->heap_used;
+  if (!root->is_leaf)
+    for (int i = 0; i <= root->num_keys; i++)
+      strTreeSize(root->pointers[i], nodes, heap_bytes);
+}
+
+// Composite keys
+//
+// Rows keyed by (department, score descending, id) in the string keyed tree.
+// A key is the department bytes, a 0 byte, then the score and the id as big
+// endian words, so comparing keys byte by byte compares the tuples. Each
+// department is one run of adjacent leaf entries, and top-K, score ranges
+// and ranks are bounded leaf scans whatever order the rows arrived in.
+
+#define COMPOSITE_DEPARTMENT_LEN (STR_KEY_LEN - 9)
+
+void putBigEndian32(char *out, uint32_t v) {
+  out[0] = (char)(v >> 24);
+  out[1] = (char)(v >> 16);
+  out[2] = (char)(v >> 8);
+  out[3] = (char)v;
+}
+
+// Score bits whose unsigned order is descending score order
+uint32_t compositeScoreBits(float score) {
+  uint32_t bits;
+  memcpy(&bits, &score, sizeof(bits));
+  bits = (bits & 0x80000000u) ? ~bits : bits | 0x80000000u;
+  return ~bits;
+}
+
+int compositeKey(char *out, const char *department, int len, float score, int id) {
+  if (len > COMPOSITE_DEPARTMENT_LEN)
+    len = COMPOSITE_DEPARTMENT_LEN;
+  memcpy(out, department, len);
+  out[len] = '\0';
+  putBigEndian32(out + len + 1, compositeScoreBits(score));
+  putBigEndian32(out + len + 5, (uint32_t)id ^ 0x80000000u);
+  return len + 9;
+}
+
+// Lowest and highest possible keys of a department
+int compositeFirstKey(char *out, const char *department, int len) {
+  int n = compositeKey(out, department, len, 0.0f, 0);
+  memset(out + n - 8, 0x00, 8);
+  return n;
+}
+
+int compositeLastKey(char *out, const char *department, int len) {
+  int n = compositeKey(out, department, len, 0.0f, 0);
+  memset(out + n - 8, 0xff, 8);
+  return n;
+}
+
+str_node *compositeInsert(tree_memory *mem, str_node *root, const CSVRecord *row) {
+  char key[STR_KEY_LEN];
+  record *found;
+  int len = compositeKey(key, row->department, (int)strlen(row->department),
+                         row->score, row->id);
+  root = strUpsert(mem, root, key, len, &found);
+  if (found->rows.count == 0)
+    postingsAppend(mem, &found->rows, row);
+  return root;
+}
+
+// Rows with keys in [from, to] in key order, skipping the first skip of
+// them. At most max_found are written.
+int compositeScan(str_node *root, const char *from, int from_len,
+                  const char *to, int to_len, int skip, int max_found,
+                  const CSVRecord *rows_out[]) {
+  int num_found = 0;
+  str_node *n = strFindLeaf(root, from, from_len, NULL, NULL);
+  if (n == NULL)
+    return 0;
+  int i = strNodeSearch(n, from, from_len, false);
+  while (n != NULL && num_found < max_found) {
+    // keys of this leaf up to and including to
+    int end = strNodeSearch(n, to, to_len, true);
+    if (skip >= end - i) {
+      skip -= end > i ? end - i : 0;
+    } else {
+      for (i += skip, skip = 0; i < end && num_found < max_found; i++)
+        rows_out[num_found++] = ((record *)n->pointers[i])->rows.rows;
+    }
+    if (end < n->num_keys)
+      break;
+    n = n->pointers[STR_NODE_KEYS];
+    i = 0;
+  }
+  return num_found;
+}
+
+// The k best rows of a department
+int compositeTopK(str_node *root, const char *department, int len, int k,
+                  const CSVRecord *rows_out[]) {
+  char from[STR_KEY_LEN], to[STR_KEY_LEN];
+  int from_len = compositeFirstKey(from, department, len);
+  int to_len = compositeLastKey(to, department, len);
+  return compositeScan(root, from, from_len, to, to_len, 0, k, rows_out);
+}
+
+// Rows of a department with low <= score <= high, best first
+int compositeScoreRange(str_node *root, const char *department, int len,
+                        float low, float high, int max_found,
+                        const CSVRecord *rows_out[]) {
+  char from[STR_KEY_LEN], to[STR_KEY_LEN];
+  int from_len = compositeKey(from, department, len, high, INT_MIN);
+  int to_len = compositeKey(to, department, len, low, INT_MAX);
+  return compositeScan(root, from, from_len, to, to_len, 0, max_found, rows_out);
+}
+
+// Row at rank (1 is the highest score) of a department, NULL when out of
+// range
+const CSVRecord *compositeRank(str_node *root, const char *department, int len,
+                               int rank) {
+  char from[STR_KEY_LEN], to[STR_KEY_LEN];
+  const CSVRecord *row;
+  if (rank < 1)
+    return NULL;
+  int from_len = compositeFirstKey(from, department, len);
+  int to_len = compositeLastKey(to, department, len);
+  if (compositeScan(root, from, from_len, to, to_len, rank - 1, 1, &row) == 0)
+    return NULL;
+  return row;
+}
+
+// Specialized trees
+//
+// Copies of the tree with the order and key type fixed at compile time,
+// generated from tree_template.h. Integer keys search a node by counting
+// the smaller keys over every slot, which the compiler vectorizes; wider
+// nodes and string keys use a binary search of a fixed number of steps.
+
+// Keys of exactly FIXED_KEY_LEN bytes in memcmp order, shorter names are
+// padded with zeros
+#define FIXED_KEY_LEN 16
+
+typedef struct fixed_key {
+  char bytes[FIXED_KEY_LEN];
+} fixed_key;
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define FIXED_KEY_WORD(x) __builtin_bswap64(x)
+#else
+#define FIXED_KEY_WORD(x) (x)
+#endif
+
+// memcmp order, compared as two big endian words
+bool fixedKeyLess(fixed_key a, fixed_key b) {
+  uint64_t x, y;
+  memcpy(&x, a.bytes, 8);
+  memcpy(&y, b.bytes, 8);
+  if (x != y)
+    return FIXED_KEY_WORD(x) < FIXED_KEY_WORD(y);
+  memcpy(&x, a.bytes + 8, 8);
+  memcpy(&y, b.bytes + 8, 8);
+  return FIXED_KEY_WORD(x) < FIXED_KEY_WORD(y);
+}
+
+fixed_key fixedKeyMax(void) {
+  fixed_key k;
+  memset(k.bytes, 0xFF, FIXED_KEY_LEN);
+  return k;
+}
+
+fixed_key fixedKey(const char *s, int len) {
+  fixed_key k = {{0}};
+  memcpy(k.bytes, s, len < FIXED_KEY_LEN ? len : FIXED_KEY_LEN);
+  return k;
+}
+
+#define INT_KEY_LESS(a, b) ((a) < (b))
+
+#define BPT_KEY uint32_t
+#define BPT_NAME u32_8
+#define BPT_ORDER 8
+#define BPT_LESS INT_KEY_LESS
+#define BPT_KEY_MAX UINT32_MAX
+#define BPT_SEARCH_WINDOW 16
+#include "tree_template.h"
+
+#define BPT_KEY uint32_t
+#define BPT_NAME u32_16
+#define BPT_ORDER 16
+#define BPT_LESS INT_KEY_LESS
+#define BPT_KEY_MAX UINT32_MAX
+#define BPT_SEARCH_WINDOW 16
+#include "tree_template.h"
+
+#define BPT_KEY uint32_t
+#define BPT_NAME u32_32
+#define BPT_ORDER 32
+#define BPT_LESS INT_KEY_LESS
+#define BPT_KEY_MAX UINT32_MAX
+#define BPT_SEARCH_WINDOW 16
+#include "tree_template.h"
+
+#define BPT_KEY uint32_t
+#define BPT_NAME u32_64
+#define BPT_ORDER 64
+#define BPT_LESS INT_KEY_LESS
+#define BPT_KEY_MAX UINT32_MAX
+#define BPT_SEARCH_WINDOW 16
+#include "tree_template.h"
+
+#define BPT_KEY uint32_t
+#define BPT_NAME u32_128
+#define BPT_ORDER 128
+#define BPT_LESS INT_KEY_LESS
+#define BPT_KEY_MAX UINT32_MAX
+#define BPT_SEARCH_WINDOW 16
+#include "tree_template.h"
+
+#define BPT_KEY uint64_t
+#define BPT_NAME u64_8
+#define BPT_ORDER 8
+#define BPT_LESS INT_KEY_LESS
+#define BPT_KEY_MAX UINT64_MAX
+#define BPT_SEARCH_WINDOW 16
+#include "tree_template.h"
+
+#define BPT_KEY uint64_t
+#define BPT_NAME u64_16
+#define BPT_ORDER 16
+#define BPT_LESS INT_KEY_LESS
+#define BPT_KEY_MAX UINT64_MAX
+#define BPT_SEARCH_WINDOW 16
+#include "tree_template.h"
+
+#define BPT_KEY uint64_t
+#define BPT_NAME u64_32
+#define BPT_ORDER 32
+#define BPT_LESS INT_KEY_LESS
+#define BPT_KEY_MAX UINT64_MAX
+#define BPT_SEARCH_WINDOW 16
+#include "tree_template.h"
+
+#define BPT_KEY uint64_t
+#define BPT_NAME u64_64
+#define BPT_ORDER 64
+#define BPT_LESS INT_KEY_LESS
+#define BPT_KEY_MAX UINT64_MAX
+#define BPT_SEARCH_WINDOW 16
+#include "tree_template.h"
+
+#define BPT_KEY uint64_t
+#define BPT_NAME u64_128
+#define BPT_ORDER 128
+#define BPT_LESS INT_KEY_LESS
+#define BPT_KEY_MAX UINT64_MAX
+#define BPT_SEARCH_WINDOW 16
+#include "tree_template.h"
+
+#define BPT_KEY fixed_key
+#define BPT_NAME str16_32
+#define BPT_ORDER 32
+#define BPT_LESS fixedKeyLess
+#define BPT_KEY_MAX fixedKeyMax()
+#define BPT_SEARCH_WINDOW 2
+#include "tree_template.h"
+
+// Paged B + tree
+//
+// The department index stored in a file of PAGE_SIZE pages, so a saved
+// index is queried without parsing the CSV again. Page 0 is the header with
+// the root page. Leaves map a department key to its run of rows; the rows
+// follow as packed CSVRecords, each run sorted by score, so the row at a
+// rank is a single page read. Every page access goes through a buffer pool
+// with a fixed number of frames and CLOCK eviction, so the file can be
+// larger than the memory given to the pool.
+
+#define PAGE_SIZE 4096
+#define PAGED_MAGIC "BPTREE01"
+#define PAGED_LEAF_KEYS ((PAGE_SIZE - 16) / (sizeof(int32_t) + sizeof(uint64_t)))
+#define PAGED_INNER_KEYS ((PAGE_SIZE - 16 - sizeof(uint32_t)) / (2 * sizeof(uint32_t)))
+#define PAGED_ROWS_PER_PAGE (PAGE_SIZE / sizeof(CSVRecord))
+#define BUFFER_POOL_PAGES 256
+#define MIN_BUFFER_POOL_PAGES 8
+#define PAGED_INDEX_PATH "yok_atlas.idx"
+
+typedef struct paged_header {
+  char magic[8];
+  uint32_t page_size;
+  uint32_t root;           // 0 while the tree is empty
+  uint32_t page_count;
+  uint32_t row_first_page; // rows fill the pages from here on
+  uint32_t row_count;
+  uint32_t key_count;
+} paged_header;
+
+typedef struct paged_leaf {
+  uint32_t is_leaf;
+  uint32_t num_keys;
+  uint32_t next; // next leaf page, 0 after the last leaf
+  uint32_t unused;
+  int32_t keys[PAGED_LEAF_KEYS];
+  uint64_t values[PAGED_LEAF_KEYS];
+} paged_leaf;
+
+typedef struct paged_inner {
+  uint32_t is_leaf;
+  uint32_t num_keys;
+  uint32_t unused[2];
+  int32_t keys[PAGED_INNER_KEYS];
+  uint32_t children[PAGED_INNER_KEYS + 1];
+} paged_inner;
+
+typedef struct buffer_frame {
+  uint32_t page_id;
+  int pin_count;
+  int next; // next frame in the same page table bucket, -1 ends the list
+  bool referenced; // CLOCK bit, set on every access
+  bool dirty;
+  bool valid;
+} buffer_frame;
+
+typedef struct pager {
+  int fd;
+  paged_header header;
+  bool header_dirty;
+  int frame_count;
+  char *pages; // frame i holds pages[i * PAGE_SIZE ..]
+  buffer_frame *frames;
+  int *buckets; // page id hash -> first frame, -1 when empty
+  int bucket_mask;
+  int clock_hand;
+  unsigned long long hits, misses, writes;
+} pager;
+
+int pagerBucket(const pager *p, uint32_t page_id) {
+  return (int)((page_id * 2654435761u) & (uint32_t)p->bucket_mask);
+}
+
+void pagerWritePage(pager *p, uint32_t page_id, const void *data) {
+  ssize_t written = pwrite(p->fd, data, PAGE_SIZE, (off_t)page_id * PAGE_SIZE);
+  if (written != PAGE_SIZE) {
+    // a short write sets no errno
+    if (written < 0)
+      perror("Page write.");
+    else
+      fprintf(stderr, "Page write: %zd of %d bytes of page %u.\n", written, PAGE_SIZE, page_id);
+    exit(EXIT_FAILURE);
+  }
+  p->writes++;
+}
+
+// Open an index file, or create an empty one. Returns false when the file
+// cannot be opened or is not an index.
+bool pagerOpen(pager *p, const char *path, bool create, int frames) {
+  memset(p, 0, sizeof(*p));
+  p->fd = open(path, create ? O_RDWR | O_CREAT | O_TRUNC : O_RDWR, 0644);
+  if (p->fd < 0) {
+    perror("Error opening index");
+    return false;
+  }
+  if (create) {
+    memcpy(p->header.magic, PAGED_MAGIC, sizeof(p->header.magic));
+    p->header.page_size = PAGE_SIZE;
+    p->header.page_count = 1;
+    p->header_dirty = true;
+  } else if (pread(p->fd, &p->header, sizeof(p->header), 0) != sizeof(p->header) ||
+             memcmp(p->header.magic, PAGED_MAGIC, sizeof(p->header.magic)) != 0 ||
+             p->header.page_size != PAGE_SIZE) {
+    printf("%s is not an index file.\n", path);
+    close(p->fd);
+    return false;
+  }
+
+  if (frames < MIN_BUFFER_POOL_PAGES)
+    frames = MIN_BUFFER_POOL_PAGES;
+  int buckets = 1;
+  while (buckets < 2 * frames)
+    buckets *= 2;
+  p->frame_count = frames;
+  p->pages = aligned_alloc(PAGE_SIZE, (size_t)frames * PAGE_SIZE);
+  p->frames = calloc(frames, sizeof(buffer_frame));
+  p->buckets = malloc(buckets * sizeof(int));
+  if (p->pages == NULL || p->frames == NULL || p->buckets == NULL) {
+    perror("Buffer pool.");
+    exit(EXIT_FAILURE);
+  }
+  memset(p->buckets, -1, buckets * sizeof(int));
+  p->bucket_mask = buckets - 1;
+  return true;
+}
+
+// Pick a frame to reuse: the clock hand skips pinned frames and clears the
+// referenced bit of the others until it finds one that is clear
+int pagerEvict(pager *p) {
+  for (int scanned = 0; scanned < 2 * p->frame_count; scanned++) {
+    int f = p->clock_hand;
+    buffer_frame *frame = &p->frames[f];
+    p->clock_hand = (p->clock_hand + 1) % p->frame_count;
+    if (!frame->valid)
+      return f;
+    if (frame->pin_count > 0)
+      continue;
+    if (frame->referenced) {
+      frame->referenced = false;
+      continue;
+    }
+    if (frame->dirty)
+      pagerWritePage(p, frame->page_id, p->pages + (size_t)f * PAGE_SIZE);
+    int *link = &p->buckets[pagerBucket(p, frame->page_id)];
+    while (*link != f)
+      link = &p->frames[*link].next;
+    *link = frame->next;
+    frame->valid = false;
+    return f;
+  }
+  printf("All buffer frames are pinned.\n");
+  exit(EXIT_FAILURE);
+}
+
+void *pagerInstall(pager *p, uint32_t page_id, bool read) {
+  int f = pagerEvict(p);
+  buffer_frame *frame = &p->frames[f];
+  char *data = p->pages + (size_t)f * PAGE_SIZE;
+  if (read) {
+    ssize_t got = pread(p->fd, data, PAGE_SIZE, (off_t)page_id * PAGE_SIZE);
+    if (got != PAGE_SIZE) {
+      // a short read, e.g. a truncated file, sets no errno
+      if (got < 0)
+        perror("Page read.");
+      else
+        fprintf(stderr, "Page read: %zd of %d bytes of page %u.\n", got, PAGE_SIZE, page_id);
+      exit(EXIT_FAILURE);
+    }
+  } else {
+    memset(data, 0, PAGE_SIZE);
+  }
+  int bucket = pagerBucket(p, page_id);
+  frame->page_id = page_id;
+  frame->pin_count = 1;
+  frame->referenced = true;
+  frame->dirty = !read;
+  frame->valid = true;
+  frame->next = p->buckets[bucket];
+  p->buckets[bucket] = f;
+  return data;
+}
+
+// Pin a page in the pool, reading it from the file on a miss
+void *pagerGet(pager *p, uint32_t page_id) {
+  for (int f = p->buckets[pagerBucket(p, page_id)]; f >= 0; f = p->frames[f].next) {
+    if (p->frames[f].page_id == page_id) {
+      p->frames[f].pin_count++;
+      p->frames[f].referenced = true;
+      p->hits++;
+      return p->pages + (size_t)f * PAGE_SIZE;
+    }
+  }
+  if (page_id == 0 || page_id >= p->header.page_count) {
+    printf("Page %u is outside the index.\n", page_id);
+    exit(EXIT_FAILURE);
+  }
+  p->misses++;
+  return pagerInstall(p, page_id, true);
+}
+
+// Append a zeroed page to the file and pin it
+void *pagerAllocate(pager *p, uint32_t *page_id) {
+  *page_id = p->header.page_count++;
+  p->header_dirty = true;
+  return pagerInstall(p, *page_id, false);
+}
+
+// Unpin a page returned by pagerGet or pagerAllocate
+void pagerRelease(pager *p, void *page, bool dirty) {
+  buffer_frame *frame = &p->frames[((char *)page - p->pages) / PAGE_SIZE];
+  frame->pin_count--;
+  frame->dirty |= dirty;
+}
+
+// Write dirty pages and the header back to the file
+void pagerFlush(pager *p) {
+  for (int f = 0; f < p->frame_count; f++) {
+    if (p->frames[f].valid && p->frames[f].dirty) {
+      pagerWritePage(p, p->frames[f].page_id, p->pages + (size_t)f * PAGE_SIZE);
+      p->frames[f].dirty = false;
+    }
+  }
+  if (p->header_dirty) {
+    char page[PAGE_SIZE] = {0};
+    memcpy(page, &p->header, sizeof(p->header));
+    pagerWritePage(p, 0, page);
+    p->header_dirty = false;
+  }
+}
+
+void pagerClose(pager *p) {
+  pagerFlush(p);
+  close(p->fd);
+  free(p->pages);
+  free(p->frames);
+  free(p->buckets);
+  memset(p, 0, sizeof(*p));
+}
+
+// Descend to the leaf page that may contain key. path[0 .. depth - 1]
+// receives the inner pages above it, nearest last. Returns 0 for an empty
+// tree.
+uint32_t pagedFindLeaf(pager *p, int32_t key, uint32_t path[], int *depth) {
+  uint32_t page_id = p->header.root;
+  *depth = 0;
+  if (page_id == 0)
+    return 0;
+  while (true) {
+    paged_inner *n = pagerGet(p, page_id);
+    if (n->is_leaf) {
+      pagerRelease(p, n, false);
+      return page_id;
+    }
+    path[(*depth)++] = page_id;
+    uint32_t child = n->children[nodeUpperBound(n->keys, (int)n->num_keys, key)];
+    pagerRelease(p, n, false);
+    page_id = child;
+  }
+}
+
+bool pagedFind(pager *p, int32_t key, uint64_t *value) {
+  uint32_t path[MAX_TREE_HEIGHT];
+  int depth;
+  uint32_t leaf_id = pagedFindLeaf(p, key, path, &depth);
+  if (leaf_id == 0)
+    return false;
+  paged_leaf *leaf = pagerGet(p, leaf_id);
+  int i = nodeLowerBound(leaf->keys, (int)leaf->num_keys, key);
+  bool found = i < (int)leaf->num_keys && leaf->keys[i] == key;
+  if (found)
+    *value = leaf->values[i];
+  pagerRelease(p, leaf, false);
+  return found;
+}
+
+void pagedInsertIntoParent(pager *p, uint32_t path[], int depth,
+                           uint32_t left_id, int32_t key, uint32_t right_id) {
+  int32_t keys[PAGED_INNER_KEYS + 1];
+  uint32_t children[PAGED_INNER_KEYS + 2];
+  int i, n, left_index;
+
+  if (depth == 0) {
+    uint32_t root_id;
+    paged_inner *root = pagerAllocate(p, &root_id);
+    root->num_keys = 1;
+    root->keys[0] = key;
+    root->children[0] = left_id;
+    root->children[1] = right_id;
+    pagerRelease(p, root, true);
+    p->header.root = root_id;
+    p->header_dirty = true;
+    return;
+  }
+
+  uint32_t parent_id = path[depth - 1];
+  paged_inner *parent = pagerGet(p, parent_id);
+  n = (int)parent->num_keys;
+  left_index = 0;
+  while (parent->children[left_index] != left_id)
+    left_index++;
+
+  if (n < (int)PAGED_INNER_KEYS) {
+    for (i = n; i > left_index; i--) {
+      parent->children[i + 1] = parent->children[i];
+      parent->keys[i] = parent->keys[i - 1];
+    }
+    parent->children[left_index + 1] = right_id;
+    parent->keys[left_index] = key;
+    parent->num_keys++;
+    pagerRelease(p, parent, true);
+    return;
+  }
+
+  for (i = 0; i < n; i++)
+    keys[i < left_index ? i : i + 1] = parent->keys[i];
+  for (i = 0; i <= n; i++)
+    children[i <= left_index ? i : i + 1] = parent->children[i];
+  keys[left_index] = key;
+  children[left_index + 1] = right_id;
+  n++;
+
+  // keys[mid] moves up, the halves keep the keys on either side of it
+  int mid = n / 2;
+  uint32_t sibling_id;
+  paged_inner *sibling = pagerAllocate(p, &sibling_id);
+  parent->num_keys = mid;
+  memcpy(parent->keys, keys, mid * sizeof(int32_t));
+  memcpy(parent->children, children, (mid + 1) * sizeof(uint32_t));
+  sibling->num_keys = n - mid - 1;
+  memcpy(sibling->keys, keys + mid + 1, (n - mid - 1) * sizeof(int32_t));
+  memcpy(sibling->children, children + mid + 1, (n - mid) * sizeof(uint32_t));
+  pagerRelease(p, parent, true);
+  pagerRelease(p, sibling, true);
+  number_of_splits++;
+  pagedInsertIntoParent(p, path, depth - 1, parent_id, keys[mid], sibling_id);
+}
+
+// Insert key with value, or replace the value of an existing key
+void pagedInsert(pager *p, int32_t key, uint64_t value) {
+  int32_t keys[PAGED_LEAF_KEYS + 1];
+  uint64_t values[PAGED_LEAF_KEYS + 1];
+  uint32_t path[MAX_TREE_HEIGHT];
+  int depth, i, n;
+
+  uint32_t leaf_id = pagedFindLeaf(p, key, path, &depth);
+  if (leaf_id == 0) {
+    paged_leaf *root = pagerAllocate(p, &leaf_id);
+    root->is_leaf = 1;
+    root->num_keys = 1;
+    root->keys[0] = key;
+    root->values[0] = value;
+    pagerRelease(p, root, true);
+    p->header.root = leaf_id;
+    p->header.key_count++;
+    p->header_dirty = true;
+    return;
+  }
+
+  paged_leaf *leaf = pagerGet(p, leaf_id);
+  n = (int)leaf->num_keys;
+  int at = nodeLowerBound(leaf->keys, n, key);
+  if (at < n && leaf->keys[at] == key) {
+    leaf->values[at] = value;
+    pagerRelease(p, leaf, true);
+    return;
+  }
+  p->header.key_count++;
+  p->header_dirty = true;
+
+  if (n < (int)PAGED_LEAF_KEYS) {
+    memmove(leaf->keys + at + 1, leaf->keys + at, (n - at) * sizeof(int32_t));
+    memmove(leaf->values + at + 1, leaf->values + at, (n - at) * sizeof(uint64_t));
+    leaf->keys[at] = key;
+    leaf->values[at] = value;
+    leaf->num_keys++;
+    pagerRelease(p, leaf, true);
+    return;
+  }
+
+  for (i = 0; i < n; i++) {
+    keys[i < at ? i : i + 1] = leaf->keys[i];
+    values[i < at ? i : i + 1] = leaf->values[i];
+  }
+  keys[at] = key;
+  values[at] = value;
+  n++;
+
+  int split = n / 2;
+  uint32_t new_id;
+  paged_leaf *new_leaf = pagerAllocate(p, &new_id);
+  new_leaf->is_leaf = 1;
+  leaf->num_keys = split;
+  memcpy(leaf->keys, keys, split * sizeof(int32_t));
+  memcpy(leaf->values, values, split * sizeof(uint64_t));
+  new_leaf->num_keys = n - split;
+  memcpy(new_leaf->keys, keys + split, (n - split) * sizeof(int32_t));
+  memcpy(new_leaf->values, values + split, (n - split) * sizeof(uint64_t));
+  new_leaf->next = leaf->next;
+  leaf->next = new_id;
+  pagerRelease(p, leaf, true);
+  pagerRelease(p, new_leaf, true);
+  number_of_splits++;
+  pagedInsertIntoParent(p, path, depth, leaf_id, keys[split], new_id);
+}
+
+// Reserve the row pages, rows are written with pagedPutRow
+void pagedReserveRows(pager *p, uint32_t row_count) {
+  uint32_t pages = (row_count + PAGED_ROWS_PER_PAGE - 1) / PAGED_ROWS_PER_PAGE;
+  p->header.row_first_page = p->header.page_count;
+  p->header.row_count = row_count;
+  p->header.page_count += pages;
+  p->header_dirty = true;
+  // the pages read back as zeros until their rows are written
+  if (ftruncate(p->fd, (off_t)p->header.page_count * PAGE_SIZE) != 0) {
+    perror("Row pages.");
+    exit(EXIT_FAILURE);
+  }
+}
+
+void pagedPutRow(pager *p, uint32_t index, const CSVRecord *row) {
+  CSVRecord *rows = pagerGet(p, p->header.row_first_page + index / PAGED_ROWS_PER_PAGE);
+  rows[index % PAGED_ROWS_PER_PAGE] = *row;
+  pagerRelease(p, rows, true);
+}
+
+void pagedGetRow(pager *p, uint32_t index, CSVRecord *out) {
+  CSVRecord *rows = pagerGet(p, p->header.row_first_page + index / PAGED_ROWS_PER_PAGE);
+  *out = rows[index % PAGED_ROWS_PER_PAGE];
+  pagerRelease(p, rows, false);
+}
+
+// Copy the row at rank (1 is the highest score) of key into out
+bool pagedRank(pager *p, int32_t key, int rank, CSVRecord *out) {
+  uint64_t run;
+  if (!pagedFind(p, key, &run))
+    return false;
+  uint32_t first = (uint32_t)(run >> 32), count = (uint32_t)run;
+  if (rank < 1 || (uint32_t)rank > count)
+    return false;
+  pagedGetRow(p, first + rank - 1, out);
+  return true;
+}
+
+// Building the index
+//
+// The rows are sorted by key, then score, in runs of PAGED_BUILD_RUN_ROWS
+// that are spilled to a temporary file, and the runs are merged with a
+// min-heap. The merged rows go to the row pages in order, and each key's
+// run is appended to the rightmost leaf. The tree is built bottom-up: only
+// the last page of every level is open, a full page stays full and its
+// successor's first key moves up a level. Memory stays around one run
+// buffer, the merge reads every run through its share of an equally sized
+// buffer, up to PAGED_BUILD_RUN_ROWS runs.
+
+#define PAGED_BUILD_RUN_ROWS 32768
+
+typedef struct paged_build_row {
+  int32_t key;
+  uint32_t seq; // row number in the CSV, keeps equal scores in file order
+  CSVRecord row;
+} paged_build_row;
+
+typedef struct paged_build_run {
+  off_t next; // file offset of the first row not yet buffered
+  size_t left; // rows of the run still in the file
+  paged_build_row *buffer;
+  int head, filled;
+} paged_build_run;
+
+typedef struct paged_builder {
+  uint32_t open[MAX_TREE_HEIGHT]; // last page of every level, leaves first
+  int levels;
+} paged_builder;
+
+// Key ascending, then the postings order: score descending, file order
+int pagedBuildCompare(const void *a, const void *b) {
+  const paged_build_row *x = a, *y = b;
+  if (x->key != y->key)
+    return x->key < y->key ? -1 : 1;
+  if (x->row.score != y->row.score)
+    return x->row.score > y->row.score ? -1 : 1;
+  return (x->seq > y->seq) - (x->seq < y->seq);
+}
+
+void pagedBuildSpill(FILE *spill, paged_build_row *rows, int count) {
+  qsort(rows, count, sizeof(paged_build_row), pagedBuildCompare);
+  if (fwrite(rows, sizeof(paged_build_row), count, spill) != (size_t)count) {
+    perror("Index build spill.");
+    exit(EXIT_FAILURE);
+  }
+}
+
+// Refill the buffer of a run from the spill file, false when it is done
+bool pagedBuildRefill(FILE *spill, paged_build_run *run, int capacity) {
+  if (run->head < run->filled)
+    return true;
+  if (run->left == 0)
+    return false;
+  int count = run->left < (size_t)capacity ? (int)run->left : capacity;
+  size_t bytes = count * sizeof(paged_build_row);
+  ssize_t got = pread(fileno(spill), run->buffer, bytes, run->next);
+  if (got != (ssize_t)bytes) {
+    if (got < 0)
+      perror("Index build spill read.");
+    else
+      fprintf(stderr, "Index build spill read: %zd of %zu bytes.\n", got, bytes);
+    exit(EXIT_FAILURE);
+  }
+  run->next += bytes;
+  run->left -= count;
+  run->head = 0;
+  run->filled = count;
+  return true;
+}
+
+// Restore the min-heap of runs below slot i, runs are ordered by their
+// head row
+void pagedBuildHeapDown(paged_build_run runs[], int heap[], int size, int i) {
+  while (true) {
+    int least = i, left = 2 * i + 1, right = left + 1;
+    if (left < size &&
+        pagedBuildCompare(&runs[heap[left]].buffer[runs[heap[left]].head],
+                          &runs[heap[least]].buffer[runs[heap[least]].head]) < 0)
+      least = left;
+    if (right < size &&
+        pagedBuildCompare(&runs[heap[right]].buffer[runs[heap[right]].head],
+                          &runs[heap[least]].buffer[runs[heap[least]].head]) < 0)
+      least = right;
+    if (least == i)
+      return;
+    int swap = heap[i];
+    heap[i] = heap[least];
+    heap[least] = swap;
+    i = least;
+  }
+}
+
+// Add key and right, the page that follows key on the level below, to the
+// last page of level. left is the page before key, it becomes the first
+// child when the level is new.
+void pagedBuildPush(pager *p, paged_builder *b, int level, uint32_t left,
+                    int32_t key, uint32_t right) {
+  uint32_t page_id;
+  if (level == b->levels) {
+    if (level == MAX_TREE_HEIGHT) {
+      printf("The index is more than %d levels high.\n", MAX_TREE_HEIGHT);
+      exit(EXIT_FAILURE);
+    }
+    paged_inner *root = pagerAllocate(p, &page_id);
+    root->num_keys = 1;
+    root->keys[0] = key;
+    root->children[0] = left;
+    root->children[1] = right;
+    pagerRelease(p, root, true);
+    b->open[b->levels++] = page_id;
+    return;
+  }
+
+  paged_inner *n = pagerGet(p, b->open[level]);
+  if (n->num_keys < PAGED_INNER_KEYS) {
+    n->keys[n->num_keys++] = key;
+    n->children[n->num_keys] = right;
+    pagerRelease(p, n, true);
+    return;
+  }
+  pagerRelease(p, n, false);
+  paged_inner *sibling = pagerAllocate(p, &page_id);
+  sibling->children[0] = right;
+  pagerRelease(p, sibling, true);
+  uint32_t full_id = b->open[level];
+  b->open[level] = page_id;
+  pagedBuildPush(p, b, level + 1, full_id, key, page_id);
+}
+
+// Append key with value after the largest key of the tree
+void pagedBuildAppend(pager *p, paged_builder *b, int32_t key, uint64_t value) {
+  uint32_t page_id;
+  paged_leaf *leaf;
+  p->header.key_count++;
+  p->header_dirty = true;
+  if (b->levels == 0) {
+    leaf = pagerAllocate(p, &page_id);
+    leaf->is_leaf = 1;
+    b->open[b->levels++] = page_id;
+  } else {
+    leaf = pagerGet(p, b->open[0]);
+  }
+  if (leaf->num_keys < PAGED_LEAF_KEYS) {
+    leaf->keys[leaf->num_keys] = key;
+    leaf->values[leaf->num_keys++] = value;
+    pagerRelease(p, leaf, true);
+    return;
+  }
+
+  paged_leaf *new_leaf = pagerAllocate(p, &page_id);
+  new_leaf->is_leaf = 1;
+  new_leaf->num_keys = 1;
+  new_leaf->keys[0] = key;
+  new_leaf->values[0] = value;
+  leaf->next = page_id;
+  pagerRelease(p, leaf, true);
+  pagerRelease(p, new_leaf, true);
+  uint32_t full_id = b->open[0];
+  b->open[0] = page_id;
+  pagedBuildPush(p, b, 1, full_id, key, page_id);
+}
+
+// Index the CSV into an empty paged tree
+void pagedBuildIndex(pager *p, const csv_file *file) {
+  paged_build_row *rows = malloc(PAGED_BUILD_RUN_ROWS * sizeof(paged_build_row));
+  paged_build_run *runs = NULL;
+  int *heap = NULL;
+  FILE *spill = tmpfile();
+  csv_cursor cursor;
+  csv_row row;
+  uint32_t row_count = 0;
+  int run_count = 0, buffered = 0;
+  if (rows == NULL) {
+    perror("Index build rows.");
+    exit(EXIT_FAILURE);
+  }
+  if (spill == NULL) {
+    perror("Index build spill file.");
+    exit(EXIT_FAILURE);
+  }
+
+  csvCursorInit(&cursor, file);
+  while (csvNextRow(&cursor, &row)) {
+    paged_build_row *r = &rows[buffered++];
+    r->key = (int32_t)csvRowKey(&row);
+    r->seq = row_count++;
+    csvRowToRecord(&row, &r->row);
+    if (buffered == PAGED_BUILD_RUN_ROWS) {
+      pagedBuildSpill(spill, rows, buffered);
+      run_count++;
+      buffered = 0;
+    }
+  }
+  if (buffered > 0) {
+    pagedBuildSpill(spill, rows, buffered);
+    run_count++;
+  }
+  if (fflush(spill) != 0) {
+    perror("Index build spill.");
+    exit(EXIT_FAILURE);
+  }
+  if (run_count > PAGED_BUILD_RUN_ROWS) {
+    fprintf(stderr, "Index build: %u rows need more than %d runs.\n", row_count,
+            PAGED_BUILD_RUN_ROWS);
+    exit(EXIT_FAILURE);
+  }
+
+  // the run buffer is split between the runs for the merge
+  int capacity = run_count > 0 ? PAGED_BUILD_RUN_ROWS / run_count : 0;
+  runs = calloc(run_count > 0 ? run_count : 1, sizeof(paged_build_run));
+  heap = malloc((run_count > 0 ? run_count : 1) * sizeof(int));
+  if (runs == NULL || heap == NULL) {
+    perror("Index build runs.");
+    exit(EXIT_FAILURE);
+  }
+  int size = 0;
+  for (int r = 0; r < run_count; r++) {
+    size_t first = (size_t)r * PAGED_BUILD_RUN_ROWS;
+    runs[r].next = (off_t)(first * sizeof(paged_build_row));
+    runs[r].left = r < run_count - 1 ? PAGED_BUILD_RUN_ROWS : row_count - first;
+    runs[r].buffer = rows + (size_t)r * capacity;
+    pagedBuildRefill(spill, &runs[r], capacity);
+    heap[size++] = r;
+  }
+  for (int i = size / 2 - 1; i >= 0; i--)
+    pagedBuildHeapDown(runs, heap, size, i);
+
+  pagedReserveRows(p, row_count);
+  paged_builder builder = {0};
+  uint32_t next_row = 0, key_first = 0;
+  int32_t key = 0;
+  while (size > 0) {
+    paged_build_run *run = &runs[heap[0]];
+    paged_build_row *next = &run->buffer[run->head++];
+    if (next_row > 0 && next->key != key) {
+      pagedBuildAppend(p, &builder, key, (uint64_t)key_first << 32 | (next_row - key_first));
+      key_first = next_row;
+    }
+    key = next->key;
+    pagedPutRow(p, next_row++, &next->row);
+    if (!pagedBuildRefill(spill, run, capacity))
+      heap[0] = heap[--size];
+    pagedBuildHeapDown(runs, heap, size, 0);
+  }
+  if (next_row > 0)
+    pagedBuildAppend(p, &builder, key, (uint64_t)key_first << 32 | (next_row - key_first));
+  if (builder.levels > 0) {
+    p->header.root = builder.open[builder.levels - 1];
+    p->header_dirty = true;
+  }
+
+  fclose(spill);
+  free(heap);
+  free(runs);
+  free(rows);
+  pagerFlush(p);
+}
+
+// Comparison function for qsort
+int compare_uint32(const void* a, const void* b) {
+    uint32_t arg1 = *(const uint32_t*)a;
+    uint32_t arg2 = *(const uint32_t*)b;
+    return (arg1 > arg2) - (arg1 < arg2);
+}
+
+// Sorts and removes duplicates in-place
+void sort_and_deduplicate(uint32_t* keys, size_t* count) {
+    if (*count <= 1) return;
+
+    // Step 1: Sort
+    qsort(keys, *count, sizeof(uint32_t), compare_uint32);
+
+    // Step 2: Deduplicate
+    size_t unique_idx = 0;
+    for (size_t i = 1; i < *count; i++) {
+        if (keys[i] != keys[unique_idx]) {
+            unique_idx++;
+            keys[unique_idx] = keys[i];
+        }
+    }
+
+    // Update count to number of unique elements
+    *count = unique_idx + 1;
+}
+
+
+// Key preparation
+//
+// Bulk load needs its keys sorted and unique. Besides qsort there is an LSD
+// radix sort that drops duplicates while writing its last pass, and a
+// parallel variant that radix sorts one slice per thread and merges the
+// sorted slices.
+
+// 0 picks the number of online CPUs
+#ifndef INGEST_THREADS
+#define INGEST_THREADS 0
+#endif
+#define MAX_INGEST_THREADS 64
+
+typedef struct key_run {
+    uint32_t *keys;
+    size_t count;
+} key_run;
+
+int ingestThreadCount(int requested) {
+    int threads = requested;
+    if (threads <= 0)
+        threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads < 1)
+        threads = 1;
+    if (threads > MAX_INGEST_THREADS)
+        threads = MAX_INGEST_THREADS;
+    return threads;
+}
+
+// Restore the min-heap of runs below slot i, runs are ordered by the key
+// at their head
+void mergeHeapDown(key_run runs[], const size_t heads[], int heap[], int size, int i) {
+    while (true) {
+        int least = i, left = 2 * i + 1, right = left + 1;
+        if (left < size &&
+            runs[heap[left]].keys[heads[heap[left]]] < runs[heap[least]].keys[heads[heap[least]]])
+            least = left;
+        if (right < size &&
+            runs[heap[right]].keys[heads[heap[right]]] < runs[heap[least]].keys[heads[heap[least]]])
+            least = right;
+        if (least == i)
+            return;
+        int swap = heap[i];
+        heap[i] = heap[least];
+        heap[least] = swap;
+        i = least;
+    }
+}
+
+// Merge sorted, unique runs into one sorted array without duplicates. A
+// min-heap of the runs picks the next key in O(log runs).
+uint32_t *mergeRuns(key_run runs[], int run_count, size_t *count) {
+    size_t total = 0;
+    for (int r = 0; r < run_count; r++)
+        total += runs[r].count;
+
+    uint32_t *keys = malloc((total > 0 ? total : 1) * sizeof(uint32_t));
+    size_t heads[MAX_INGEST_THREADS] = {0};
+    int heap[MAX_INGEST_THREADS];
+    int size = 0;
+    if (keys == NULL) {
+        perror("Merged keys.");
+        exit(EXIT_FAILURE);
+    }
+    for (int r = 0; r < run_count; r++)
+        if (runs[r].count > 0)
+            heap[size++] = r;
+    for (int i = size / 2 - 1; i >= 0; i--)
+        mergeHeapDown(runs, heads, heap, size, i);
+
+    *count = 0;
+    while (size > 0) {
+        int best = heap[0];
+        uint32_t key = runs[best].keys[heads[best]++];
+        if (*count == 0 || keys[*count - 1] != key)
+            keys[(*count)++] = key;
+        if (heads[best] == runs[best].count)
+            heap[0] = heap[--size];
+        mergeHeapDown(runs, heads, heap, size, 0);
+    }
+    return keys;
+}
+
+typedef enum {
+    KEY_SORT_QSORT,
+    KEY_SORT_RADIX,
+    KEY_SORT_PARALLEL_RADIX,
+    KEY_SORT_METHOD_COUNT
+} key_sort_method;
+
+const char *key_sort_names[KEY_SORT_METHOD_COUNT] = {
+    "qsort", "radix", "parallel-radix"
+};
+
+// below this many keys the parallel variant sorts on one thread
+#define PARALLEL_SORT_MIN_KEYS 65536
+
+key_sort_method key_sort = KEY_SORT_RADIX;
+
+// Method by name, returns false if the name is unknown
+bool parse_key_sort_method(const char *name, key_sort_method *method) {
+    for (int m = 0; m < KEY_SORT_METHOD_COUNT; m++) {
+        if (strcmp(name, key_sort_names[m]) == 0) {
+            *method = m;
+            return true;
+        }
+    }
+    return false;
+}
+
+void radix_sort_and_deduplicate(uint32_t *keys, size_t *count) {
+    size_t n = *count;
+    if (n <= 1) return;
+
+    // one read for the digit counts of all four passes
+    size_t hist[4][256] = {{0}};
+    for (size_t i = 0; i < n; i++) {
+        uint32_t k = keys[i];
+        hist[0][k & 255]++;
+        hist[1][(k >> 8) & 255]++;
+        hist[2][(k >> 16) & 255]++;
+        hist[3][k >> 24]++;
+    }
+
+    // a pass is skipped when every key has the same digit there
+    int passes[4];
+    int pass_count = 0;
+    for (int b = 0; b < 4; b++) {
+        if (hist[b][(keys[0] >> (8 * b)) & 255] != n)
+            passes[pass_count++] = b;
+    }
+    if (pass_count == 0) {
+        *count = 1;
+        return;
+    }
+
+    uint32_t *tmp = malloc(n * sizeof(uint32_t));
+    if (tmp == NULL) {
+        perror("Radix sort buffer.");
+        exit(EXIT_FAILURE);
+    }
+    uint32_t *src = keys, *dst = tmp;
+    for (int p = 0; p < pass_count; p++) {
+        int shift = 8 * passes[p];
+        size_t offsets[256], starts[256];
+        size_t sum = 0;
+        for (int d = 0; d < 256; d++) {
+            starts[d] = offsets[d] = sum;
+            sum += hist[passes[p]][d];
+        }
+
+        if (p < pass_count - 1) {
+            for (size_t i = 0; i < n; i++)
+                dst[offsets[(src[i] >> shift) & 255]++] = src[i];
+        } else {
+            // Keys reach their bucket in sorted order on the last pass, so
+            // a duplicate always equals the key written just before it
+            for (size_t i = 0; i < n; i++) {
+                int d = (src[i] >> shift) & 255;
+                size_t pos = offsets[d];
+                if (pos > starts[d] && dst[pos - 1] == src[i])
+                    continue;
+                dst[pos] = src[i];
+                offsets[d]++;
+            }
+            size_t out = 0;
+            for (int d = 0; d < 256; d++) {
+                size_t len = offsets[d] - starts[d];
+                if (out != starts[d])
+                    memmove(dst + out, dst + starts[d], len * sizeof(uint32_t));
+                out += len;
+            }
+            n = out;
+        }
+        uint32_t *swap = src;
+        src = dst;
+        dst = swap;
+    }
+    if (src != keys)
+        memcpy(keys, src, n * sizeof(uint32_t));
+    free(tmp);
+    *count = n;
+}
+
+// Shared state of one parallel sort. Every thread counts the top byte of
+// its slice, then all threads scatter their slices by top byte into tmp
+// at once, so bucket d holds the keys with top byte d. The buckets are
+// cut into one range of similar size per thread; ranges hold disjoint
+// keys, so after each thread sorts and dedups its own range the results
+// only need to be concatenated.
+typedef struct radix_partition {
+    uint32_t *keys, *tmp;
+    size_t n;
+    int threads;
+    size_t hist[MAX_INGEST_THREADS][256];
+    size_t unique[MAX_INGEST_THREADS]; // keys left in each range
+    pthread_barrier_t barrier;
+} radix_partition;
+
+typedef struct radix_task {
+    radix_partition *shared;
+    int index;
+    pthread_t thread;
+} radix_task;
+
+void *radixWorker(void *arg) {
+    radix_task *task = arg;
+    radix_partition *p = task->shared;
+    int t = task->index;
+    size_t begin = p->n * t / p->threads;
+    size_t end = p->n * (t + 1) / p->threads;
+
+    for (size_t i = begin; i < end; i++)
+        p->hist[t][p->keys[i] >> 24]++;
+    pthread_barrier_wait(&p->barrier);
+
+    // the slice of this thread goes after the same bucket of the threads
+    // before it. Bucket d belongs to the range of thread
+    // starts[d] * threads / n, so the ranges are contiguous.
+    size_t offsets[256], starts[257] = {0};
+    size_t range_begin = 0, range_end = 0;
+    bool owns = false;
+    for (int d = 0; d < 256; d++) {
+        offsets[d] = starts[d];
+        for (int u = 0; u < p->threads; u++) {
+            if (u < t)
+                offsets[d] += p->hist[u][d];
+            starts[d + 1] += p->hist[u][d];
+        }
+        starts[d + 1] += starts[d];
+        if ((int)(starts[d] * p->threads / p->n) == t) {
+            if (!owns)
+                range_begin = starts[d];
+            owns = true;
+            range_end = starts[d + 1];
+        }
+    }
+    for (size_t i = begin; i < end; i++)
+        p->tmp[offsets[p->keys[i] >> 24]++] = p->keys[i];
+    pthread_barrier_wait(&p->barrier);
+
+    size_t count = range_end - range_begin;
+    radix_sort_and_deduplicate(p->tmp + range_begin, &count);
+    p->unique[t] = count;
+    pthread_barrier_wait(&p->barrier);
+
+    size_t out = 0;
+    for (int u = 0; u < t; u++)
+        out += p->unique[u];
+    memcpy(p->keys + out, p->tmp + range_begin, count * sizeof(uint32_t));
+    return NULL;
+}
+
+// threads = 0 uses all online CPUs
+void parallel_radix_sort_and_deduplicate(uint32_t *keys, size_t *count, int threads) {
+    size_t n = *count;
+    threads = ingestThreadCount(threads);
+    if (threads == 1 || n < PARALLEL_SORT_MIN_KEYS) {
+        radix_sort_and_deduplicate(keys, count);
+        return;
+    }
+
+    radix_partition *p = calloc(1, sizeof(radix_partition));
+    radix_task tasks[MAX_INGEST_THREADS];
+    if (p == NULL || (p->tmp = malloc(n * sizeof(uint32_t))) == NULL) {
+        perror("Parallel sort buffer.");
+        exit(EXIT_FAILURE);
+    }
+    p->keys = keys;
+    p->n = n;
+    p->threads = threads;
+    pthread_barrier_init(&p->barrier, NULL, threads);
+    for (int t = 0; t < threads; t++) {
+        tasks[t].shared = p;
+        tasks[t].index = t;
+        int error = pthread_create(&tasks[t].thread, NULL, radixWorker, &tasks[t]);
+        if (error != 0) {
+            fprintf(stderr, "Sort thread: %s\n", strerror(error));
+            exit(EXIT_FAILURE);
+        }
+    }
+    *count = 0;
+    for (int t = 0; t < threads; t++) {
+        pthread_join(tasks[t].thread, NULL);
+        *count += p->unique[t];
+    }
+    pthread_barrier_destroy(&p->barrier);
+    free(p->tmp);
+    free(p);
+}
+
+// Sort and dedup keys in place for bulk_load()
+void prepare_keys(uint32_t *keys, size_t *count, key_sort_method method) {
+    switch (method) {
+    case KEY_SORT_QSORT:
+        sort_and_deduplicate(keys, count);
+        break;
+    case KEY_SORT_PARALLEL_RADIX:
+        parallel_radix_sort_and_deduplicate(keys, count, INGEST_THREADS);
+        break;
+    default:
+        radix_sort_and_deduplicate(keys, count);
+        break;
+    }
+}
+
+
+// Parallel ingestion
+//
+// The mapped file is cut into chunks at line boundaries. Each worker thread
+// parses and hashes its chunk into a private run. With the qsort and radix
+// methods every worker then sorts and dedups its run and the sorted runs
+// are merged into the key array handed to bulk_load(). With parallel-radix
+// the workers only parse, and the runs are joined into one array that
+// parallel_radix_sort_and_deduplicate() sorts with every thread.
+
+typedef struct ingest_task {
+    csv_cursor cursor;
+    key_run run;
+    long long rows;
+    pthread_t thread;
+} ingest_task;
+
+// Cursor over [begin, end), both on line boundaries
+void csvCursorRange(csv_cursor *cursor, const char *begin, const char *end) {
+    cursor->pos = begin;
+    cursor->end = end;
+    cursor->dropped = begin;
+    cursor->drop_consumed = false;
+}
+
+// Split the data rows of the file into at most chunks ranges of similar
+// size, returns the number of ranges written to cursors
+int csvSplitChunks(const csv_file *file, int chunks, csv_cursor cursors[]) {
+    csv_cursor all;
+    csvCursorInit(&all, file);
+    const char *begin = all.pos;
+    size_t length = all.end - begin;
+    int count = 0;
+
+    for (int i = 0; i < chunks && begin < all.end; i++) {
+        const char *end = all.end;
+        if (i < chunks - 1) {
+            end = all.pos + length / chunks * (i + 1);
+            if (end <= begin)
+                continue;
+            const char *eol = memchr(end, '\n', all.end - end);
+            end = eol ? eol + 1 : all.end;
+        }
+        csvCursorRange(&cursors[count++], begin, end);
+        begin = end;
+    }
+    return count;
+}
+
+void *ingestWorker(void *arg) {
+    ingest_task *task = arg;
+    csv_row row;
+    size_t capacity = 1024;
+
+    task->run.keys = malloc(capacity * sizeof(uint32_t));
+    task->run.count = 0;
+    task->rows = 0;
+    if (task->run.keys == NULL) {
+        perror("Ingest run.");
+        exit(EXIT_FAILURE);
+    }
+    while (csvNextRow(&task->cursor, &row)) {
+        if (task->run.count == capacity) {
+            capacity *= 2;
+            task->run.keys = realloc(task->run.keys, capacity * sizeof(uint32_t));
+            if (task->run.keys == NULL) {
+                perror("Ingest run.");
+                exit(EXIT_FAILURE);
+            }
+        }
+        task->run.keys[task->run.count++] = csvRowKey(&row);
+        task->rows++;
+    }
+    // parallel-radix sorts all runs together once they are joined
+    if (key_sort != KEY_SORT_PARALLEL_RADIX)
+        prepare_keys(task->run.keys, &task->run.count, key_sort);
+    return NULL;
+}
+
+// Sorted, unique department keys of the file using the given number of
+// threads (0 = all CPUs). rows is set to the number of rows read.
+uint32_t *csvSortedKeysParallel(const csv_file *file, int threads,
+        size_t *count, long long *rows) {
+    csv_cursor cursors[MAX_INGEST_THREADS];
+    ingest_task tasks[MAX_INGEST_THREADS];
+    key_run runs[MAX_INGEST_THREADS];
+
+    int chunks = csvSplitChunks(file, ingestThreadCount(threads), cursors);
+    for (int i = 0; i < chunks; i++) {
+        tasks[i].cursor = cursors[i];
+        int error = pthread_create(&tasks[i].thread, NULL, ingestWorker, &tasks[i]);
+        if (error != 0) {
+            fprintf(stderr, "Ingest thread: %s\n", strerror(error));
+            exit(EXIT_FAILURE);
+        }
+    }
+    *rows = 0;
+    for (int i = 0; i < chunks; i++) {
+        pthread_join(tasks[i].thread, NULL);
+        runs[i] = tasks[i].run;
+        *rows += tasks[i].rows;
+    }
+    if (key_sort != KEY_SORT_PARALLEL_RADIX) {
+        uint32_t *keys = mergeRuns(runs, chunks, count);
+        for (int i = 0; i < chunks; i++)
+            free(runs[i].keys);
+        return keys;
+    }
+
+    // the runs are unsorted, join them and sort once on every thread
+    size_t total = 0;
+    for (int i = 0; i < chunks; i++)
+        total += runs[i].count;
+    uint32_t *keys = malloc((total > 0 ? total : 1) * sizeof(uint32_t));
+    if (keys == NULL) {
+        perror("Ingest keys.");
+        exit(EXIT_FAILURE);
+    }
+    *count = 0;
+    for (int i = 0; i < chunks; i++) {
+        memcpy(keys + *count, runs[i].keys, runs[i].count * sizeof(uint32_t));
+        *count += runs[i].count;
+        free(runs[i].keys);
+    }
+    parallel_radix_sort_and_deduplicate(keys, count, threads);
+    return keys;
+}
+
+// Snapshot of a bulk loaded tree
+//
+// write_snapshot() stores a bulk loaded tree and its rows in one file that
+// uses byte offsets from the start of the file instead of pointers. Nodes
+// are written level by level from the root, leaves last and in key order,
+// followed by the rows of every key packed in key order. open_snapshot()
+// maps the file read-only and queries run on the mapping directly, with
+// nothing to parse or rebuild. It checks every offset in the header and
+// the nodes before the first query, so a truncated or damaged file is
+// rejected instead of read out of bounds. The header records the size and
+// modification time of the CSV the snapshot was built from, and
+// main.exe 6 rebuilds the snapshot when the CSV has changed since.
+
+#define SNAPSHOT_MAGIC "BPTSNAP2"
+#define SNAPSHOT_PATH "yok_atlas.snap"
+
+typedef struct snapshot_header {
+    char magic[8];
+    uint32_t order;       // ORDER of the writer, nodes have the same shape
+    uint32_t record_size; // sizeof(CSVRecord) of the writer
+    uint64_t node_count;
+    uint64_t root;        // offset of the root node, 0 for an empty tree
+    uint64_t rows;        // offset of the first row
+    uint64_t row_count;
+    uint64_t file_size;
+    uint64_t source_size;     // of the CSV, 0 when not built from a file
+    int64_t source_mtime_ns;
+} snapshot_header;
+
+typedef struct snapshot_node {
+    uint32_t is_leaf;
+    uint32_t num_keys;
+    uint32_t keys[ORDER - 1];
+    // Inner: offsets of the children. Leaf: the run of rows of each key as
+    // first row << 32 | row count, and the offset of the next leaf (0 for
+    // the last one) in links[ORDER - 1].
+    uint64_t links[ORDER];
+} snapshot_node;
+
+typedef struct snapshot {
+    const char *base;
+    size_t size;
+    const snapshot_header *header;
+    const CSVRecord *rows;
+} snapshot;
+
+// Header padded to a cache line, nodes start right after it
+#define SNAPSHOT_NODES_OFFSET \
+    ((sizeof(snapshot_header) + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE * CACHE_LINE_SIZE)
+
+// source is the stat of the CSV the tree was loaded from, or NULL
+bool write_snapshot(Node_bulkload* root, const char *path, const struct stat *source) {
+    snapshot_header header = {0};
+    Node_bulkload** queue = NULL;
+    uint64_t count = 0, capacity = 0;
+
+    // breadth first order: every level left to right, leaves last
+    if (root != NULL) {
+        capacity = 1024;
+        queue = malloc(capacity * sizeof(Node_bulkload*));
+        if (queue == NULL) {
+            perror("Snapshot node queue.");
+            exit(EXIT_FAILURE);
+        }
+        queue[count++] = root;
+        for (uint64_t i = 0; i < count; i++) {
+            if (queue[i]->is_leaf)
+                continue;
+            for (int j = 0; j <= queue[i]->num_keys; j++) {
+                if (count == capacity) {
+                    capacity *= 2;
+                    queue = realloc(queue, capacity * sizeof(Node_bulkload*));
+                    if (queue == NULL) {
+                        perror("Snapshot node queue.");
+                        exit(EXIT_FAILURE);
+                    }
+                }
+                queue[count++] = queue[i]->children[j];
+            }
+        }
+    }
+
+    FILE* out = fopen(path, "wb");
+    if (out == NULL) {
+        perror("Error creating snapshot");
+        free(queue);
+        return false;
+    }
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.order = ORDER;
+    header.record_size = sizeof(CSVRecord);
+    header.node_count = count;
+    header.root = count > 0 ? SNAPSHOT_NODES_OFFSET : 0;
+    header.rows = SNAPSHOT_NODES_OFFSET + count * sizeof(snapshot_node);
+    if (source != NULL) {
+        header.source_size = (uint64_t)source->st_size;
+        header.source_mtime_ns = (int64_t)source->st_mtim.tv_sec * 1000000000 +
+                                 source->st_mtim.tv_nsec;
+    }
+    char pad[SNAPSHOT_NODES_OFFSET] = {0};
+    fwrite(pad, 1, SNAPSHOT_NODES_OFFSET, out);
+
+    // the children of node i follow those of the inner nodes before it
+    uint64_t next_child = 1;
+    for (uint64_t i = 0; i < count; i++) {
+        Node_bulkload* n = queue[i];
+        snapshot_node s = {0};
+        s.is_leaf = n->is_leaf;
+        s.num_keys = n->num_keys;
+        memcpy(s.keys, n->keys, sizeof(s.keys));
+        if (!n->is_leaf) {
+            for (int j = 0; j <= n->num_keys; j++)
+                s.links[j] = SNAPSHOT_NODES_OFFSET + next_child++ * sizeof(snapshot_node);
+        } else {
+            for (int j = 0; j < n->num_keys; j++) {
+                s.links[j] = header.row_count << 32 | (uint32_t)n->values[j].count;
+                header.row_count += n->values[j].count;
+            }
+            if (n->next != NULL)
+                s.links[ORDER - 1] = SNAPSHOT_NODES_OFFSET + (i + 1) * sizeof(snapshot_node);
+        }
+        fwrite(&s, sizeof(s), 1, out);
+    }
+
+    for (uint64_t i = 0; i < count; i++) {
+        Node_bulkload* n = queue[i];
+        if (!n->is_leaf)
+            continue;
+        for (int j = 0; j < n->num_keys; j++)
+            if (n->values[j].count > 0)
+                fwrite(n->values[j].rows, sizeof(CSVRecord), n->values[j].count, out);
+    }
+    header.file_size = header.rows + header.row_count * sizeof(CSVRecord);
+
+    fseek(out, 0, SEEK_SET);
+    fwrite(&header, sizeof(header), 1, out);
+    bool ok = !ferror(out);
+    if (fclose(out) != 0 || !ok) {
+        perror("Error writing snapshot");
+        ok = false;
+    }
+    free(queue);
+    return ok;
+}
+
+// Offset of a node written after the node at after
+bool snapshot_node_offset_ok(const snapshot_header *h, uint64_t offset, uint64_t after) {
+    return offset > after && offset < h->rows &&
+           (offset - SNAPSHOT_NODES_OFFSET) % sizeof(snapshot_node) == 0;
+}
+
+// The header matches the file size and every node offset and row run
+// points inside the file. Nodes only link to nodes written after them, so
+// neither a descent nor a leaf walk can loop.
+bool check_snapshot(const snapshot *s) {
+    const snapshot_header *h = s->header;
+    if (h->file_size != s->size || s->size < SNAPSHOT_NODES_OFFSET)
+        return false;
+    // nodes end where the rows start, and the rows end with the file
+    if (h->node_count > (s->size - SNAPSHOT_NODES_OFFSET) / sizeof(snapshot_node) ||
+        h->rows != SNAPSHOT_NODES_OFFSET + h->node_count * sizeof(snapshot_node) ||
+        h->row_count > (s->size - h->rows) / sizeof(CSVRecord) ||
+        h->rows + h->row_count * sizeof(CSVRecord) != s->size)
+        return false;
+    if (h->root != (h->node_count > 0 ? SNAPSHOT_NODES_OFFSET : 0))
+        return false;
+
+    for (uint64_t i = 0; i < h->node_count; i++) {
+        uint64_t offset = SNAPSHOT_NODES_OFFSET + i * sizeof(snapshot_node);
+        const snapshot_node* n = (const snapshot_node*)(s->base + offset);
+        if (n->is_leaf > 1 || n->num_keys > ORDER - 1)
+            return false;
+        if (!n->is_leaf) {
+            for (uint32_t j = 0; j <= n->num_keys; j++)
+                if (!snapshot_node_offset_ok(h, n->links[j], offset))
+                    return false;
+            continue;
+        }
+        for (uint32_t j = 0; j < n->num_keys; j++) {
+            uint64_t first = n->links[j] >> 32, count = (uint32_t)n->links[j];
+            if (first > h->row_count || count > h->row_count - first)
+                return false;
+        }
+        uint64_t next = n->links[ORDER - 1];
+        if (next != 0 && (!snapshot_node_offset_ok(h, next, offset) ||
+                          !((const snapshot_node*)(s->base + next))->is_leaf))
+            return false;
+    }
+    return true;
+}
+
+bool open_snapshot(snapshot *s, const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror("Error opening snapshot");
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(snapshot_header)) {
+        printf("%s is not a snapshot.\n", path);
+        close(fd);
+        return false;
+    }
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        perror("Error mapping snapshot");
+        return false;
+    }
+    s->base = data;
+    s->size = (size_t)st.st_size;
+    s->header = data;
+    if (memcmp(s->header->magic, SNAPSHOT_MAGIC, sizeof(s->header->magic)) != 0 ||
+        s->header->order != ORDER || s->header->record_size != sizeof(CSVRecord)) {
+        printf("%s is not a snapshot of this build.\n", path);
+        munmap(data, s->size);
+        return false;
+    }
+    if (!check_snapshot(s)) {
+        printf("%s is damaged.\n", path);
+        munmap(data, s->size);
+        return false;
+    }
+    s->rows = (const CSVRecord*)(s->base + s->header->rows);
+    return true;
+}
+
+// True when the snapshot was built from a file of source's size and
+// modification time
+bool snapshot_matches_source(const snapshot *s, const struct stat *source) {
+    return s->header->source_size == (uint64_t)source->st_size &&
+           s->header->source_mtime_ns == (int64_t)source->st_mtim.tv_sec * 1000000000 +
+                                         source->st_mtim.tv_nsec;
+}
+
+void close_snapshot(snapshot *s) {
+    munmap((void *)s->base, s->size);
+    memset(s, 0, sizeof(*s));
+}
+
+const snapshot_node* snapshot_node_at(const snapshot *s, uint64_t offset) {
+    return (const snapshot_node*)(s->base + offset);
+}
+
+// Descend to the leaf that may contain key
+const snapshot_node* findLeaf_snapshot(const snapshot *s, uint32_t key) {
+    if (s->header->root == 0) return NULL;
+    const snapshot_node* c = snapshot_node_at(s, s->header->root);
+    while (!c->is_leaf) {
+        uint32_t i = 0;
+        while (i < c->num_keys && key >= c->keys[i])
+            i++;
+        c = snapshot_node_at(s, c->links[i]);
+    }
+    return c;
+}
+
+// Run of rows of key as first row << 32 | row count, false when the key is
+// not in the snapshot
+bool find_snapshot(const snapshot *s, uint32_t key, uint64_t *run) {
+    const snapshot_node* leaf = findLeaf_snapshot(s, key);
+    if (leaf == NULL) return false;
+    for (uint32_t i = 0; i < leaf->num_keys; i++) {
+        if (leaf->keys[i] == key) {
+            *run = leaf->links[i];
+            return true;
+        }
+    }
+    return false;
+}
+
+// Row at rank (1 is the highest score) among the rows of key. With a
+// department only its own rows are counted, departments whose names
+// collide on the key share a run.
+const CSVRecord* rank_snapshot(const snapshot *s, uint32_t key,
+        const char *department, int rank) {
+    uint64_t run;
+    if (rank < 1 || !find_snapshot(s, key, &run)) return NULL;
+    const CSVRecord* rows = s->rows + (run >> 32);
+    uint32_t count = (uint32_t)run;
+    if (department == NULL)
+        return (uint32_t)rank <= count ? &rows[rank - 1] : NULL;
+    for (uint32_t i = 0; i < count; i++) {
+        if (strncmp(rows[i].department, department, MAX_KEY_LEN) == 0 && --rank == 0)
+            return &rows[i];
+    }
+    return NULL;
+}
+
+// Collect keys in [key_start, key_end] by walking the leaf chain,
+// at most max_found entries are written
+int findRange_snapshot(const snapshot *s, uint32_t key_start, uint32_t key_end,
+        int max_found, uint32_t returned_keys[], uint64_t returned_runs[]) {
+    int num_found = 0;
+    const snapshot_node* n = findLeaf_snapshot(s, key_start);
+    uint32_t i = 0;
+    if (n == NULL) return 0;
+    while (i < n->num_keys && n->keys[i] < key_start)
+        i++;
+    while (num_found < max_found) {
+        for (; i < n->num_keys && num_found < max_found; i++) {
+            if (n->keys[i] > key_end)
+                return num_found;
+            returned_keys[num_found] = n->keys[i];
+            returned_runs[num_found] = n->links[i];
+            num_found++;
+        }
+        if (n->links[ORDER - 1] == 0)
+            break;
+        n = snapshot_node_at(s, n->links[ORDER - 1]);
+        i = 0;
+    }
+    return num_found;
+}
+
+// Bulk load the department keys of the file and attach every row to its
+// key, as main.exe 2 does. The postings arrays come from rows_mem.
+Node_bulkload* bulk_load_csv(const csv_file *file, double fill_factor,
+                             tree_memory *rows_mem) {
+    csv_cursor cursor;
+    csv_row row;
+    size_t key_count;
+    long long row_count;
+
+    uint32_t* keys = csvSortedKeysParallel(file, INGEST_THREADS, &key_count, &row_count);
+    Node_bulkload* root = bulk_load(keys, key_count, fill_factor);
+    free(keys);
+
+    csvCursorInit(&cursor, file);
+    cursor.drop_consumed = true;
+    while (csvNextRow(&cursor, &row))
+        postingsAppendRow(rows_mem, find_bulkload(root, csvRowKey(&row)), &row);
+
+    // the tree is read-only from here on, so sort every key now
+    Node_bulkload* leaf = root;
+    while (leaf != NULL && !leaf->is_leaf)
+        leaf = leaf->children[0];
+    for (; leaf != NULL; leaf = leaf->next)
+        for (int i = 0; i < leaf->num_keys; i++)
+            postingsSort(&leaf->values[i]);
+    return root;
+}
+
+// Epoch based reclamation
+//
+// Objects unlinked from a structure that other threads read without locks
+// are retired instead of freed, and freed once no thread can still hold a
+// pointer to them. Each thread owns a slot of the domain. A thread pins the
+// slot around a traversal, which announces the global epoch it started
+// in; that store and a fence are the only atomics a reader adds. The
+// global epoch moves on when every pinned slot has announced the current
+// one, so an object retired in epoch e is unreachable for every thread
+// once the global epoch reaches e + 2. Retired objects wait in the slot of
+// the thread that retired them and are freed in batches.
+
+#define EPOCH_MAX_THREADS 64
+// try to advance the epoch and free after this many retires
+#define EPOCH_RETIRE_BATCH 64
+
+typedef struct epoch_retired {
+  void *object;
+  void (*release)(void *);
+  uint64_t epoch;
+} epoch_retired;
+
+typedef struct epoch_domain epoch_domain;
+
+typedef struct epoch_slot {
+  _Alignas(CACHE_LINE_SIZE) _Atomic uint64_t announced; // epoch << 1 | 1 while pinned, 0 otherwise
+  _Atomic bool in_use;
+  epoch_domain *domain;
+  int pins; // nested pins only announce once
+  epoch_retired *retired; // oldest first
+  int retired_count;
+  int retired_capacity;
+} epoch_slot;
+
+struct epoch_domain {
+  _Atomic uint64_t epoch;
+  _Atomic unsigned long long retired;
+  _Atomic unsigned long long freed;
+  epoch_slot slots[EPOCH_MAX_THREADS];
+};
+
+void epochInit(epoch_domain *d) {
+  memset(d, 0, sizeof(*d));
+  atomic_init(&d->epoch, 1);
+  for (int i = 0; i < EPOCH_MAX_THREADS; i++)
+    d->slots[i].domain = d;
+}
+
+// Claim a slot for the calling thread. Objects left in a slot by an
+// earlier thread are freed by whoever claims it next.
+epoch_slot *epochRegister(epoch_domain *d) {
+  for (int i = 0; i < EPOCH_MAX_THREADS; i++) {
+    bool expected = false;
+    if (atomic_compare_exchange_strong(&d->slots[i].in_use, &expected, true)) {
+      d->slots[i].pins = 0;
+      return &d->slots[i];
+    }
+  }
+  fprintf(stderr, "More than %d threads in one epoch domain.\n", EPOCH_MAX_THREADS);
+  exit(EXIT_FAILURE);
+}
+
+void epochPin(epoch_slot *self) {
+  if (self->pins++ > 0)
+    return;
+  uint64_t epoch = atomic_load_explicit(&self->domain->epoch, memory_order_relaxed);
+  atomic_store_explicit(&self->announced, epoch << 1 | 1, memory_order_relaxed);
+  // the announcement must be visible before any shared pointer is read
+  atomic_thread_fence(memory_order_seq_cst);
+}
+
+void epochUnpin(epoch_slot *self) {
+  if (--self->pins > 0)
+    return;
+  atomic_store_explicit(&self->announced, 0, memory_order_release);
+}
+
+// Advance the global epoch if every pinned thread has seen it, then free
+// the objects of this slot that no thread can reach any more
+void epochCollect(epoch_slot *self) {
+  epoch_domain *d = self->domain;
+  uint64_t epoch = atomic_load(&d->epoch);
+  bool current = true;
+
+  atomic_thread_fence(memory_order_seq_cst);
+  for (int i = 0; i < EPOCH_MAX_THREADS && current; i++) {
+    uint64_t announced = atomic_load_explicit(&d->slots[i].announced, memory_order_acquire);
+    if ((announced & 1) && announced >> 1 != epoch)
+      current = false;
+  }
+  if (current) {
+    atomic_compare_exchange_strong(&d->epoch, &epoch, epoch + 1);
+    epoch = atomic_load(&d->epoch);
+  }
+
+  int freed = 0;
+  while (freed < self->retired_count && self->retired[freed].epoch + 2 <= epoch) {
+    self->retired[freed].release(self->retired[freed].object);
+    freed++;
+  }
+  if (freed == 0)
+    return;
+  memmove(self->retired, self->retired + freed,
+          (self->retired_count - freed) * sizeof(epoch_retired));
+  self->retired_count -= freed;
+  atomic_fetch_add_explicit(&d->freed, freed, memory_order_relaxed);
+}
+
+// Release the slot, pending objects stay in it
+void epochUnregister(epoch_slot *self) {
+  epochCollect(self);
+  atomic_store_explicit(&self->announced, 0, memory_order_release);
+  atomic_store(&self->in_use, false);
+}
+
+// Free object with release once no pinned thread can still see it
+void epochRetire(epoch_slot *self, void *object, void (*release)(void *)) {
+  if (self->retired_count == self->retired_capacity) {
+    int capacity = self->retired_capacity ? self->retired_capacity * 2 : EPOCH_RETIRE_BATCH;
+    epoch_retired *grown = realloc(self->retired, capacity * sizeof(epoch_retired));
+    if (grown == NULL) {
+      perror("Retired objects.");
+      exit(EXIT_FAILURE);
+    }
+    self->retired = grown;
+    self->retired_capacity = capacity;
+  }
+  self->retired[self->retired_count++] = (epoch_retired){
+      object, release, atomic_load(&self->domain->epoch)};
+  atomic_fetch_add_explicit(&self->domain->retired, 1, memory_order_relaxed);
+  if (self->retired_count % EPOCH_RETIRE_BATCH == 0)
+    epochCollect(self);
+}
+
+// Free everything still retired, no thread may use the domain any more
+void epochDestroy(epoch_domain *d) {
+  for (int i = 0; i < EPOCH_MAX_THREADS; i++) {
+    epoch_slot *s = &d->slots[i];
+    for (int j = 0; j < s->retired_count; j++)
+      s->retired[j].release(s->retired[j].object);
+    atomic_fetch_add_explicit(&d->freed, s->retired_count, memory_order_relaxed);
+    free(s->retired);
+    s->retired = NULL;
+    s->retired_count = s->retired_capacity = 0;
+  }
+}
+
+// Concurrent B + tree
+//
+// A tree that reader threads can search while writer threads insert. Its
+// state (the root, the order and the counters) lives in a tree_handle
+// instead of globals, so several trees can be used at once. Every node
+// carries a version word for optimistic lock coupling: a reader notes the
+// version of a node, reads the node and checks that the version did not
+// move, and starts over from the root when it did. Readers never write to
+// shared memory. A writer descends the same way, locks the leaf, and only
+// when the leaf is full also locks the ancestors that split with it and
+// the one that takes the new separator. Locks are only ever taken with a
+// compare-and-swap from a version seen unlocked, so a writer that loses a
+// race releases what it holds and starts over instead of waiting.
+//
+// Every operation pins the calling thread's epoch slot of the tree, and
+// nodes that a delete merges away are retired to it, so a reader that
+// followed a stale pointer still reads valid memory and its check
+// afterwards throws the result away. Values are opaque pointers owned by
+// the caller; a caller that frees deleted values retires them the same
+// way and stays pinned while it uses a value it found.
+
+// version word: locking adds OLC_LOCKED and unlocking adds it again, which
+// carries into the counter above it
+#define OLC_OBSOLETE 1
+#define OLC_LOCKED 2
+#define OLC_MIN_ORDER 3
+
+typedef struct olc_node {
+  _Atomic uint64_t version;
+  int *keys; // points into the block, after pointers
+  bool is_leaf;
+  int num_keys;
+  void *pointers[]; // leaves link to the next leaf through pointers[order - 1]
+} olc_node;
+
+typedef struct tree_handle {
+  olc_node *_Atomic root;
+  int order;
+  _Atomic unsigned long long splits;
+  _Atomic unsigned long long restarts; // descents started over
+  _Atomic unsigned long long nodes;
+  epoch_domain epochs; // each thread registers a slot here
+} tree_handle;
+
+olc_node *olcMakeNode(tree_handle *t, bool is_leaf) {
+  size_t size = sizeof(olc_node) + t->order * sizeof(void *) +
+                (t->order - 1) * sizeof(int);
+  size = (size + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE * CACHE_LINE_SIZE;
+  olc_node *n = aligned_alloc(CACHE_LINE_SIZE, size);
+  if (n == NULL) {
+    perror("Concurrent tree node.");
+    exit(EXIT_FAILURE);
+  }
+  memset(n, 0, size);
+  atomic_init(&n->version, 0);
+  n->keys = (int *)(n->pointers + t->order);
+  n->is_leaf = is_leaf;
+  atomic_fetch_add_explicit(&t->nodes, 1, memory_order_relaxed);
+  return n;
+}
+
+// Start an empty tree, the root is an empty leaf
+void olcInit(tree_handle *t, int order) {
+  memset(t, 0, sizeof(*t));
+  t->order = order < OLC_MIN_ORDER ? OLC_MIN_ORDER : order;
+  epochInit(&t->epochs);
+  atomic_init(&t->root, olcMakeNode(t, true));
+}
+
+void olcFreeNode(olc_node *n) {
+  if (!n->is_leaf) {
+    for (int i = 0; i <= n->num_keys; i++)
+      olcFreeNode(n->pointers[i]);
+  }
+  free(n);
+}
+
+// Free every node, no other thread may use the tree any more
+void olcDestroy(tree_handle *t) {
+  olcFreeNode(atomic_load(&t->root));
+  epochDestroy(&t->epochs);
+  memset(t, 0, sizeof(*t));
+}
+
+// Version of n if it is unlocked, false when a writer holds it
+bool olcReadLock(olc_node *n, uint64_t *version) {
+  *version = atomic_load_explicit(&n->version, memory_order_acquire);
+  return (*version & (OLC_LOCKED | OLC_OBSOLETE)) == 0;
+}
+
+// True when n did not change since its version was read
+bool olcValidate(olc_node *n, uint64_t version) {
+  atomic_thread_fence(memory_order_acquire);
+  return atomic_load_explicit(&n->version, memory_order_relaxed) == version;
+}
+
+// Lock n if it is still at version, never waits
+bool olcUpgrade(olc_node *n, uint64_t version) {
+  return atomic_compare_exchange_strong_explicit(
+      &n->version, &version, version + OLC_LOCKED,
+      memory_order_acquire, memory_order_relaxed);
+}
+
+void olcUnlock(olc_node *n) {
+  atomic_fetch_add_explicit(&n->version, OLC_LOCKED, memory_order_release);
+}
+
+// Unlock a node that was unlinked from the tree, readers that reach it
+// start over
+void olcUnlockObsolete(olc_node *n) {
+  atomic_fetch_add_explicit(&n->version, OLC_LOCKED | OLC_OBSOLETE,
+                            memory_order_release);
+}
+
+// Count a restart and back off: spin first, then give the CPU to the
+// writer that is in the way
+void olcRestart(tree_handle *t, int attempt) {
+  atomic_fetch_add_explicit(&t->restarts, 1, memory_order_relaxed);
+  if (attempt < 8) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+  } else {
+    sched_yield();
+  }
+}
+
+// Descend to the leaf that may contain key without taking locks. The leaf
+// was unlocked at *version; callers validate it again after reading it.
+// With path set, the inner nodes passed and their versions are recorded,
+// path[depth - 1] being the parent of the leaf.
+olc_node *olcFindLeaf(tree_handle *t, int key, uint64_t *version,
+                      olc_node *path[], uint64_t versions[], int *depth) {
+  olc_node *n, *child;
+  uint64_t v, child_version;
+  int attempt = 0;
+
+restart:
+  if (attempt > 0)
+    olcRestart(t, attempt);
+  attempt++;
+  if (depth != NULL)
+    *depth = 0;
+  n = atomic_load_explicit(&t->root, memory_order_acquire);
+  // a root split locks the old root before replacing it
+  if (!olcReadLock(n, &v) || n != atomic_load_explicit(&t->root, memory_order_acquire))
+    goto restart;
+  while (!n->is_leaf) {
+    // num_keys may be torn by a writer but never exceeds order - 1
+    child = n->pointers[nodeUpperBound(n->keys, n->num_keys, key)];
+    if (!olcValidate(n, v))
+      goto restart;
+    if (!olcReadLock(child, &child_version) || !olcValidate(n, v))
+      goto restart;
+    if (depth != NULL) {
+      if (*depth == MAX_TREE_HEIGHT)
+        goto restart;
+      path[*depth] = n;
+      versions[*depth] = v;
+      (*depth)++;
+    }
+    n = child;
+    v = child_version;
+  }
+  *version = v;
+  return n;
+}
+
+// Value of key, NULL when the key is not in the tree
+void *olcFind(tree_handle *t, epoch_slot *self, int key) {
+  epochPin(self);
+  for (int attempt = 1; ; attempt++) {
+    uint64_t v;
+    olc_node *leaf = olcFindLeaf(t, key, &v, NULL, NULL, NULL);
+    int n = leaf->num_keys;
+    int i = nodeLowerBound(leaf->keys, n, key);
+    void *value = i < n && leaf->keys[i] == key ? leaf->pointers[i] : NULL;
+    if (olcValidate(leaf, v)) {
+      epochUnpin(self);
+      return value;
+    }
+    olcRestart(t, attempt);
+  }
+}
+
+// Collect keys in [key_start, key_end] by walking the leaf chain, at most
+// max_found entries are written. Each leaf is copied and then validated;
+// when a writer got in the way the scan descends again from the key after
+// the last one collected, so the result is sorted and has no duplicates.
+int olcFindRange(tree_handle *t, epoch_slot *self, int key_start, int key_end,
+                 int returned_keys[], void *returned_pointers[], int max_found) {
+  int num_found = 0;
+  long long from = key_start; // next key to collect
+  int attempt = 0;
+
+  epochPin(self);
+
+  while (num_found < max_found && from <= key_end) {
+    uint64_t v, next_version;
+    if (attempt > 0)
+      olcRestart(t, attempt);
+    attempt++;
+    olc_node *n = olcFindLeaf(t, (int)from, &v, NULL, NULL, NULL);
+    for (;;) {
+      int count = n->num_keys;
+      int found = num_found;
+      bool done = false;
+      for (int i = nodeLowerBound(n->keys, count, (int)from); i < count; i++) {
+        if (n->keys[i] > key_end || found == max_found) {
+          done = true;
+          break;
+        }
+        returned_keys[found] = n->keys[i];
+        returned_pointers[found] = n->pointers[i];
+        found++;
+      }
+      olc_node *next = n->pointers[t->order - 1];
+      if (!olcValidate(n, v))
+        break;
+      if (found > num_found)
+        from = (long long)returned_keys[found - 1] + 1;
+      num_found = found;
+      if (done || next == NULL) {
+        epochUnpin(self);
+        return num_found;
+      }
+      if (!olcReadLock(next, &next_version) || !olcValidate(n, v))
+        break;
+      n = next;
+      v = next_version;
+    }
+  }
+  epochUnpin(self);
+  return num_found;
+}
+
+void olcInsertIntoLeaf(olc_node *leaf, int i, int key, void *value) {
+  memmove(leaf->keys + i + 1, leaf->keys + i, (leaf->num_keys - i) * sizeof(int));
+  memmove(leaf->pointers + i + 1, leaf->pointers + i,
+          (leaf->num_keys - i) * sizeof(void *));
+  leaf->keys[i] = key;
+  leaf->pointers[i] = value;
+  leaf->num_keys++;
+}
+
+void olcInsertIntoNode(olc_node *n, int left_index, int key, olc_node *right) {
+  memmove(n->keys + left_index + 1, n->keys + left_index,
+          (n->num_keys - left_index) * sizeof(int));
+  memmove(n->pointers + left_index + 2, n->pointers + left_index + 1,
+          (n->num_keys - left_index) * sizeof(void *));
+  n->keys[left_index] = key;
+  n->pointers[left_index + 1] = right;
+  n->num_keys++;
+}
+
+// Split a full, locked leaf while inserting key at slot i, as
+// insertIntoLeafAfterSplitting() does. Returns the new right leaf, which
+// is not reachable until its separator is in the parent.
+olc_node *olcSplitLeaf(tree_handle *t, olc_node *leaf, int i, int key,
+                       void *value, int *separator) {
+  int order = t->order;
+  int temp_keys[order];
+  void *temp_pointers[order];
+  int split = cut(order - 1);
+  olc_node *right = olcMakeNode(t, true);
+
+  memcpy(temp_keys, leaf->keys, i * sizeof(int));
+  memcpy(temp_pointers, leaf->pointers, i * sizeof(void *));
+  temp_keys[i] = key;
+  temp_pointers[i] = value;
+  memcpy(temp_keys + i + 1, leaf->keys + i, (order - 1 - i) * sizeof(int));
+  memcpy(temp_pointers + i + 1, leaf->pointers + i, (order - 1 - i) * sizeof(void *));
+
+  memcpy(right->keys, temp_keys + split, (order - split) * sizeof(int));
+  memcpy(right->pointers, temp_pointers + split, (order - split) * sizeof(void *));
+  right->num_keys = order - split;
+  right->pointers[order - 1] = leaf->pointers[order - 1];
+
+  memcpy(leaf->keys, temp_keys, split * sizeof(int));
+  memcpy(leaf->pointers, temp_pointers, split * sizeof(void *));
+  for (int j = split; j < order - 1; j++)
+    leaf->pointers[j] = NULL;
+  leaf->num_keys = split;
+  leaf->pointers[order - 1] = right;
+
+  atomic_fetch_add_explicit(&t->splits, 1, memory_order_relaxed);
+  *separator = right->keys[0];
+  return right;
+}
+
+// Split a full, locked inner node while inserting key and right after the
+// child at left_index, as insertIntoNodeAfterSplitting() does
+olc_node *olcSplitNode(tree_handle *t, olc_node *old_node, int left_index,
+                       int key, olc_node *right, int *separator) {
+  int order = t->order;
+  int temp_keys[order];
+  void *temp_pointers[order + 1];
+  int i, j, split = cut(order);
+  olc_node *new_node = olcMakeNode(t, false);
+
+  for (i = 0, j = 0; i < old_node->num_keys + 1; i++, j++) {
+    if (j == left_index + 1)
+      j++;
+    temp_pointers[j] = old_node->pointers[i];
+  }
+  for (i = 0, j = 0; i < old_node->num_keys; i++, j++) {
+    if (j == left_index)
+      j++;
+    temp_keys[j] = old_node->keys[i];
+  }
+  temp_pointers[left_index + 1] = right;
+  temp_keys[left_index] = key;
+
+  for (i = 0; i < split - 1; i++) {
+    old_node->pointers[i] = temp_pointers[i];
+    old_node->keys[i] = temp_keys[i];
+  }
+  old_node->pointers[i] = temp_pointers[i];
+  old_node->num_keys = split - 1;
+  *separator = temp_keys[split - 1];
+  for (++i, j = 0; i < order; i++, j++) {
+    new_node->pointers[j] = temp_pointers[i];
+    new_node->keys[j] = temp_keys[i];
+  }
+  new_node->pointers[j] = temp_pointers[i];
+  new_node->num_keys = j;
+
+  atomic_fetch_add_explicit(&t->splits, 1, memory_order_relaxed);
+  return new_node;
+}
+
+// Insert key with value, or replace the value of an existing key. Returns
+// false when the key was already in the tree.
+bool olcInsert(tree_handle *t, epoch_slot *self, int key, void *value) {
+  olc_node *path[MAX_TREE_HEIGHT];
+  uint64_t versions[MAX_TREE_HEIGHT];
+  int depth, top, i;
+  uint64_t v;
+
+  epochPin(self);
+  for (int attempt = 0; ; attempt++) {
+    if (attempt > 0)
+      olcRestart(t, attempt);
+    olc_node *leaf = olcFindLeaf(t, key, &v, path, versions, &depth);
+    if (!olcUpgrade(leaf, v))
+      continue;
+
+    i = nodeLowerBound(leaf->keys, leaf->num_keys, key);
+    if (i < leaf->num_keys && leaf->keys[i] == key) {
+      leaf->pointers[i] = value;
+      olcUnlock(leaf);
+      epochUnpin(self);
+      return false;
+    }
+    if (leaf->num_keys < t->order - 1) {
+      olcInsertIntoLeaf(leaf, i, key, value);
+      olcUnlock(leaf);
+      epochUnpin(self);
+      return true;
+    }
+
+    // lock the full ancestors bottom up and the first one with room, the
+    // versions from the descent show that none changed since
+    bool locked = true;
+    for (top = depth; top > 0; top--) {
+      if (!olcUpgrade(path[top - 1], versions[top - 1])) {
+        locked = false;
+        break;
+      }
+      if (path[top - 1]->num_keys < t->order - 1) {
+        top--;
+        break;
+      }
+    }
+    if (!locked) {
+      // path[top .. depth - 1] are held
+      for (int d = top; d < depth; d++)
+        olcUnlock(path[d]);
+      olcUnlock(leaf);
+      continue;
+    }
+
+    // path[top .. depth - 1] and the leaf are locked
+    int separator;
+    olc_node *left = leaf;
+    olc_node *right = olcSplitLeaf(t, leaf, i, key, value, &separator);
+    for (int d = depth - 1; ; d--) {
+      if (d < 0) {
+        // left was the root, it stays locked until the new root is in place
+        olc_node *root = olcMakeNode(t, false);
+        root->keys[0] = separator;
+        root->pointers[0] = left;
+        root->pointers[1] = right;
+        root->num_keys = 1;
+        atomic_store_explicit(&t->root, root, memory_order_release);
+        break;
+      }
+      olc_node *parent = path[d];
+      int left_index = 0;
+      while (parent->pointers[left_index] != left)
+        left_index++;
+      if (parent->num_keys < t->order - 1) {
+        olcInsertIntoNode(parent, left_index, separator, right);
+        break;
+      }
+      right = olcSplitNode(t, parent, left_index, separator, right, &separator);
+      left = parent;
+    }
+    for (int d = top; d < depth; d++)
+      olcUnlock(path[d]);
+    olcUnlock(leaf);
+    epochUnpin(self);
+    return true;
+  }
+}
+
+// Merge a locked leaf with its sibling under the same parent when both fit
+// in one node. The right one of the two is emptied into the left one, so
+// the leaf chain is fixed without touching a third leaf. The parent and
+// the sibling are only tried; when either is busy the leaf stays underfull.
+// Unlocks the leaf.
+void olcMergeLeaf(tree_handle *t, epoch_slot *self, olc_node *leaf,
+                  olc_node *parent, uint64_t parent_version, bool parent_is_root) {
+  olc_node *sibling, *left, *right;
+  uint64_t sibling_version;
+  int index = 0, key_index;
+
+  if (!olcUpgrade(parent, parent_version)) {
+    olcUnlock(leaf);
+    return;
+  }
+  while (parent->pointers[index] != leaf)
+    index++;
+  if (index < parent->num_keys) {
+    sibling = parent->pointers[index + 1];
+    left = leaf;
+    right = sibling;
+    key_index = index;
+  } else {
+    sibling = index > 0 ? parent->pointers[index - 1] : NULL;
+    left = sibling;
+    right = leaf;
+    key_index = index - 1;
+  }
+  if (sibling == NULL || !olcReadLock(sibling, &sibling_version) ||
+      !olcUpgrade(sibling, sibling_version)) {
+    olcUnlock(parent);
+    olcUnlock(leaf);
+    return;
+  }
+  if (left->num_keys + right->num_keys > t->order - 1) {
+    olcUnlock(sibling);
+    olcUnlock(parent);
+    olcUnlock(leaf);
+    return;
+  }
+
+  memcpy(left->keys + left->num_keys, right->keys, right->num_keys * sizeof(int));
+  memcpy(left->pointers + left->num_keys, right->pointers,
+         right->num_keys * sizeof(void *));
+  left->num_keys += right->num_keys;
+  left->pointers[t->order - 1] = right->pointers[t->order - 1];
+  memmove(parent->keys + key_index, parent->keys + key_index + 1,
+          (parent->num_keys - key_index - 1) * sizeof(int));
+  memmove(parent->pointers + key_index + 1, parent->pointers + key_index + 2,
+          (parent->num_keys - key_index - 1) * sizeof(void *));
+  parent->num_keys--;
+  olcUnlock(left);
+  olcUnlockObsolete(right);
+  epochRetire(self, right, free);
+
+  // a root left with one child is replaced by it; other inner nodes are
+  // not merged and may keep a single child
+  if (parent_is_root && parent->num_keys == 0) {
+    atomic_store_explicit(&t->root, parent->pointers[0], memory_order_release);
+    olcUnlockObsolete(parent);
+    epochRetire(self, parent, free);
+  } else {
+    olcUnlock(parent);
+  }
+}
+
+// Remove key and return its value, NULL when the key is not in the tree.
+// Readers may still hold the value, free it through epochRetire().
+void *olcDelete(tree_handle *t, epoch_slot *self, int key) {
+  olc_node *path[MAX_TREE_HEIGHT];
+  uint64_t versions[MAX_TREE_HEIGHT];
+  int depth, i;
+  uint64_t v;
+
+  epochPin(self);
+  for (int attempt = 0; ; attempt++) {
+    if (attempt > 0)
+      olcRestart(t, attempt);
+    olc_node *leaf = olcFindLeaf(t, key, &v, path, versions, &depth);
+    if (!olcUpgrade(leaf, v))
+      continue;
+
+    i = nodeLowerBound(leaf->keys, leaf->num_keys, key);
+    if (i == leaf->num_keys || leaf->keys[i] != key) {
+      olcUnlock(leaf);
+      epochUnpin(self);
+      return NULL;
+    }
+    void *value = leaf->pointers[i];
+    memmove(leaf->keys + i, leaf->keys + i + 1, (leaf->num_keys - i - 1) * sizeof(int));
+    memmove(leaf->pointers + i, leaf->pointers + i + 1,
+            (leaf->num_keys - i - 1) * sizeof(void *));
+    leaf->num_keys--;
+
+    if (depth > 0 && leaf->num_keys < (t->order - 1) / 2)
+      olcMergeLeaf(t, self, leaf, path[depth - 1], versions[depth - 1], depth == 1);
+    else
+      olcUnlock(leaf);
+    epochUnpin(self);
+    return value;
+  }
+}
+
+
+// Tree statistics
+//
+// treeStats() and stats_bulkload() walk a tree once and fill in the same
+// tree_stats: node and key counts, bytes and fill histograms per level,
+// rows per key and the memory behind it all. Live bytes count the objects
+// the tree uses at their allocated size: whole node blocks, records and
+// postings arrays at their capacity. Reserved bytes are what the
+// allocator holds for the tree. That is the arena blocks for the node
+// tree, and malloc chunks with their headers for the bulk loaded nodes.
+// The difference is allocator overhead: padding, slab free lists, unused
+// block tails.
+
+#define TREE_STATS_FILL_BUCKETS 10 // nodes by fill in tenths; a full node counts in the last one
+#define TREE_STATS_CHAIN_BUCKETS 32 // keys by rows per key, 0, 1, 2-3, 4-7, ...
+
+typedef struct tree_level_stats {
+  long long nodes;
+  long long keys;
+  long long bytes; // live bytes of the nodes
+  long long fill[TREE_STATS_FILL_BUCKETS + 1];
+} tree_level_stats;
+
+typedef struct tree_stats {
+  int height; // levels, a lone leaf is 1
+  int capacity; // keys per node
+  tree_level_stats levels[MAX_TREE_HEIGHT]; // levels[0] is the root
+  long long nodes;
+  long long keys;
+  long long rows;
+  long long tombstones;
+  long long chains[TREE_STATS_CHAIN_BUCKETS];
+  long long longest_chain;
+  long long node_bytes;
+  long long record_bytes;
+  long long postings_bytes;
+  long long live_bytes;
+  long long reserved_bytes;
+} tree_stats;
+
+void statsCountNode(tree_stats *s, int level, int num_keys, size_t bytes) {
+  tree_level_stats *l = &s->levels[level];
+  if (level + 1 > s->height)
+    s->height = level + 1;
+  l->nodes++;
+  l->keys += num_keys;
+  l->bytes += bytes;
+  l->fill[num_keys * TREE_STATS_FILL_BUCKETS / s->capacity]++;
+  s->nodes++;
+  s->node_bytes += bytes;
+}
+
+void statsCountRows(tree_stats *s, const postings *p) {
+  int bucket = 0;
+  while (bucket < TREE_STATS_CHAIN_BUCKETS - 1 && (1LL << bucket) <= p->count)
+    bucket++;
+  s->chains[bucket]++;
+  if (p->count > s->longest_chain)
+    s->longest_chain = p->count;
+  s->rows += p->count;
+  s->keys++;
+  s->postings_bytes += (long long)p->capacity * sizeof(CSVRecord);
+}
+
+// Bytes the arenas of mem hold, split buffers and tombstone queue included
+long long statsReservedBytes(const tree_memory *mem) {
+  return (long long)mem->bytes_reserved + (long long)mem->scratch_size +
+         (long long)mem->tombstone_capacity * sizeof(int);
+}
+
+void treeStatsNode(node *n, int level, tree_stats *s) {
+  statsCountNode(s, level, n->num_keys, nodeSize());
+  if (n->is_leaf) {
+    for (int i = 0; i < n->num_keys; i++) {
+      record *r = n->pointers[i];
+      s->record_bytes += sizeof(record);
+      s->tombstones += r->deleted;
+      statsCountRows(s, &r->rows);
+    }
+    return;
+  }
+  for (int i = 0; i <= n->num_keys; i++)
+    treeStatsNode(n->pointers[i], level + 1, s);
+}
+
+// Statistics of the node tree whose nodes, records and rows come from mem
+void treeStats(node *root, const tree_memory *mem, tree_stats *s) {
+  memset(s, 0, sizeof(*s));
+  s->capacity = order - 1;
+  if (root != NULL)
+    treeStatsNode(root, 0, s);
+  s->live_bytes = s->node_bytes + s->record_bytes + s->postings_bytes;
+  s->reserved_bytes = statsReservedBytes(mem);
+}
+
+void stats_bulkload_node(Node_bulkload *n, int level, tree_stats *s) {
+  statsCountNode(s, level, n->num_keys, sizeof(Node_bulkload));
+  // malloc_usable_size() does not count the chunk header
+  s->reserved_bytes += malloc_usable_size(n) + sizeof(size_t);
+  if (n->is_leaf) {
+    for (int i = 0; i < n->num_keys; i++)
+      statsCountRows(s, &n->values[i]);
+    return;
+  }
+  for (int i = 0; i <= n->num_keys; i++)
+    stats_bulkload_node(n->children[i], level + 1, s);
+}
+
+// Statistics of a bulk loaded tree whose rows come from rows_mem
+void stats_bulkload(Node_bulkload *root, const tree_memory *rows_mem, tree_stats *s) {
+  memset(s, 0, sizeof(*s));
+  s->capacity = ORDER - 1;
+  if (root != NULL)
+    stats_bulkload_node(root, 0, s);
+  s->live_bytes = s->node_bytes + s->postings_bytes;
+  s->reserved_bytes += statsReservedBytes(rows_mem);
+}
+
+void printTreeStats(const tree_stats *s) {
+  printf("Levels: %d, nodes: %lld, keys: %lld, rows: %lld", s->height, s->nodes,
+         s->keys, s->rows);
+  if (s->tombstones > 0)
+    printf(", tombstones: %lld", s->tombstones);
+  printf("\n%-6s %10s %12s %14s   fill by tenths of %d keys, then full\n",
+         "level", "nodes", "keys", "bytes", s->capacity);
+  for (int l = 0; l < s->height; l++) {
+    const tree_level_stats *level = &s->levels[l];
+    printf("%-6d %10lld %12lld %14lld  ", l, level->nodes, level->keys, level->bytes);
+    for (int b = 0; b <= TREE_STATS_FILL_BUCKETS; b++)
+      printf(" %lld", level->fill[b]);
+    printf("\n");
+  }
+  printf("Bytes: nodes %lld, records %lld, postings %lld, live %lld, reserved %lld",
+         s->node_bytes, s->record_bytes, s->postings_bytes, s->live_bytes,
+         s->reserved_bytes);
+  if (s->live_bytes > 0)
+    printf(" (%.1f%% overhead)", 100.0 * (s->reserved_bytes - s->live_bytes) / s->live_bytes);
+  printf("\nKeys by rows per key:");
+  for (int b = 0; b < TREE_STATS_CHAIN_BUCKETS; b++) {
+    if (s->chains[b] == 0)
+      continue;
+    long long low = b == 0 ? 0 : 1LL << (b - 1), high = b == 0 ? 0 : (1LL << b) - 1;
+    if (low == high)
+      printf(" %lld: %lld,", low, s->chains[b]);
+    else
+      printf(" %lld-%lld: %lld,", low, high, s->chains[b]);
+  }
+  printf(" longest %lld\n", s->longest_chain);
+}
+
+// Query server
+//
+// serveQueries() answers newline separated queries from a file or a pipe
+// without prompts. The department comes last on the line, so it may hold
+// spaces:
+//
+//   point <department>             number of rows of the department
+//   rank <n> <department>          row at rank n, 1 is the highest score
+//   topk <k> <department>          the k best rows
+//   range <low> <high> <department> rows with low <= score <= high, best first
+//
+// Each answer is a line "OK <rows>" followed by that many rows as
+// id,university,department,score (for point, just the count line), or a
+// line "ERR <reason>". Queries are read QUERY_BATCH at a time and their
+// departments looked up together with findBatch(), and answers go to a
+// fully buffered stream, so the tree rather than the terminal sets the pace.
+// Answers are only written once a batch is full or the input ends, so a
+// client has to stream its queries rather than wait for each answer.
+
+#define QUERY_BATCH 256
+#define QUERY_LINE_LEN 256
+#define QUERY_OUTPUT_BUFFER (1 << 20)
+
+typedef enum {
+  QUERY_POINT,
+  QUERY_RANK,
+  QUERY_TOPK,
+  QUERY_RANGE,
+  QUERY_INVALID,
+} query_type;
+
+typedef struct query {
+  query_type type;
+  int n; // rank or k
+  float low, high;
+  const char *department; // points into line
+  char line[QUERY_LINE_LEN];
+} query;
+
+// Split a line into a query, type is QUERY_INVALID when it does not parse
+void parseQuery(query *q) {
+  char *p = q->line, *end;
+  q->type = QUERY_INVALID;
+  q->line[strcspn(q->line, "\r\n")] = '\0';
+  int args;
+  if (strncmp(p, "point ", 6) == 0) {
+    q->type = QUERY_POINT;
+    args = 0;
+    p += 6;
+  } else if (strncmp(p, "rank ", 5) == 0) {
+    q->type = QUERY_RANK;
+    args = 1;
+    p += 5;
+  } else if (strncmp(p, "topk ", 5) == 0) {
+    q->type = QUERY_TOPK;
+    args = 1;
+    p += 5;
+  } else if (strncmp(p, "range ", 6) == 0) {
+    q->type = QUERY_RANGE;
+    args = 2;
+    p += 6;
+  } else {
+    return;
+  }
+  if (args == 1) {
+    q->n = (int)strtol(p, &end, 10);
+    if (end == p)
+      q->type = QUERY_INVALID;
+    p = end;
+  } else if (args == 2) {
+    q->low = strtof(p, &end);
+    if (end == p)
+      q->type = QUERY_INVALID;
+    p = end;
+    q->high = strtof(p, &end);
+    if (end == p)
+      q->type = QUERY_INVALID;
+    p = end;
+  }
+  while (*p == ' ')
+    p++;
+  if (*p == '\0')
+    q->type = QUERY_INVALID;
+  q->department = p;
+}
+
+// Departments whose names collide on the key share a record, so only rows
+// of the asked department count
+bool queryRowMatches(const query *q, const CSVRecord *row) {
+  return strncmp(row->department, q->department, MAX_KEY_LEN - 1) == 0;
+}
+
+void printQueryRow(FILE *out, const CSVRecord *row) {
+  fprintf(out, "%d,%s,%s,%.5f\n", row->id, row->university, row->department, row->score);
+}
+
+// Rows [from, to) of p that belong to the department, at most max of them
+void answerRows(FILE *out, const query *q, const postings *p, int from, int to, int max) {
+  int count = 0;
+  for (int i = from; i < to && count < max; i++)
+    count += queryRowMatches(q, &p->rows[i]);
+  fprintf(out, "OK %d\n", count);
+  for (int i = from; i < to && count > 0; i++) {
+    if (queryRowMatches(q, &p->rows[i])) {
+      printQueryRow(out, &p->rows[i]);
+      count--;
+    }
+  }
+}
+
+void answerQuery(FILE *out, const query *q, record *r) {
+  static const postings empty = {0};
+  if (r != NULL)
+    postingsSort(&r->rows);
+  const postings *p = r != NULL ? &r->rows : &empty;
+  switch (q->type) {
+  case QUERY_POINT: {
+    int count = 0;
+    for (int i = 0; i < p->count; i++)
+      count += queryRowMatches(q, &p->rows[i]);
+    fprintf(out, "OK %d\n", count);
+    break;
+  }
+  case QUERY_RANK:
+    if (q->n < 1) {
+      fprintf(out, "ERR rank must be at least 1\n");
+      break;
+    }
+    // the n-th row of the department, skipping colliding departments
+    for (int i = 0, seen = 0; i < p->count; i++) {
+      if (queryRowMatches(q, &p->rows[i]) && ++seen == q->n) {
+        fprintf(out, "OK 1\n");
+        printQueryRow(out, &p->rows[i]);
+        return;
+      }
+    }
+    fprintf(out, "OK 0\n");
+    break;
+  case QUERY_TOPK:
+    answerRows(out, q, p, 0, p->count, q->n);
+    break;
+  case QUERY_RANGE: {
+    // rows are sorted by descending score, skip those above high
+    int lo = 0, hi = p->count;
+    while (lo < hi) {
+      int mid = lo + (hi - lo) / 2;
+      if (p->rows[mid].score > q->high)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+    int end = lo;
+    while (end < p->count && p->rows[end].score >= q->low)
+      end++;
+    answerRows(out, q, p, lo, end, INT_MAX);
+    break;
+  }
+  default:
+    fprintf(out, "ERR bad query: %s\n", q->line);
+    break;
+  }
+}
+
+// Answer every query of in on out, returns the number of queries
+long long serveQueries(node *root, FILE *in, FILE *out) {
+  query *batch = malloc(QUERY_BATCH * sizeof(query));
+  if (batch == NULL) {
+    perror("Query batch.");
+    exit(EXIT_FAILURE);
+  }
+  int keys[QUERY_BATCH];
+  record *found[QUERY_BATCH];
+  int slots[QUERY_BATCH];
+  long long total = 0;
+  bool more = true;
+
+  while (more) {
+    int n = 0, valid = 0;
+    while (n < QUERY_BATCH) {
+      if (fgets(batch[n].line, QUERY_LINE_LEN, in) == NULL) {
+        more = false;
+        break;
+      }
+      if (batch[n].line[0] == '\n' || batch[n].line[0] == '\r')
+        continue;
+      // a line longer than the buffer is dropped with its remainder
+      if (strchr(batch[n].line, '\n') == NULL && !feof(in)) {
+        int c;
+        while ((c = fgetc(in)) != EOF && c != '\n')
+          ;
+        strcpy(batch[n].line, "line too long");
+      }
+      parseQuery(&batch[n]);
+      if (batch[n].type != QUERY_INVALID) {
+        keys[valid] = (int)DJB2_hash_n((const uint8_t *)batch[n].department,
+                                       strnlen(batch[n].department, MAX_KEY_LEN - 1));
+        slots[n] = valid++;
+      }
+      n++;
+    }
+    findBatch(root, keys, valid, found);
+    for (int i = 0; i < n; i++)
+      answerQuery(out, &batch[i], batch[i].type != QUERY_INVALID ? found[slots[i]] : NULL);
+    total += n;
+  }
+  free(batch);
+  return total;
+}
+
+// util functions
+
+int calculateHeight(node *root){
+  if (root == NULL) {
+      return 0;
+  }
+  // leaf entries are records, not nodes
+  if (root->is_leaf) {
+      return 1;
+  }
+  int max_height = 0;
+  for(int i =0 ; i<= root->num_keys; i++){
+    if(root->pointers[i] == NULL){
+      continue;
+    }
+    int cur_height = calculateHeight(root->pointers[i]) + 1;
+    max_height = max_height > cur_height ? max_height : cur_height;
+
+  }
+  return max_height;
+}
+
+unsigned long long estimateMemoryUsage(node *root){
+    if (root == NULL) {
+      return 0;
+    }
+  unsigned long long memory_usage = nodeSize();
+  // an inner node has one child more than keys
+  int children = root->is_leaf ? root->num_keys : root->num_keys + 1;
+  for(int i =0 ; i< children; i++){
+    if(root->pointers[i] == NULL){
+      continue;
+    }
+    if(root->is_leaf){
+        // record and its postings array
+        record *r = (record *)root->pointers[i];
+        memory_usage += sizeof(record) + r->rows.capacity * sizeof(CSVRecord);
+      }
+    else
+      memory_usage += estimateMemoryUsage(root->pointers[i]);
+
+  }
+  return memory_usage;
+}
+
+
+// benchmarks
+
+// Monotonic clock in nanoseconds
+uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+uint32_t xorshift32(uint32_t *state) {
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+// Time sequential insert() against sort + bulk_load() for the same keys,
+// then probe both trees with lookups of keys that are present
+void bench_load_keys(const char *label, const uint32_t *keys, int count,
+        double fill_factor) {
+    const int probes = 1000000;
+    uint64_t start, end;
+    tree_memory mem = {0};
+
+    number_of_splits = 0;
+    node *root = NULL;
+    start = now_ns();
+    for (int i = 0; i < count; i++) {
+        root = insert(&mem, root, (int)keys[i], NULL);
+    }
+    end = now_ns();
+    double insert_ms = (end - start) / 1e6;
+
+    uint32_t *sorted = malloc(count * sizeof(uint32_t));
+    if (sorted == NULL) {
+        perror("Benchmark keys.");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(sorted, keys, count * sizeof(uint32_t));
+    start = now_ns();
+    size_t unique = count;
+    sort_and_deduplicate(sorted, &unique);
+    Node_bulkload *bulk_root = bulk_load(sorted, unique, fill_factor);
+    end = now_ns();
+    double bulk_ms = (end - start) / 1e6;
+
+    uint32_t state = 2463534242u;
+    int hits = 0;
+    start = now_ns();
+    for (int i = 0; i < probes; i++) {
+        if (find(root, (int)keys[xorshift32(&state) % count], false, NULL) != NULL)
+            hits++;
+    }
+    end = now_ns();
+    double insert_lookup_ns = (double)(end - start) / probes;
+
+    state = 2463534242u;
+    start = now_ns();
+    for (int i = 0; i < probes; i++) {
+        if (find_bulkload(bulk_root, keys[xorshift32(&state) % count]) != NULL)
+            hits++;
+    }
+    end = now_ns();
+    double bulk_lookup_ns = (double)(end - start) / probes;
+
+    printf("%s: %d rows, %zu unique keys\n", label, count, unique);
+    printf("  insert loop: %10.2f ms  height %d  splits %d  lookup %.1f ns\n",
+           insert_ms, height(root), number_of_splits, insert_lookup_ns);
+    printf("  bulk load:   %10.2f ms  height %d  fill %.2f  lookup %.1f ns\n",
+           bulk_ms, height_bulkload(bulk_root), fill_factor, bulk_lookup_ns);
+    if (hits != 2 * probes)
+        printf("  lookup mismatch: %d of %d probes found\n", hits, 2 * probes);
+
+    free_bulkload(bulk_root);
+    destroyTree(&mem);
+    free(sorted);
+}
+
+// Department hashes of the loaded CSV rows, in file order
+uint32_t *bench_csv_keys(void) {
+    uint32_t *keys = malloc(csv_record_count * sizeof(uint32_t));
+    if (keys == NULL) {
+        perror("Benchmark keys.");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < csv_record_count; i++) {
+        keys[i] = DJB2_hash((const uint8_t *)records[i].department);
+    }
+    return keys;
+}
+
+// Pseudo random keys, the same sequence on every run
+uint32_t *bench_synthetic_keys(int count) {
+    uint32_t *keys = malloc(count * sizeof(uint32_t));
+    if (keys == NULL) {
+        perror("Benchmark keys.");
+        exit(EXIT_FAILURE);
+    }
+    uint32_t state = 88172645u;
+    for (int i = 0; i < count; i++) {
+        keys[i] = xorshift32(&state);
+    }
+    return keys;
+}
+
+// main.exe bench-load [synthetic_keys] [fill_factor]
+int bench_load(int argc, char *argv[]) {
+    int synthetic_count = argc > 2 ? atoi(argv[2]) : 4000000;
+    double fill_factor = argc > 3 ? atof(argv[3]) : BULKLOAD_FILL_FACTOR;
+
+    read_file();
+    uint32_t *keys = bench_csv_keys();
+    bench_load_keys("yok_atlas.csv", keys, csv_record_count, fill_factor);
+    free(keys);
+
+    if (synthetic_count > 0) {
+        keys = bench_synthetic_keys(synthetic_count);
+        bench_load_keys("synthetic", keys, synthetic_count, fill_factor);
+        free(keys);
+    }
+    return 0;
+}
+
+// Build the insert tree at the given order, then report node size,
+// lookup latency and estimated memory
+void bench_layout_keys(const char *label, const uint32_t *keys, int count,
+        int tree_order) {
+    const int probes = 1000000;
+    uint64_t start, end;
+    tree_memory mem = {0};
+
+    order = tree_order;
+    number_of_splits = 0;
+    node *root = NULL;
+    for (int i = 0; i < count; i++) {
+        root = insert(&mem, root, (int)keys[i], NULL);
+    }
+
+    uint32_t state = 2463534242u;
+    int hits = 0;
+    start = now_ns();
+    for (int i = 0; i < probes; i++) {
+        if (find(root, (int)keys[xorshift32(&state) % count], false, NULL) != NULL)
+            hits++;
+    }
+    end = now_ns();
+
+    printf("%-14s order %3d  node %4zu B  height %2d  lookup %7.1f ns  memory %llu bytes\n",
+           label, order, nodeSize(), height(root),
+           (double)(end - start) / probes, estimateMemoryUsage(root));
+    if (hits != probes)
+        printf("  lookup mismatch: %d of %d probes found\n", hits, probes);
+    destroyTree(&mem);
+    order = ORDER;
+}
+
+// main.exe bench-layout [synthetic_keys]
+int bench_layout(int argc, char *argv[]) {
+    int synthetic_count = argc > 2 ? atoi(argv[2]) : 10000000;
+    int orders[] = {ORDER, orderForCacheLines(1), orderForCacheLines(2),
+                    orderForCacheLines(4)};
+    int order_count = sizeof(orders) / sizeof(orders[0]);
+
+    read_file();
+    uint32_t *keys = bench_csv_keys();
+    for (int i = 0; i < order_count; i++)
+        bench_layout_keys("yok_atlas.csv", keys, csv_record_count, orders[i]);
+    free(keys);
+
+    if (synthetic_count > 0) {
+        keys = bench_synthetic_keys(synthetic_count);
+        for (int i = 0; i < order_count; i++)
+            bench_layout_keys("synthetic", keys, synthetic_count, orders[i]);
+        free(keys);
+    }
+    return 0;
+}
+
+
+// Load rows the way mode 1 used to (insert() checking with find() first,
+// then find() again to attach the row) and with a single upsert()
+void bench_insert_keys(const char *label, const uint32_t *keys, int count) {
+    static CSVRecord row;
+    uint64_t start, end;
+    tree_memory mem = {0};
+
+    node *root = NULL;
+    start = now_ns();
+    for (int i = 0; i < count; i++) {
+        if (find(root, (int)keys[i], false, NULL) == NULL)
+            root = insert(&mem, root, (int)keys[i], NULL);
+    }
+    for (int i = 0; i < count; i++) {
+        postingsAppend(&mem, &find(root, (int)keys[i], false, NULL)->rows, &row);
+    }
+    end = now_ns();
+    double three_ms = (end - start) / 1e6;
+    destroyTree(&mem);
+
+    root = NULL;
+    start = now_ns();
+    for (int i = 0; i < count; i++) {
+        record *found;
+        root = upsert(&mem, root, (int)keys[i], &found);
+        postingsAppend(&mem, &found->rows, &row);
+    }
+    end = now_ns();
+    double one_ms = (end - start) / 1e6;
+    destroyTree(&mem);
+
+    printf("%s: %d rows\n", label, count);
+    printf("  3 descents: %10.2f ms  %12.0f rows/s\n", three_ms, count / (three_ms / 1e3));
+    printf("  upsert:     %10.2f ms  %12.0f rows/s\n", one_ms, count / (one_ms / 1e3));
+}
+
+// main.exe bench-insert [synthetic_rows] [distinct_keys]
+int bench_insert(int argc, char *argv[]) {
+    int synthetic_count = argc > 2 ? atoi(argv[2]) : 4000000;
+    int distinct = argc > 3 ? atoi(argv[3]) : synthetic_count / 20;
+
+    read_file();
+    uint32_t *keys = bench_csv_keys();
+    bench_insert_keys("yok_atlas.csv", keys, csv_record_count);
+    free(keys);
+
+    if (synthetic_count > 0 && distinct > 0) {
+        uint32_t *pool = bench_synthetic_keys(distinct);
+        keys = malloc(synthetic_count * sizeof(uint32_t));
+        if (keys == NULL) {
+            perror("Benchmark keys.");
+            exit(EXIT_FAILURE);
+        }
+        uint32_t state = 2463534242u;
+        for (int i = 0; i < synthetic_count; i++)
+            keys[i] = pool[xorshift32(&state) % distinct];
+        bench_insert_keys("synthetic", keys, synthetic_count);
+        free(keys);
+        free(pool);
+    }
+    return 0;
+}
+
+// Load rows like mode 1 does (upsert, then append a CSV row to the key's
+// postings) and report allocator calls, load time and teardown time
+void bench_alloc_rows(const char *label, const uint32_t *keys, int count) {
+    uint64_t start, end;
+    tree_memory mem = {0};
+
+    number_of_splits = 0;
+    node *root = NULL;
+    start = now_ns();
+    for (int i = 0; i < count; i++) {
+        record *found;
+        root = upsert(&mem, root, (int)keys[i], &found);
+        postingsAppend(&mem, &found->rows, &records[i % csv_record_count]);
+    }
+    end = now_ns();
+    double load_ms = (end - start) / 1e6;
+    tree_memory stats = mem;
+
+    start = now_ns();
+    destroyTree(&mem);
+    end = now_ns();
+    double destroy_ms = (end - start) / 1e6;
+
+    printf("%s: %d rows, %d splits\n", label, count, number_of_splits);
+    printf("  load %.2f ms  destroy %.3f ms  malloc calls %llu  objects %llu  reserved %.1f MB\n",
+           load_ms, destroy_ms, stats.system_allocations,
+           stats.object_allocations, stats.bytes_reserved / 1048576.0);
+}
+
+// main.exe bench-alloc [synthetic_rows] [distinct_keys]
+int bench_alloc(int argc, char *argv[]) {
+    int synthetic_count = argc > 2 ? atoi(argv[2]) : 1000000;
+    int distinct = argc > 3 ? atoi(argv[3]) : synthetic_count / 20;
+
+    read_file();
+    uint32_t *keys = bench_csv_keys();
+    bench_alloc_rows("yok_atlas.csv", keys, csv_record_count);
+    free(keys);
+
+    if (synthetic_count > 0 && distinct > 0) {
+        uint32_t *pool = bench_synthetic_keys(distinct);
+        keys = malloc(synthetic_count * sizeof(uint32_t));
+        if (keys == NULL) {
+            perror("Benchmark keys.");
+            exit(EXIT_FAILURE);
+        }
+        uint32_t state = 2463534242u;
+        for (int i = 0; i < synthetic_count; i++)
+            keys[i] = pool[xorshift32(&state) % distinct];
+        bench_alloc_rows("synthetic", keys, synthetic_count);
+        free(keys);
+        free(pool);
+    }
+    return 0;
+}
+
+long peak_rss_kb(void) {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+// main.exe bench-ingest [csv_path]
+// Parse rate of the mapped file, then the rate of streaming it into the
+// index, with peak resident memory after each pass
+int bench_ingest(int argc, char *argv[]) {
+    const char *path = argc > 2 ? argv[2] : CSV_PATH;
+    uint64_t start, end;
+    csv_file file;
+    csv_cursor cursor;
+    csv_row row;
+
+    start = now_ns();
+    read_file();
+    end = now_ns();
+    printf("read_file(%s): %d rows  %.3f ms\n", CSV_PATH, csv_record_count,
+           (end - start) / 1e6);
+
+    if (!csvOpen(&file, path))
+        return 1;
+    double mb = file.size / 1048576.0;
+
+    tree_memory mem = {0};
+    long long rows = 0;
+    uint32_t checksum = 0;
+    csvCursorInit(&cursor, &file);
+    cursor.drop_consumed = true;
+    start = now_ns();
+    while (csvNextRow(&cursor, &row)) {
+        checksum += csvRowKey(&row) + (uint32_t)row.id;
+        rows++;
+    }
+    end = now_ns();
+    double seconds = (end - start) / 1e9;
+    printf("parse %s: %lld rows  %.1f MB  %.3f s  %.0f rows/s  %.1f MB/s  peak rss %ld KB  (checksum %u)\n",
+           path, rows, mb, seconds, rows / seconds, mb / seconds,
+           peak_rss_kb(), checksum);
+
+    node *root = NULL;
+    csvCursorInit(&cursor, &file);
+    cursor.drop_consumed = true;
+    start = now_ns();
+    while (csvNextRow(&cursor, &row)) {
+        record *found;
+        root = upsert(&mem, root, (int)csvRowKey(&row), &found);
+    }
+    end = now_ns();
+    seconds = (end - start) / 1e9;
+    printf("index %s: %lld rows  %.3f s  %.0f rows/s  peak rss %ld KB\n",
+           path, rows, seconds, rows / seconds, peak_rss_kb());
+
+    destroyTree(&mem);
+    csvClose(&file);
+    return 0;
+}
+
+// main.exe bench-parallel [csv_path]
+// Key preparation plus bulk_load() with the serial path and with the
+// parallel pipeline at 1 to 16 threads
+int bench_parallel(int argc, char *argv[]) {
+    const char *path = argc > 2 ? argv[2] : CSV_PATH;
+    int thread_counts[] = {1, 2, 4, 8, 16};
+    int thread_count = sizeof(thread_counts) / sizeof(thread_counts[0]);
+    uint64_t start, end;
+    csv_file file;
+
+    if (!csvOpen(&file, path))
+        return 1;
+
+    size_t serial_count;
+    start = now_ns();
+    uint32_t *serial = csvDepartmentKeys(&file, &serial_count);
+    long long rows = serial_count;
+    sort_and_deduplicate(serial, &serial_count);
+    Node_bulkload *root = bulk_load(serial, serial_count, BULKLOAD_FILL_FACTOR);
+    end = now_ns();
+    double serial_s = (end - start) / 1e9;
+    free_bulkload(root);
+    printf("%s: %lld rows, %zu keys, %ld CPUs online\n", path, rows,
+           serial_count, sysconf(_SC_NPROCESSORS_ONLN));
+    printf("  serial     %8.3f s  %12.0f rows/s\n", serial_s, rows / serial_s);
+
+    for (int t = 0; t < thread_count; t++) {
+        size_t count;
+        long long parallel_rows;
+        start = now_ns();
+        uint32_t *keys = csvSortedKeysParallel(&file, thread_counts[t], &count, &parallel_rows);
+        root = bulk_load(keys, count, BULKLOAD_FILL_FACTOR);
+        end = now_ns();
+        double seconds = (end - start) / 1e9;
+        printf("  %2d threads %8.3f s  %12.0f rows/s  speedup %.2fx",
+               thread_counts[t], seconds, parallel_rows / seconds, serial_s / seconds);
+        if (count != serial_count || parallel_rows != rows ||
+            memcmp(keys, serial, count * sizeof(uint32_t)) != 0)
+            printf("  (mismatch)");
+        printf("\n");
+        free_bulkload(root);
+        free(keys);
+    }
+
+    free(serial);
+    csvClose(&file);
+    return 0;
+}
+
+// main.exe bench-sort [keys] [distinct_keys]
+// Key preparation with every sort method, then bulk_load() of the result
+int bench_sort(int argc, char *argv[]) {
+    int count = argc > 2 ? atoi(argv[2]) : 20000000;
+    int distinct = argc > 3 ? atoi(argv[3]) : 0;
+    uint64_t start, end;
+
+    uint32_t *input = bench_synthetic_keys(count);
+    if (distinct > 0) {
+        // draw the keys from a smaller pool to get duplicates
+        uint32_t *pool = bench_synthetic_keys(distinct);
+        uint32_t state = 2463534242u;
+        for (int i = 0; i < count; i++)
+            input[i] = pool[xorshift32(&state) % distinct];
+        free(pool);
+    }
+    uint32_t *keys = malloc(count * sizeof(uint32_t));
+    uint32_t *expected = NULL;
+    size_t expected_count = 0;
+    if (keys == NULL) {
+        perror("Benchmark keys.");
+        exit(EXIT_FAILURE);
+    }
+
+    printf("%d keys, %ld CPUs online\n", count, sysconf(_SC_NPROCESSORS_ONLN));
+    for (int m = 0; m < KEY_SORT_METHOD_COUNT; m++) {
+        memcpy(keys, input, count * sizeof(uint32_t));
+        size_t unique = count;
+        start = now_ns();
+        prepare_keys(keys, &unique, m);
+        end = now_ns();
+        double sort_ms = (end - start) / 1e6;
+
+        start = now_ns();
+        Node_bulkload *root = bulk_load(keys, unique, BULKLOAD_FILL_FACTOR);
+        end = now_ns();
+        double load_ms = (end - start) / 1e6;
+
+        printf("  %-15s sort %9.2f ms  %12.0f keys/s  bulk_load %8.2f ms  %zu unique",
+               key_sort_names[m], sort_ms, count / (sort_ms / 1e3), load_ms, unique);
+        if (expected == NULL) {
+            expected = malloc(unique * sizeof(uint32_t));
+            if (expected == NULL) {
+                perror("Benchmark keys.");
+                exit(EXIT_FAILURE);
+            }
+            memcpy(expected, keys, unique * sizeof(uint32_t));
+            expected_count = unique;
+        } else if (unique != expected_count ||
+                   memcmp(keys, expected, unique * sizeof(uint32_t)) != 0) {
+            printf("  (mismatch)");
+        }
+        printf("\n");
+        free_bulkload(root);
+    }
+
+    free(expected);
+    free(keys);
+    free(input);
+    return 0;
+}
+
+int bench_count_nodes(node *n) {
+    if (n->is_leaf)
+        return 1;
+    int total = 1;
+    for (int i = 0; i <= n->num_keys; i++)
+        total += bench_count_nodes(n->pointers[i]);
+    return total;
+}
+
+void bench_strkey_names(const char *label, char **names, int count) {
+    uint64_t start, end;
+    tree_memory hash_mem = {0}, str_mem = {0};
+    node *hash_root = NULL;
+    str_node *str_root = NULL;
+    record *found;
+
+    start = now_ns();
+    for (int i = 0; i < count; i++)
+        hash_root = upsert(&hash_mem, hash_root, (int)DJB2_hash((const uint8_t *)names[i]), &found);
+    end = now_ns();
+    double hash_build = (end - start) / 1e6;
+
+    start = now_ns();
+    for (int i = 0; i < count; i++)
+        str_root = strUpsert(&str_mem, str_root, names[i], (int)strlen(names[i]), &found);
+    end = now_ns();
+    double str_build = (end - start) / 1e6;
+
+    // the hash path has to compare the first row's department to reject
+    // collisions
+    for (int i = 0; i < count; i++) {
+        record *r = find(hash_root, (int)DJB2_hash((const uint8_t *)names[i]), false, NULL);
+        CSVRecord row = {0};
+        strncpy(row.department, names[i], MAX_KEY_LEN - 1);
+        if (r->rows.count == 0)
+            postingsAppend(&hash_mem, &r->rows, &row);
+    }
+
+    int lookups = count < 1000000 ? 1000000 : count;
+    uint32_t state = 2463534242u;
+    long long hits = 0;
+    start = now_ns();
+    for (int i = 0; i < lookups; i++) {
+        const char *name = names[xorshift32(&state) % count];
+        record *r = find(hash_root, (int)DJB2_hash((const uint8_t *)name), false, NULL);
+        hits += r != NULL && strcmp(r->rows.rows[0].department, name) == 0;
+    }
+    end = now_ns();
+    double hash_ns = (double)(end - start) / lookups;
+
+    state = 2463534242u;
+    start = now_ns();
+    for (int i = 0; i < lookups; i++) {
+        const char *name = names[xorshift32(&state) % count];
+        hits += strFind(str_root, name, (int)strlen(name)) != NULL;
+    }
+    end = now_ns();
+    double str_ns = (double)(end - start) / lookups;
+
+    unsigned long long str_nodes = 0, heap_bytes = 0;
+    strTreeSize(str_root, &str_nodes, &heap_bytes);
+    unsigned long long hash_bytes =
+        (unsigned long long)bench_count_nodes(hash_root) * nodeSize();
+    unsigned long long str_bytes = str_nodes * sizeof(str_node);
+
+    printf("%s: %d names\n", label, count);
+    printf("  hash tree:   build %8.2f ms  lookup+strcmp %6.1f ns  index %8.1f KB\n",
+           hash_build, hash_ns, hash_bytes / 1024.0);
+    printf("  string tree: build %8.2f ms  lookup        %6.1f ns  index %8.1f KB  (key heap %.1f KB used, height %d)\n",
+           str_build, str_ns, str_bytes / 1024.0, heap_bytes / 1024.0,
+           strHeight(str_root) + 1);
+    printf("  hits %lld of %d\n", hits, 2 * lookups);
+
+    destroyTree(&hash_mem);
+    destroyTree(&str_mem);
+}
+
+// main.exe bench-strkey [synthetic_departments]
+// Hashed int keys against the string keyed tree on the dataset's
+// department names and on synthetic names with long shared prefixes
+int bench_strkey(int argc, char *argv[]) {
+    int synthetic_count = argc > 2 ? atoi(argv[2]) : 200000;
+    csv_file file;
+    csv_cursor cursor;
+    csv_row row;
+
+    // distinct department names of the dataset
+    if (!csvOpen(&file, CSV_PATH))
+        return 1;
+    tree_memory mem = {0};
+    str_node *distinct = NULL;
+    int count = 0, capacity = 1024;
+    char **names = malloc(capacity * sizeof(char *));
+    csvCursorInit(&cursor, &file);
+    while (csvNextRow(&cursor, &row)) {
+        record *found;
+        int len = row.department.len < STR_KEY_LEN ? (int)row.department.len : STR_KEY_LEN;
+        distinct = strUpsert(&mem, distinct, row.department.data, len, &found);
+        if (found->rows.count > 0)
+            continue;
+        if (count == capacity) {
+            capacity *= 2;
+            names = realloc(names, capacity * sizeof(char *));
+        }
+        postingsAppendRow(&mem, &found->rows, &row);
+        names[count++] = strndup(row.department.data, len);
+    }
+    csvClose(&file);
+
+    record *matches[8];
+    str_key keys[8];
+    int prefix_hits = strFindPrefix(distinct, "Bilgisayar", 10, 8, matches, keys);
+    printf("prefix \"Bilgisayar\": %d departments, first %.*s\n", prefix_hits,
+           prefix_hits > 0 ? keys[0].len : 0, prefix_hits > 0 ? keys[0].bytes : "");
+    destroyTree(&mem);
+
+    bench_strkey_names("yok_atlas.csv departments", names, count);
+
+    if (synthetic_count > 0) {
+        static const char *faculties[] = {
+            "Muhendislik Fakultesi ", "Fen Edebiyat Fakultesi ",
+            "Iktisadi ve Idari Bilimler Fakultesi ", "Egitim Fakultesi ",
+        };
+        static const char *programs[] = {
+            "Bilgisayar Muhendisligi", "Elektrik-Elektronik Muhendisligi",
+            "Matematik", "Tarih", "Isletme", "Sinif Ogretmenligi",
+        };
+        static const char *variants[] = {
+            "", " (Ingilizce)", " (Burslu)", " (%50 Indirimli)", " (KKTC Uyruklu)",
+        };
+        char **synthetic = malloc(synthetic_count * sizeof(char *));
+        if (synthetic == NULL) {
+            perror("Benchmark names.");
+            exit(EXIT_FAILURE);
+        }
+        char buffer[MAX_KEY_LEN];
+        for (int i = 0; i < synthetic_count; i++) {
+            snprintf(buffer, sizeof(buffer), "%s%s%s %07d", faculties[i % 4],
+                     programs[(i / 4) % 6], variants[(i / 24) % 5], i / 120);
+            synthetic[i] = strdup(buffer);
+        }
+        bench_strkey_names("synthetic departments", synthetic, synthetic_count);
+        for (int i = 0; i < synthetic_count; i++)
+            free(synthetic[i]);
+        free(synthetic);
+    }
+
+    for (int i = 0; i < count; i++)
+        free(names[i]);
+    free(names);
+    return 0;
+}
+
+// Per-key linked list of rows, as the tree kept them before postings
+typedef struct bench_chain_node {
+    CSVRecord record;
+    struct bench_chain_node *next;
+} bench_chain_node;
+
+typedef struct bench_chain {
+    bench_chain_node *first;
+} bench_chain;
+
+// Row i of a load: the dataset rows over and over, with falling scores so
+// every key receives its rows in score order like the real file
+void bench_postings_row(int i, int count, CSVRecord *out) {
+    *out = records[i % csv_record_count];
+    out->score = 600.0f - 400.0f * i / count;
+}
+
+// Slot of key in the sorted, unique keys
+size_t bench_key_slot(const uint32_t *unique, size_t count, uint32_t key) {
+    size_t low = 0, high = count;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (unique[mid] < key)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return low;
+}
+
+// Load rows into linked lists and into postings, then time rank queries on
+// random (key, rank) pairs. Both sides find their per-key struct by binary
+// search in the same sorted key array, so only the layout of the rows
+// differs.
+void bench_postings_rows(const char *label, const uint32_t *keys, int count) {
+    tree_memory list_mem = {0}, mem = {0};
+    uint64_t start, end;
+    CSVRecord row;
+
+    size_t distinct = count;
+    uint32_t *unique = malloc(count * sizeof(uint32_t));
+    if (unique == NULL) {
+        perror("Benchmark keys.");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(unique, keys, count * sizeof(uint32_t));
+    radix_sort_and_deduplicate(unique, &distinct);
+    bench_chain *chains = calloc(distinct, sizeof(bench_chain));
+    postings *lists = calloc(distinct, sizeof(postings));
+    if (chains == NULL || lists == NULL) {
+        perror("Benchmark keys.");
+        exit(EXIT_FAILURE);
+    }
+
+    start = now_ns();
+    for (int i = 0; i < count; i++) {
+        bench_chain *chain = &chains[bench_key_slot(unique, distinct, keys[i])];
+        bench_chain_node *chain_node = arenaAlloc(&list_mem, sizeof(bench_chain_node),
+                                                  _Alignof(bench_chain_node));
+        bench_postings_row(i, count, &chain_node->record);
+        chain_node->next = NULL;
+        bench_chain_node **tail = &chain->first;
+        while (*tail != NULL)
+            tail = &(*tail)->next;
+        *tail = chain_node;
+    }
+    end = now_ns();
+    double list_load_ms = (end - start) / 1e6;
+
+    start = now_ns();
+    for (int i = 0; i < count; i++) {
+        bench_postings_row(i, count, &row);
+        postingsAppend(&mem, &lists[bench_key_slot(unique, distinct, keys[i])], &row);
+    }
+    end = now_ns();
+    double load_ms = (end - start) / 1e6;
+
+    int queries = 100000;
+    uint32_t *query_keys = malloc(queries * sizeof(uint32_t));
+    int *query_ranks = malloc(queries * sizeof(int));
+    if (query_keys == NULL || query_ranks == NULL) {
+        perror("Benchmark queries.");
+        exit(EXIT_FAILURE);
+    }
+    uint32_t state = 2463534242u;
+    for (int q = 0; q < queries; q++) {
+        query_keys[q] = keys[xorshift32(&state) % count];
+        postings *rows = &lists[bench_key_slot(unique, distinct, query_keys[q])];
+        query_ranks[q] = 1 + xorshift32(&state) % rows->count;
+    }
+
+    long long list_checksum = 0;
+    start = now_ns();
+    for (int q = 0; q < queries; q++) {
+        bench_chain *chain = &chains[bench_key_slot(unique, distinct, query_keys[q])];
+        bench_chain_node *chain_node = chain->first;
+        for (int i = 1; i < query_ranks[q]; i++)
+            chain_node = chain_node->next;
+        list_checksum += chain_node->record.id;
+    }
+    end = now_ns();
+    double list_ns = (double)(end - start) / queries;
+
+    long long checksum = 0;
+    start = now_ns();
+    for (int q = 0; q < queries; q++) {
+        postings *rows = &lists[bench_key_slot(unique, distinct, query_keys[q])];
+        checksum += postingsRank(rows, query_ranks[q])->id;
+    }
+    end = now_ns();
+    double postings_ns = (double)(end - start) / queries;
+
+    printf("%s: %d rows, %d queries%s\n", label, count, queries,
+           checksum == list_checksum ? "" : "  (RESULTS DIFFER)");
+    printf("  linked list: load %10.2f ms  rank query %8.1f ns  reserved %.1f MB\n",
+           list_load_ms, list_ns, list_mem.bytes_reserved / 1048576.0);
+    printf("  postings:    load %10.2f ms  rank query %8.1f ns  reserved %.1f MB\n",
+           load_ms, postings_ns, mem.bytes_reserved / 1048576.0);
+
+    free(query_keys);
+    free(query_ranks);
+    free(chains);
+    free(lists);
+    free(unique);
+    destroyTree(&list_mem);
+    destroyTree(&mem);
+}
+
+// main.exe bench-postings [synthetic_rows] [distinct_keys]
+int bench_postings(int argc, char *argv[]) {
+    int synthetic_count = argc > 2 ? atoi(argv[2]) : 200000;
+    int distinct = argc > 3 ? atoi(argv[3]) : 200;
+
+    read_file();
+    uint32_t *keys = bench_csv_keys();
+    bench_postings_rows("yok_atlas.csv", keys, csv_record_count);
+    free(keys);
+
+    if (synthetic_count > 0 && distinct > 0) {
+        uint32_t *pool = bench_synthetic_keys(distinct);
+        keys = malloc(synthetic_count * sizeof(uint32_t));
+        if (keys == NULL) {
+            perror("Benchmark keys.");
+            exit(EXIT_FAILURE);
+        }
+        uint32_t state = 2463534242u;
+        for (int i = 0; i < synthetic_count; i++)
+            keys[i] = pool[xorshift32(&state) % distinct];
+        bench_postings_rows("synthetic", keys, synthetic_count);
+        free(keys);
+        free(pool);
+    }
+    return 0;
+}
+
+// Load rows into the hashed tree with postings and into the composite key
+// tree, then time top-10 queries for the departments of random rows
+void bench_topk_rows(const char *label, const CSVRecord *rows, int count) {
+    uint64_t start, end;
+    tree_memory mem = {0}, composite_mem = {0};
+    record *found;
+
+    node *root = NULL;
+    start = now_ns();
+    for (int i = 0; i < count; i++) {
+        root = upsert(&mem, root, (int)DJB2_hash((const uint8_t *)rows[i].department), &found);
+        postingsAppend(&mem, &found->rows, &rows[i]);
+    }
+    end = now_ns();
+    double postings_load_ms = (end - start) / 1e6;
+
+    number_of_splits = 0;
+    str_node *composite_root = NULL;
+    start = now_ns();
+    for (int i = 0; i < count; i++)
+        composite_root = compositeInsert(&composite_mem, composite_root, &rows[i]);
+    end = now_ns();
+    double composite_load_ms = (end - start) / 1e6;
+
+    int queries = 200000;
+    uint32_t state = 2463534242u;
+    long long postings_checksum = 0;
+    start = now_ns();
+    for (int q = 0; q < queries; q++) {
+        const char *department = rows[xorshift32(&state) % count].department;
+        record *r = find(root, (int)DJB2_hash((const uint8_t *)department), false, NULL);
+        int k = r->rows.count < 10 ? r->rows.count : 10;
+        postingsSort(&r->rows);
+        for (int i = 0; i < k; i++)
+            postings_checksum += (long long)(r->rows.rows[i].score * 1000);
+    }
+    end = now_ns();
+    double postings_ns = (double)(end - start) / queries;
+
+    state = 2463534242u;
+    long long composite_checksum = 0;
+    start = now_ns();
+    for (int q = 0; q < queries; q++) {
+        const char *department = rows[xorshift32(&state) % count].department;
+        const CSVRecord *top[10];
+        int k = compositeTopK(composite_root, department, (int)strlen(department), 10, top);
+        for (int i = 0; i < k; i++)
+            composite_checksum += (long long)(top[i]->score * 1000);
+    }
+    end = now_ns();
+    double composite_ns = (double)(end - start) / queries;
+
+    printf("%s: %d rows, %d top-10 queries%s\n", label, count, queries,
+           postings_checksum == composite_checksum ? "" : "  (RESULTS DIFFER)");
+    printf("  postings:  load %10.2f ms  top-10 %8.1f ns\n", postings_load_ms, postings_ns);
+    printf("  composite: load %10.2f ms  top-10 %8.1f ns  (%d splits, height %d)\n",
+           composite_load_ms, composite_ns, number_of_splits, strHeight(composite_root) + 1);
+
+    destroyTree(&mem);
+    destroyTree(&composite_mem);
+    number_of_splits = 0;
+}
+
+void bench_shuffle_rows(CSVRecord *rows, int count) {
+    uint32_t state = 88675123u;
+    for (int i = count - 1; i > 0; i--) {
+        int j = xorshift32(&state) % (i + 1);
+        CSVRecord t = rows[i];
+        rows[i] = rows[j];
+        rows[j] = t;
+    }
+}
+
+// main.exe bench-topk [synthetic_rows] [departments]
+// The dataset in file order (sorted by score) and shuffled, then synthetic
+// rows with random scores
+int bench_topk(int argc, char *argv[]) {
+    int synthetic_count = argc > 2 ? atoi(argv[2]) : 500000;
+    int departments = argc > 3 ? atoi(argv[3]) : 5000;
+
+    read_file();
+    CSVRecord *rows = malloc(csv_record_count * sizeof(CSVRecord));
+    if (rows == NULL) {
+        perror("Benchmark rows.");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(rows, records, csv_record_count * sizeof(CSVRecord));
+    bench_topk_rows("yok_atlas.csv", rows, csv_record_count);
+    bench_shuffle_rows(rows, csv_record_count);
+    bench_topk_rows("yok_atlas.csv shuffled", rows, csv_record_count);
+    free(rows);
+
+    if (synthetic_count > 0 && departments > 0) {
+        rows = malloc(synthetic_count * sizeof(CSVRecord));
+        if (rows == NULL) {
+            perror("Benchmark rows.");
+            exit(EXIT_FAILURE);
+        }
+        uint32_t state = 2463534242u;
+        for (int i = 0; i < synthetic_count; i++) {
+            rows[i] = records[i % csv_record_count];
+            rows[i].id = i + 1;
+            snprintf(rows[i].department, MAX_KEY_LEN, "Synthetic Department %05u",
+                     xorshift32(&state) % departments);
+            rows[i].score = 150.0f + (xorshift32(&state) % 450000) / 1000.0f;
+        }
+        bench_topk_rows("synthetic", rows, synthetic_count);
+        free(rows);
+    }
+    return 0;
+}
+
+void bench_tree_fill(node *n, long long *leaves, long long *leaf_keys,
+                     long long *inner, long long *inner_keys) {
+    if (n == NULL)
+        return;
+    if (n->is_leaf) {
+        (*leaves)++;
+        *leaf_keys += n->num_keys;
+        return;
+    }
+    (*inner)++;
+    *inner_keys += n->num_keys;
+    for (int i = 0; i <= n->num_keys; i++)
+        bench_tree_fill(n->pointers[i], leaves, leaf_keys, inner, inner_keys);
+}
+
+// Mix inserts of new keys and deletes of live ones in equal parts, so the
+// live key count stays around its starting value, and print the shape of
+// the tree after every round
+void bench_churn_run(bool lazy, const uint32_t *pool, int live_count,
+                     int rounds, int ops) {
+    int total = live_count * 2;
+    uint32_t *keys = malloc(total * sizeof(uint32_t));
+    if (keys == NULL) {
+        perror("Benchmark keys.");
+        exit(EXIT_FAILURE);
+    }
+    // keys[0 .. live) are in the tree, the rest are waiting to be inserted
+    memcpy(keys, pool, total * sizeof(uint32_t));
+    int live = live_count;
+
+    static const CSVRecord row;
+    tree_memory mem = {0};
+    node *root = NULL;
+    for (int i = 0; i < live; i++)
+        root = insert(&mem, root, (int)keys[i], &row);
+
+    printf("%s deletes, %d live keys, %d ops per round\n",
+           lazy ? "lazy" : "eager", live, ops);
+    printf("  round     live  height  leaf fill  inner fill     nodes  reserved MB    ops/s  compact ms\n");
+    uint32_t state = 2463534242u;
+    for (int round = 0; round <= rounds; round++) {
+        double ops_per_s = 0, compact_ms = 0;
+        if (round > 0) {
+            uint64_t start = now_ns();
+            for (int op = 0; op < ops; op++) {
+                // insert when the tree is empty, delete when every key is in
+                if ((xorshift32(&state) & 1) ? live < total : live == 0) {
+                    int j = live + xorshift32(&state) % (total - live);
+                    root = insert(&mem, root, (int)keys[j], &row);
+                    uint32_t t = keys[live]; keys[live] = keys[j]; keys[j] = t;
+                    live++;
+                } else {
+                    int j = xorshift32(&state) % live;
+                    if (lazy)
+                        deleteLazy(&mem, root, (int)keys[j]);
+                    else
+                        root = delete(&mem, root, (int)keys[j]);
+                    live--;
+                    uint32_t t = keys[live]; keys[live] = keys[j]; keys[j] = t;
+                }
+            }
+            uint64_t end = now_ns();
+            ops_per_s = ops / ((end - start) / 1e9);
+            if (lazy) {
+                start = now_ns();
+                root = compactTombstones(&mem, root, INT_MAX);
+                end = now_ns();
+                compact_ms = (end - start) / 1e6;
+            }
+        }
+        long long leaves = 0, leaf_keys = 0, inner = 0, inner_keys = 0;
+        bench_tree_fill(root, &leaves, &leaf_keys, &inner, &inner_keys);
+        printf("  %5d %8d  %6d  %8.1f%%  %9.1f%%  %8lld  %11.1f  %7.0f  %10.2f\n",
+               round, live, root != NULL ? height(root) + 1 : 0,
+               leaves ? 100.0 * leaf_keys / (leaves * (order - 1)) : 0.0,
+               inner ? 100.0 * inner_keys / (inner * (order - 1)) : 0.0,
+               leaves + inner, mem.bytes_reserved / 1048576.0,
+               ops_per_s, compact_ms);
+    }
+    destroyTree(&mem);
+    free(keys);
+}
+
+// main.exe bench-churn [live_keys] [rounds] [ops_per_round]
+int bench_churn(int argc, char *argv[]) {
+    int live = argc > 2 ? atoi(argv[2]) : 200000;
+    int rounds = argc > 3 ? atoi(argv[3]) : 10;
+    int ops = argc > 4 ? atoi(argv[4]) : 200000;
+    if (live < 1) {
+        fprintf(stderr, "bench-churn needs at least one live key\n");
+        return 1;
+    }
+
+    uint32_t *pool = bench_synthetic_keys(live * 2);
+    bench_churn_run(false, pool, live, rounds, ops);
+    bench_churn_run(true, pool, live, rounds, ops);
+    free(pool);
+    return 0;
+}
+
+// Drop the file from the OS page cache so the next open reads the disk
+void bench_drop_cache(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return;
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+}
+
+// main.exe bench-paged [synthetic_keys] [pool_pages]
+// Start-up and lookups of the dataset with the in-memory tree and with a
+// saved paged index, then synthetic keys in a paged tree several times the
+// size of the buffer pool
+int bench_paged(int argc, char *argv[]) {
+    int synthetic_count = argc > 2 ? atoi(argv[2]) : 2000000;
+    int pool_pages = argc > 3 ? atoi(argv[3]) : BUFFER_POOL_PAGES;
+    const char *path = "bench_paged.idx";
+    const int lookups = 200000;
+    uint64_t start, end;
+    csv_file file;
+    csv_cursor cursor;
+    csv_row row;
+    pager index;
+    tree_memory mem = {0};
+
+    read_file();
+    uint32_t *keys = bench_csv_keys();
+
+    // in memory: parse and build, then the first query
+    start = now_ns();
+    if (!csvOpen(&file, CSV_PATH))
+        return 1;
+    node *root = NULL;
+    csvCursorInit(&cursor, &file);
+    while (csvNextRow(&cursor, &row)) {
+        record *found;
+        root = upsert(&mem, root, (int)csvRowKey(&row), &found);
+        postingsAppendRow(&mem, &found->rows, &row);
+    }
+    csvClose(&file);
+    const CSVRecord *first = postingsRank(&find(root, (int)keys[0], false, NULL)->rows, 1);
+    end = now_ns();
+    printf("yok_atlas.csv: %d rows\n", csv_record_count);
+    printf("  in memory: build + first query %8.3f ms  (id %d)\n", (end - start) / 1e6, first->id);
+
+    start = now_ns();
+    if (!csvOpen(&file, CSV_PATH) || !pagerOpen(&index, path, true, pool_pages))
+        return 1;
+    pagedBuildIndex(&index, &file);
+    csvClose(&file);
+    pagerClose(&index);
+    end = now_ns();
+    printf("  paged:     build and save     %8.3f ms\n", (end - start) / 1e6);
+
+    // paged: open the saved index with a cold cache, then the first query
+    bench_drop_cache(path);
+    CSVRecord ranked;
+    start = now_ns();
+    if (!pagerOpen(&index, path, false, pool_pages))
+        return 1;
+    pagedRank(&index, (int32_t)keys[0], 1, &ranked);
+    end = now_ns();
+    printf("  paged:     open + first query %8.3f ms  (id %d)\n", (end - start) / 1e6, ranked.id);
+
+    uint32_t state = 2463534242u;
+    long long checksum = 0;
+    start = now_ns();
+    for (int i = 0; i < lookups; i++) {
+        record *r = find(root, (int)keys[xorshift32(&state) % csv_record_count], false, NULL);
+        checksum += postingsRank(&r->rows, 1)->id;
+    }
+    end = now_ns();
+    printf("  in memory: rank lookup %8.1f ns\n", (double)(end - start) / lookups);
+
+    state = 2463534242u;
+    index.hits = index.misses = 0;
+    start = now_ns();
+    for (int i = 0; i < lookups; i++) {
+        pagedRank(&index, (int32_t)keys[xorshift32(&state) % csv_record_count], 1, &ranked);
+        checksum -= ranked.id;
+    }
+    end = now_ns();
+    printf("  paged:     rank lookup %8.1f ns  pool %d pages, hit rate %.1f%%%s\n",
+           (double)(end - start) / lookups, index.frame_count,
+           100.0 * index.hits / (index.hits + index.misses),
+           checksum == 0 ? "" : "  (RESULTS DIFFER)");
+    pagerClose(&index);
+    destroyTree(&mem);
+    free(keys);
+
+    if (synthetic_count > 0) {
+        keys = bench_synthetic_keys(synthetic_count);
+
+        start = now_ns();
+        root = NULL;
+        for (int i = 0; i < synthetic_count; i++)
+            root = insert(&mem, root, (int)keys[i], NULL);
+        end = now_ns();
+        double memory_ms = (end - start) / 1e6;
+        unsigned long long memory_mb = mem.bytes_reserved >> 20;
+
+        start = now_ns();
+        if (!pagerOpen(&index, path, true, pool_pages))
+            return 1;
+        for (int i = 0; i < synthetic_count; i++)
+            pagedInsert(&index, (int32_t)keys[i], (uint64_t)i);
+        pagerClose(&index);
+        end = now_ns();
+        double paged_ms = (end - start) / 1e6;
+
+        printf("synthetic: %d keys\n", synthetic_count);
+        printf("  in memory: insert %10.2f ms  %llu MB reserved\n", memory_ms, memory_mb);
+
+        bench_drop_cache(path);
+        if (!pagerOpen(&index, path, false, pool_pages))
+            return 1;
+        printf("  paged:     insert %10.2f ms  %u pages (%.1f MB file, %.1f MB pool)\n",
+               paged_ms, index.header.page_count,
+               index.header.page_count * (double)PAGE_SIZE / 1048576.0,
+               index.frame_count * (double)PAGE_SIZE / 1048576.0);
+
+        state = 2463534242u;
+        start = now_ns();
+        for (int i = 0; i < lookups; i++)
+            checksum += find(root, (int)keys[xorshift32(&state) % synthetic_count], false, NULL) != NULL;
+        end = now_ns();
+        printf("  in memory: lookup %8.1f ns\n", (double)(end - start) / lookups);
+
+        // the first pass runs against a cold OS cache, the second is warm
+        for (int pass = 0; pass < 2; pass++) {
+            uint64_t value;
+            state = 2463534242u;
+            index.hits = index.misses = 0;
+            start = now_ns();
+            for (int i = 0; i < lookups; i++)
+                checksum -= pagedFind(&index, (int32_t)keys[xorshift32(&state) % synthetic_count], &value);
+            end = now_ns();
+            printf("  paged:     lookup %8.1f ns  (%s, pool hit rate %.1f%%)\n",
+                   (double)(end - start) / lookups, pass == 0 ? "cold" : "warm",
+                   100.0 * index.hits / (index.hits + index.misses));
+        }
+        pagerClose(&index);
+        destroyTree(&mem);
+        free(keys);
+    }
+    unlink(path);
+    return 0;
+}
+
+// main.exe bench-snapshot [synthetic_keys]
+// Time to first query when rebuilding the bulk loaded tree against mapping
+// its snapshot, then lookups on both
+int bench_snapshot(int argc, char *argv[]) {
+    int synthetic_count = argc > 2 ? atoi(argv[2]) : 4000000;
+    const char *path = "bench_snapshot.snap";
+    const int lookups = 1000000;
+    uint64_t start, end;
+    csv_file file;
+    snapshot snap;
+    tree_memory rows_mem = {0};
+
+    read_file();
+    uint32_t *keys = bench_csv_keys();
+
+    start = now_ns();
+    if (!csvOpen(&file, CSV_PATH))
+        return 1;
+    Node_bulkload* root = bulk_load_csv(&file, BULKLOAD_FILL_FACTOR, &rows_mem);
+    csvClose(&file);
+    int first_id = find_bulkload(root, keys[0])->rows[0].id;
+    end = now_ns();
+    printf("yok_atlas.csv: %d rows\n", csv_record_count);
+    printf("  rebuild:  first query after %8.3f ms  (id %d)\n", (end - start) / 1e6, first_id);
+
+    start = now_ns();
+    if (!write_snapshot(root, path, NULL))
+        return 1;
+    end = now_ns();
+    printf("  snapshot: written in        %8.3f ms\n", (end - start) / 1e6);
+
+    bench_drop_cache(path);
+    start = now_ns();
+    if (!open_snapshot(&snap, path))
+        return 1;
+    first_id = rank_snapshot(&snap, keys[0], NULL, 1)->id;
+    end = now_ns();
+    printf("  snapshot: first query after %8.3f ms  (id %d, cold cache)\n", (end - start) / 1e6, first_id);
+
+    uint32_t state = 2463534242u;
+    long long checksum = 0;
+    start = now_ns();
+    for (int i = 0; i < lookups; i++)
+        checksum += find_bulkload(root, keys[xorshift32(&state) % csv_record_count])->rows[0].id;
+    end = now_ns();
+    printf("  rebuild:  rank lookup %8.1f ns\n", (double)(end - start) / lookups);
+
+    state = 2463534242u;
+    start = now_ns();
+    for (int i = 0; i < lookups; i++)
+        checksum -= rank_snapshot(&snap, keys[xorshift32(&state) % csv_record_count], NULL, 1)->id;
+    end = now_ns();
+    printf("  snapshot: rank lookup %8.1f ns%s\n", (double)(end - start) / lookups,
+           checksum == 0 ? "" : "  (RESULTS DIFFER)");
+    close_snapshot(&snap);
+    free_bulkload(root);
+    destroyTree(&rows_mem);
+    free(keys);
+
+    if (synthetic_count > 0) {
+        uint32_t *input = bench_synthetic_keys(synthetic_count);
+        keys = malloc(synthetic_count * sizeof(uint32_t));
+        if (keys == NULL) {
+            perror("Benchmark keys.");
+            exit(EXIT_FAILURE);
+        }
+        memcpy(keys, input, synthetic_count * sizeof(uint32_t));
+        size_t count = synthetic_count;
+
+        start = now_ns();
+        prepare_keys(keys, &count, key_sort);
+        root = bulk_load(keys, count, BULKLOAD_FILL_FACTOR);
+        bool hit = search_bulkload(root, input[0]) != NULL;
+        end = now_ns();
+        printf("synthetic: %zu keys\n", count);
+        printf("  rebuild:  first query after %8.3f ms  (%s)\n", (end - start) / 1e6,
+               hit ? "found" : "missing");
+
+        start = now_ns();
+        if (!write_snapshot(root, path, NULL))
+            return 1;
+        end = now_ns();
+        free_bulkload(root);
+        printf("  snapshot: written in        %8.3f ms\n", (end - start) / 1e6);
+
+        bench_drop_cache(path);
+        uint64_t run;
+        start = now_ns();
+        if (!open_snapshot(&snap, path))
+            return 1;
+        hit = find_snapshot(&snap, input[0], &run);
+        end = now_ns();
+        printf("  snapshot: first query after %8.3f ms  (%s, cold cache, %.1f MB file)\n",
+               (end - start) / 1e6, hit ? "found" : "missing", snap.size / 1048576.0);
+
+        // the first pass faults pages in from the file, the second is warm
+        for (int pass = 0; pass < 2; pass++) {
+            long long found = 0;
+            state = 2463534242u;
+            start = now_ns();
+            for (int i = 0; i < lookups; i++)
+                found += find_snapshot(&snap, input[xorshift32(&state) % synthetic_count], &run);
+            end = now_ns();
+            printf("  snapshot: lookup %8.1f ns  (%s, %lld found)\n", (double)(end - start) / lookups,
+                   pass == 0 ? "cold" : "warm", found);
+        }
+        close_snapshot(&snap);
+        free(keys);
+        free(input);
+    }
+    unlink(path);
+    return 0;
+}
+
+// Mixed lookups and inserts from several threads, on the concurrent tree
+// and on the node tree behind one reader-writer lock
+typedef struct olc_bench_task {
+    tree_handle *tree; // NULL runs the locked node tree
+    node **root;
+    tree_memory *mem; // of the node tree
+    pthread_rwlock_t *lock;
+    const uint32_t *keys; // keys already in the tree
+    int key_count;
+    const uint32_t *new_keys; // keys this thread inserts, in order
+    int ops;
+    int read_percent;
+    uint32_t seed;
+    int inserted;
+    long long misses;
+} olc_bench_task;
+
+void *bench_olc_worker(void *arg) {
+    olc_bench_task *task = arg;
+    uint32_t state = task->seed;
+    epoch_slot *self = task->tree != NULL ? epochRegister(&task->tree->epochs) : NULL;
+    for (int op = 0; op < task->ops; op++) {
+        if ((int)(xorshift32(&state) % 100) < task->read_percent) {
+            int key = (int)task->keys[xorshift32(&state) % task->key_count];
+            bool found;
+            if (task->tree != NULL) {
+                found = olcFind(task->tree, self, key) != NULL;
+            } else {
+                pthread_rwlock_rdlock(task->lock);
+                found = find(*task->root, key, false, NULL) != NULL;
+                pthread_rwlock_unlock(task->lock);
+            }
+            if (!found)
+                task->misses++;
+        } else {
+            int key = (int)task->new_keys[task->inserted++];
+            if (task->tree != NULL) {
+                olcInsert(task->tree, self, key, (void *)task->keys);
+            } else {
+                pthread_rwlock_wrlock(task->lock);
+                *task->root = insert(task->mem, *task->root, key, NULL);
+                pthread_rwlock_unlock(task->lock);
+            }
+        }
+    }
+    if (self != NULL)
+        epochUnregister(self);
+    METRIC_FLUSH();
+    return NULL;
+}
+
+// Operations per second over all threads. The tree starts with
+// pool[0 .. key_count) and each thread inserts from its own slice of the
+// rest of the pool.
+double bench_olc_run(bool concurrent, const uint32_t *pool, int key_count,
+                     int ops, int read_percent, int threads, int tree_order,
+                     unsigned long long *restarts) {
+    olc_bench_task tasks[MAX_INGEST_THREADS];
+    pthread_t ids[MAX_INGEST_THREADS];
+    pthread_rwlock_t lock;
+    tree_handle tree;
+    tree_memory mem = {0};
+    node *root = NULL;
+
+    order = tree_order;
+    olcInit(&tree, tree_order);
+    epoch_slot *self = epochRegister(&tree.epochs);
+    pthread_rwlock_init(&lock, NULL);
+    for (int i = 0; i < key_count; i++) {
+        if (concurrent)
+            olcInsert(&tree, self, (int)pool[i], (void *)pool);
+        else
+            root = insert(&mem, root, (int)pool[i], NULL);
+    }
+    atomic_store(&tree.restarts, 0);
+
+    int per_thread = ops / threads;
+    for (int t = 0; t < threads; t++) {
+        tasks[t] = (olc_bench_task){
+            .tree = concurrent ? &tree : NULL,
+            .root = &root,
+            .mem = &mem,
+            .lock = &lock,
+            .keys = pool,
+            .key_count = key_count,
+            .new_keys = pool + key_count + (size_t)t * per_thread,
+            .ops = per_thread,
+            .read_percent = read_percent,
+            .seed = 2463534242u + 7919u * t,
+        };
+    }
+    uint64_t start = now_ns();
+    for (int t = 0; t < threads; t++) {
+        int error = pthread_create(&ids[t], NULL, bench_olc_worker, &tasks[t]);
+        if (error != 0) {
+            fprintf(stderr, "Benchmark thread: %s\n", strerror(error));
+            exit(EXIT_FAILURE);
+        }
+    }
+    long long misses = 0, inserted = 0;
+    for (int t = 0; t < threads; t++) {
+        pthread_join(ids[t], NULL);
+        misses += tasks[t].misses;
+        inserted += tasks[t].inserted;
+    }
+    uint64_t end = now_ns();
+
+    // every key must be found once, in order
+    long long expected = key_count + inserted;
+    int *found_keys = malloc(expected * sizeof(int));
+    void **found_values = malloc(expected * sizeof(void *));
+    if (found_keys == NULL || found_values == NULL) {
+        perror("Benchmark keys.");
+        exit(EXIT_FAILURE);
+    }
+    long long found = concurrent
+        ? olcFindRange(&tree, self, INT_MIN, INT_MAX, found_keys, found_values, (int)expected)
+        : findRange(root, INT_MIN, INT_MAX, false, found_keys, found_values, (int)expected);
+    for (long long i = 1; i < found; i++) {
+        if (found_keys[i - 1] >= found_keys[i])
+            found = -1;
+    }
+    if (misses != 0 || found != expected)
+        printf("  (mismatch: %lld lookups missed, %lld of %lld keys found)\n",
+               misses, found, expected);
+    free(found_keys);
+    free(found_values);
+
+    *restarts = atomic_load(&tree.restarts);
+    epochUnregister(self);
+    olcDestroy(&tree);
+    destroyTree(&mem);
+    pthread_rwlock_destroy(&lock);
+    return (double)per_thread * threads / ((end - start) / 1e9);
+}
+
+// main.exe bench-olc [tree_keys] [ops] [order]
+// Read-mostly (95/5) and balanced (50/50) lookup/insert mixes at 1 to 16
+// threads, on the concurrent tree and on the node tree behind a lock
+int bench_olc(int argc, char *argv[]) {
+    int key_count = argc > 2 ? atoi(argv[2]) : 1000000;
+    int ops = argc > 3 ? atoi(argv[3]) : 2000000;
+    int tree_order = argc > 4 ? atoi(argv[4]) : 32;
+    int thread_counts[] = {1, 2, 4, 8, 16};
+    int thread_count = sizeof(thread_counts) / sizeof(thread_counts[0]);
+    int read_percents[] = {95, 50};
+    unsigned long long restarts, unused;
+
+    if (tree_order < OLC_MIN_ORDER)
+        tree_order = OLC_MIN_ORDER;
+    uint32_t *pool = bench_synthetic_keys(key_count + ops);
+    printf("%d keys, %d ops per run, order %d, %ld CPUs online\n",
+           key_count, ops, tree_order, sysconf(_SC_NPROCESSORS_ONLN));
+    for (int r = 0; r < 2; r++) {
+        printf("%d%% lookups, %d%% inserts\n", read_percents[r], 100 - read_percents[r]);
+        printf("  threads  concurrent ops/s  restarts  rwlock ops/s  ratio\n");
+        for (int t = 0; t < thread_count; t++) {
+            double concurrent = bench_olc_run(true, pool, key_count, ops, read_percents[r],
+                                              thread_counts[t], tree_order, &restarts);
+            double locked = bench_olc_run(false, pool, key_count, ops, read_percents[r],
+                                          thread_counts[t], tree_order, &unused);
+            printf("  %7d  %16.0f  %8llu  %12.0f  %4.2fx\n", thread_counts[t],
+                   concurrent, restarts, locked, concurrent / locked);
+        }
+    }
+    free(pool);
+    order = ORDER;
+    return 0;
+}
+
+// Writers insert disjoint keys into the concurrent tree while readers
+// scan all of it and look up part of what they saw. Small orders make
+// splits reach the root often. Every scan must be sorted and every value
+// must be the one stored with its key.
+#define STRESS_READERS 2
+#define STRESS_WRITERS 4
+
+typedef struct olc_stress_task {
+    tree_handle *tree;
+    _Atomic bool *stop; // set once every writer is done
+    int writer; // index of a writer, -1 for a reader
+    int keys_per_writer;
+    long long scans;
+    long long errors;
+    pthread_t thread;
+} olc_stress_task;
+
+// Key i of writer w, distinct for every (w, i) since the multiplier is odd
+int stress_key(int writer, int i) {
+    return (int)((uint32_t)(i * STRESS_WRITERS + writer) * 2654435761u);
+}
+
+void *stress_value(int key) {
+    return (void *)((intptr_t)key | 1);
+}
+
+// Scan the whole tree, returns the number of keys found or -1 when the
+// scan was out of order or held a wrong value
+int stress_scan(tree_handle *tree, epoch_slot *self, int keys[], void *values[], int max) {
+    int found = olcFindRange(tree, self, INT_MIN, INT_MAX, keys, values, max);
+    for (int i = 0; i < found; i++) {
+        if ((i > 0 && keys[i - 1] >= keys[i]) || values[i] != stress_value(keys[i]))
+            return -1;
+    }
+    return found;
+}
+
+void *olc_stress_worker(void *arg) {
+    olc_stress_task *task = arg;
+    epoch_slot *self = epochRegister(&task->tree->epochs);
+    if (task->writer >= 0) {
+        for (int i = 0; i < task->keys_per_writer; i++) {
+            int key = stress_key(task->writer, i);
+            if (!olcInsert(task->tree, self, key, stress_value(key)))
+                task->errors++;
+        }
+        epochUnregister(self);
+        METRIC_FLUSH();
+        return NULL;
+    }
+
+    int max = task->keys_per_writer * STRESS_WRITERS;
+    int *keys = malloc(max * sizeof(int));
+    void **values = malloc(max * sizeof(void *));
+    if (keys == NULL || values == NULL) {
+        perror("Stress scan.");
+        exit(EXIT_FAILURE);
+    }
+    while (!atomic_load(task->stop)) {
+        int found = stress_scan(task->tree, self, keys, values, max);
+        if (found < 0)
+            task->errors++;
+        // inserted keys stay, so a lookup must find what the scan saw
+        for (int i = 0; i < found; i += 97) {
+            if (olcFind(task->tree, self, keys[i]) != stress_value(keys[i]))
+                task->errors++;
+        }
+        task->scans++;
+    }
+    free(keys);
+    free(values);
+    epochUnregister(self);
+    METRIC_FLUSH();
+    return NULL;
+}
+
+// main.exe stress-olc [keys_per_writer]
+// STRESS_WRITERS inserting threads and STRESS_READERS scanning threads on
+// the concurrent tree at small orders, returns 1 on the first wrong result
+int stress_olc(int argc, char *argv[]) {
+    int keys_per_writer = argc > 2 ? atoi(argv[2]) : 50000;
+    int orders[] = {3, 4, 5, 8, 16};
+    int order_count = sizeof(orders) / sizeof(orders[0]);
+    olc_stress_task tasks[STRESS_READERS + STRESS_WRITERS];
+    int task_count = STRESS_READERS + STRESS_WRITERS;
+    int expected = keys_per_writer * STRESS_WRITERS;
+    int *keys = malloc((expected > 0 ? expected : 1) * sizeof(int));
+    void **values = malloc((expected > 0 ? expected : 1) * sizeof(void *));
+    bool failed = false;
+    tree_handle tree;
+    _Atomic bool stop;
+
+    if (keys == NULL || values == NULL) {
+        perror("Stress scan.");
+        exit(EXIT_FAILURE);
+    }
+    printf("%d writers inserting %d keys each, %d readers scanning\n",
+           STRESS_WRITERS, keys_per_writer, STRESS_READERS);
+    for (int o = 0; o < order_count && !failed; o++) {
+        olcInit(&tree, orders[o]);
+        atomic_store(&stop, false);
+        for (int t = 0; t < task_count; t++) {
+            tasks[t] = (olc_stress_task){
+                .tree = &tree,
+                .stop = &stop,
+                .writer = t < STRESS_WRITERS ? t : -1,
+                .keys_per_writer = keys_per_writer,
+            };
+            int error = pthread_create(&tasks[t].thread, NULL, olc_stress_worker, &tasks[t]);
+            if (error != 0) {
+                fprintf(stderr, "Stress thread: %s\n", strerror(error));
+                exit(EXIT_FAILURE);
+            }
+        }
+        long long scans = 0, errors = 0;
+        for (int t = 0; t < task_count; t++) {
+            // readers stop once the last writer is done
+            if (t == STRESS_WRITERS)
+                atomic_store(&stop, true);
+            pthread_join(tasks[t].thread, NULL);
+            scans += tasks[t].scans;
+            errors += tasks[t].errors;
+        }
+
+        epoch_slot *self = epochRegister(&tree.epochs);
+        int found = stress_scan(&tree, self, keys, values, expected);
+        epochUnregister(self);
+        failed = errors > 0 || found != expected;
+        printf("  order %2d  %8d keys  %6lld scans  %8llu restarts  %8llu splits  %s\n",
+               orders[o], found, scans, atomic_load(&tree.restarts),
+               atomic_load(&tree.splits), failed ? "FAILED" : "ok");
+        olcDestroy(&tree);
+    }
+    free(keys);
+    free(values);
+    return failed ? 1 : 0;
+}
+
+// Lookups, inserts and deletes from several threads, on the concurrent
+// tree with epoch reclamation and on the node tree behind one mutex. Each
+// thread inserts and deletes only its own slice of the keys and looks up
+// keys of every slice. Every key carries a row whose id is the key. In the
+// concurrent tree rows are on the heap and deleted ones are retired; a
+// lookup reads the row before leaving its epoch, so a row freed too early
+// shows up as a wrong id (or under ASan).
+typedef struct epoch_bench_task {
+    tree_handle *tree; // NULL runs the locked node tree
+    node **root;
+    tree_memory *mem; // of the node tree
+    pthread_mutex_t *lock;
+    const uint32_t *keys; // every key of the run
+    int key_count;
+    uint32_t *own; // own[0 .. live) are in the tree
+    int own_count;
+    int live;
+    int ops;
+    int read_percent;
+    uint32_t seed;
+    long long wrong;
+} epoch_bench_task;
+
+void *bench_epoch_worker(void *arg) {
+    epoch_bench_task *task = arg;
+    uint32_t state = task->seed;
+    epoch_slot *self = task->tree != NULL ? epochRegister(&task->tree->epochs) : NULL;
+
+    for (int op = 0; op < task->ops; op++) {
+        uint32_t dice = xorshift32(&state) % 100;
+        if ((int)dice < task->read_percent) {
+            int key = (int)task->keys[xorshift32(&state) % task->key_count];
+            if (task->tree != NULL) {
+                epochPin(self);
+                CSVRecord *row = olcFind(task->tree, self, key);
+                if (row != NULL && row->id != key)
+                    task->wrong++;
+                epochUnpin(self);
+            } else {
+                pthread_mutex_lock(task->lock);
+                record *r = find(*task->root, key, false, NULL);
+                if (r != NULL && r->rows.rows[0].id != key)
+                    task->wrong++;
+                pthread_mutex_unlock(task->lock);
+            }
+        } else if (dice % 2 == 0 ? task->live < task->own_count : task->live == 0) {
+            int j = task->live + xorshift32(&state) % (task->own_count - task->live);
+            int key = (int)task->own[j];
+            if (task->tree != NULL) {
+                CSVRecord *row = malloc(sizeof(CSVRecord));
+                if (row == NULL) {
+                    perror("Benchmark row.");
+                    exit(EXIT_FAILURE);
+                }
+                row->id = key;
+                olcInsert(task->tree, self, key, row);
+            } else {
+                CSVRecord row = {.id = key};
+                pthread_mutex_lock(task->lock);
+                *task->root = insert(task->mem, *task->root, key, &row);
+                pthread_mutex_unlock(task->lock);
+            }
+            task->own[j] = task->own[task->live];
+            task->own[task->live++] = (uint32_t)key;
+        } else {
+            int j = xorshift32(&state) % task->live;
+            int key = (int)task->own[j];
+            if (task->tree != NULL) {
+                CSVRecord *row = olcDelete(task->tree, self, key);
+                if (row == NULL || row->id != key)
+                    task->wrong++;
+                else
+                    epochRetire(self, row, free);
+            } else {
+                pthread_mutex_lock(task->lock);
+                *task->root = delete(task->mem, *task->root, key);
+                pthread_mutex_unlock(task->lock);
+            }
+            task->own[j] = task->own[--task->live];
+            task->own[task->live] = (uint32_t)key;
+        }
+    }
+    if (self != NULL)
+        epochUnregister(self);
+    METRIC_FLUSH();
+    return NULL;
+}
+
+// Operations per second over all threads. Half of every slice of keys is
+// in the tree at the start.
+double bench_epoch_run(bool concurrent, const uint32_t *pool, int key_count,
+                       int ops, int read_percent, int threads, int tree_order,
+                       const char *label) {
+    epoch_bench_task tasks[MAX_INGEST_THREADS];
+    pthread_t ids[MAX_INGEST_THREADS];
+    pthread_mutex_t lock;
+    tree_handle tree;
+    tree_memory mem = {0};
+    node *root = NULL;
+
+    order = tree_order;
+    olcInit(&tree, tree_order);
+    epoch_slot *self = epochRegister(&tree.epochs);
+    pthread_mutex_init(&lock, NULL);
+    uint32_t *own = malloc(key_count * sizeof(uint32_t));
+    if (own == NULL) {
+        perror("Benchmark keys.");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(own, pool, key_count * sizeof(uint32_t));
+
+    int share = key_count / threads;
+    long long live = 0;
+    for (int t = 0; t < threads; t++) {
+        tasks[t] = (epoch_bench_task){
+            .tree = concurrent ? &tree : NULL,
+            .root = &root,
+            .mem = &mem,
+            .lock = &lock,
+            .keys = pool,
+            .key_count = key_count,
+            .own = own + (size_t)t * share,
+            .own_count = share,
+            .live = share / 2,
+            .ops = ops / threads,
+            .read_percent = read_percent,
+            .seed = 2463534242u + 7919u * t,
+        };
+        for (int i = 0; i < tasks[t].live; i++) {
+            int key = (int)tasks[t].own[i];
+            if (concurrent) {
+                CSVRecord *row = malloc(sizeof(CSVRecord));
+                if (row == NULL) {
+                    perror("Benchmark row.");
+                    exit(EXIT_FAILURE);
+                }
+                row->id = key;
+                olcInsert(&tree, self, key, row);
+            } else {
+                CSVRecord row = {.id = key};
+                root = insert(&mem, root, key, &row);
+            }
+        }
+    }
+
+    uint64_t start = now_ns();
+    for (int t = 0; t < threads; t++) {
+        int error = pthread_create(&ids[t], NULL, bench_epoch_worker, &tasks[t]);
+        if (error != 0) {
+            fprintf(stderr, "Benchmark thread: %s\n", strerror(error));
+            exit(EXIT_FAILURE);
+        }
+    }
+    long long wrong = 0;
+    for (int t = 0; t < threads; t++) {
+        pthread_join(ids[t], NULL);
+        wrong += tasks[t].wrong;
+        live += tasks[t].live;
+    }
+    uint64_t end = now_ns();
+
+    // exactly the live keys of every slice must be left, in order
+    int *found_keys = malloc(key_count * sizeof(int));
+    void **found_values = malloc(key_count * sizeof(void *));
+    if (found_keys == NULL || found_values == NULL) {
+        perror("Benchmark keys.");
+        exit(EXIT_FAILURE);
+    }
+    long long found = concurrent
+        ? olcFindRange(&tree, self, INT_MIN, INT_MAX, found_keys, found_values, key_count)
+        : findRange(root, INT_MIN, INT_MAX, false, found_keys, found_values, key_count);
+    for (long long i = 1; i < found; i++) {
+        if (found_keys[i - 1] >= found_keys[i])
+            found = -1;
+    }
+    if (wrong != 0 || found != live)
+        printf("  (mismatch: %lld wrong rows, %lld of %lld keys found)\n",
+               wrong, found, live);
+
+    if (concurrent) {
+        for (long long i = 0; i < found; i++)
+            free(found_values[i]);
+        // rows deleted in the last epochs are still waiting
+        printf("  %-10s retired %llu, freed %llu before the end, epoch %llu\n", label,
+               atomic_load(&tree.epochs.retired), atomic_load(&tree.epochs.freed),
+               (unsigned long long)atomic_load(&tree.epochs.epoch));
+    }
+    free(found_keys);
+    free(found_values);
+    free(own);
+    epochUnregister(self);
+    olcDestroy(&tree);
+    destroyTree(&mem);
+    pthread_mutex_destroy(&lock);
+    return (double)(ops / threads) * threads / ((end - start) / 1e9);
+}
+
+// main.exe bench-epoch [keys] [ops] [order]
+// Read-mostly (90/5/5) and write-heavy (50/25/25) lookup/insert/delete
+// mixes at 1 to 16 threads, on the concurrent tree and on the node tree
+// behind a mutex. Every run checks the rows it reads and the keys left.
+int bench_epoch(int argc, char *argv[]) {
+    int key_count = argc > 2 ? atoi(argv[2]) : 1000000;
+    int ops = argc > 3 ? atoi(argv[3]) : 2000000;
+    int tree_order = argc > 4 ? atoi(argv[4]) : 32;
+    int thread_counts[] = {1, 2, 4, 8, 16};
+    int thread_count = sizeof(thread_counts) / sizeof(thread_counts[0]);
+    int read_percents[] = {90, 50};
+    char label[32];
+
+    if (tree_order < OLC_MIN_ORDER)
+        tree_order = OLC_MIN_ORDER;
+    uint32_t *pool = bench_synthetic_keys(key_count);
+    printf("%d keys, %d ops per run, order %d, %ld CPUs online\n",
+           key_count, ops, tree_order, sysconf(_SC_NPROCESSORS_ONLN));
+    for (int r = 0; r < 2; r++) {
+        int writes = (100 - read_percents[r]) / 2;
+        printf("%d%% lookups, %d%% inserts, %d%% deletes\n", read_percents[r], writes, writes);
+        for (int t = 0; t < thread_count; t++) {
+            snprintf(label, sizeof(label), "%d threads", thread_counts[t]);
+            double concurrent = bench_epoch_run(true, pool, key_count, ops, read_percents[r],
+                                                thread_counts[t], tree_order, label);
+            double locked = bench_epoch_run(false, pool, key_count, ops, read_percents[r],
+                                            thread_counts[t], tree_order, label);
+            printf("  %-10s concurrent %10.0f ops/s  mutex %10.0f ops/s  %4.2fx\n", label,
+                   concurrent, locked, concurrent / locked);
+        }
+    }
+    free(pool);
+    order = ORDER;
+    return 0;
+}
+
+// Writers insert and delete their own keys in rounds while readers scan
+// the whole tree in one pinned epoch and read the row behind every value.
+// Deleted rows are retired, so a row freed while a reader can still reach
+// it shows up as a wrong id, or under ASan as a use after free. The last
+// round deletes only the even keys of every writer.
+#define STRESS_ROUNDS 4
+
+typedef struct epoch_stress_task {
+    tree_handle *tree;
+    _Atomic bool *stop; // set once every writer is done
+    int writer; // index of a writer, -1 for a reader
+    int keys_per_writer;
+    long long scans;
+    long long errors;
+    pthread_t thread;
+} epoch_stress_task;
+
+// Scan the whole tree and check the row of every key, returns the number
+// of keys found or -1 on a wrong result. The caller keeps self pinned as
+// long as it uses the rows.
+int stress_scan_rows(tree_handle *tree, epoch_slot *self, int keys[], void *values[], int max) {
+    int found = olcFindRange(tree, self, INT_MIN, INT_MAX, keys, values, max);
+    for (int i = 0; i < found; i++) {
+        if ((i > 0 && keys[i - 1] >= keys[i]) || ((CSVRecord *)values[i])->id != keys[i])
+            return -1;
+    }
+    return found;
+}
+
+void epoch_stress_write(epoch_stress_task *task, epoch_slot *self) {
+    for (int round = 0; round < STRESS_ROUNDS; round++) {
+        for (int i = 0; i < task->keys_per_writer; i++) {
+            int key = stress_key(task->writer, i);
+            CSVRecord *row = malloc(sizeof(CSVRecord));
+            if (row == NULL) {
+                perror("Stress row.");
+                exit(EXIT_FAILURE);
+            }
+            row->id = key;
+            if (!olcInsert(task->tree, self, key, row))
+                task->errors++;
+        }
+        for (int i = 0; i < task->keys_per_writer; i++) {
+            if (round == STRESS_ROUNDS - 1 && i % 2 == 1)
+                continue;
+            int key = stress_key(task->writer, i);
+            CSVRecord *row = olcDelete(task->tree, self, key);
+            if (row == NULL || row->id != key)
+                task->errors++;
+            else
+                epochRetire(self, row, free);
+        }
+    }
+}
+
+void *epoch_stress_worker(void *arg) {
+    epoch_stress_task *task = arg;
+    epoch_slot *self = epochRegister(&task->tree->epochs);
+    if (task->writer >= 0) {
+        epoch_stress_write(task, self);
+        epochUnregister(self);
+        METRIC_FLUSH();
+        return NULL;
+    }
+
+    int max = task->keys_per_writer * STRESS_WRITERS;
+    int *keys = malloc(max * sizeof(int));
+    void **values = malloc(max * sizeof(void *));
+    if (keys == NULL || values == NULL) {
+        perror("Stress scan.");
+        exit(EXIT_FAILURE);
+    }
+    while (!atomic_load(task->stop)) {
+        epochPin(self);
+        if (stress_scan_rows(task->tree, self, keys, values, max) < 0)
+            task->errors++;
+        epochUnpin(self);
+        task->scans++;
+    }
+    free(keys);
+    free(values);
+    epochUnregister(self);
+    METRIC_FLUSH();
+    return NULL;
+}
+
+// main.exe stress-epoch [keys_per_writer]
+// STRESS_WRITERS threads inserting and deleting and STRESS_READERS
+// scanning threads on the concurrent tree at small orders, returns 1 on
+// the first wrong result
+int stress_epoch(int argc, char *argv[]) {
+    int keys_per_writer = argc > 2 ? atoi(argv[2]) : 20000;
+    int orders[] = {3, 4, 5, 8, 16};
+    int order_count = sizeof(orders) / sizeof(orders[0]);
+    epoch_stress_task tasks[STRESS_READERS + STRESS_WRITERS];
+    int task_count = STRESS_READERS + STRESS_WRITERS;
+    int max = keys_per_writer * STRESS_WRITERS;
+    // the last round leaves the odd keys of every writer
+    int expected = keys_per_writer / 2 * STRESS_WRITERS;
+    int *keys = malloc((max > 0 ? max : 1) * sizeof(int));
+    void **values = malloc((max > 0 ? max : 1) * sizeof(void *));
+    bool failed = false;
+    tree_handle tree;
+    _Atomic bool stop;
+
+    if (keys == NULL || values == NULL) {
+        perror("Stress scan.");
+        exit(EXIT_FAILURE);
+    }
+    printf("%d writers inserting and deleting %d keys each for %d rounds, %d readers scanning\n",
+           STRESS_WRITERS, keys_per_writer, STRESS_ROUNDS, STRESS_READERS);
+    for (int o = 0; o < order_count && !failed; o++) {
+        olcInit(&tree, orders[o]);
+        atomic_store(&stop, false);
+        for (int t = 0; t < task_count; t++) {
+            tasks[t] = (epoch_stress_task){
+                .tree = &tree,
+                .stop = &stop,
+                .writer = t < STRESS_WRITERS ? t : -1,
+                .keys_per_writer = keys_per_writer,
+            };
+            int error = pthread_create(&tasks[t].thread, NULL, epoch_stress_worker, &tasks[t]);
+            if (error != 0) {
+                fprintf(stderr, "Stress thread: %s\n", strerror(error));
+                exit(EXIT_FAILURE);
+            }
+        }
+        long long scans = 0, errors = 0;
+        for (int t = 0; t < task_count; t++) {
+            // readers stop once the last writer is done
+            if (t == STRESS_WRITERS)
+                atomic_store(&stop, true);
+            pthread_join(tasks[t].thread, NULL);
+            scans += tasks[t].scans;
+            errors += tasks[t].errors;
+        }
+
+        epoch_slot *self = epochRegister(&tree.epochs);
+        epochPin(self);
+        int found = stress_scan_rows(&tree, self, keys, values, max);
+        epochUnpin(self);
+        epochUnregister(self);
+        for (int i = 0; i < found; i++)
+            free(values[i]);
+        failed = errors > 0 || found != expected;
+        printf("  order %2d  %7d keys left  %5lld scans  %8llu restarts  %8llu retired  %s\n",
+               orders[o], found, scans, atomic_load(&tree.restarts),
+               atomic_load(&tree.epochs.retired), failed ? "FAILED" : "ok");
+        olcDestroy(&tree);
+    }
+    free(keys);
+    free(values);
+    return failed ? 1 : 0;
+}
+
+// main.exe bench-batch [tree_keys]
+// Lookups of present keys one find() at a time against findBatch() with
+// batch sizes 1 to 1024, on trees much larger than the CPU caches
+int bench_batch(int argc, char *argv[]) {
+    int tree_count = argc > 2 ? atoi(argv[2]) : 4000000;
+    int orders[] = {ORDER, 16, 64};
+    int order_count = sizeof(orders) / sizeof(orders[0]);
+    const int probes = 1 << 20;
+    uint64_t start, end;
+    tree_memory mem = {0};
+
+    uint32_t *keys = bench_synthetic_keys(tree_count);
+    int *probe_keys = malloc(probes * sizeof(int));
+    record **expected = malloc(probes * sizeof(record *));
+    record **found = malloc(probes * sizeof(record *));
+    if (probe_keys == NULL || expected == NULL || found == NULL) {
+        perror("Benchmark keys.");
+        exit(EXIT_FAILURE);
+    }
+    uint32_t state = 2463534242u;
+    for (int i = 0; i < probes; i++)
+        probe_keys[i] = (int)keys[xorshift32(&state) % tree_count];
+
+    for (int o = 0; o < order_count; o++) {
+        order = orders[o];
+        node *root = NULL;
+        for (int i = 0; i < tree_count; i++)
+            root = insert(&mem, root, (int)keys[i], NULL);
+        printf("order %d, %d keys, height %d, %.1f MB reserved\n", order, tree_count,
+               height(root) + 1, mem.bytes_reserved / 1048576.0);
+
+        start = now_ns();
+        for (int i = 0; i < probes; i++)
+            expected[i] = find(root, probe_keys[i], false, NULL);
+        end = now_ns();
+        double find_ns = (double)(end - start) / probes;
+        printf("  find() loop  %8.1f ns per lookup\n", find_ns);
+
+        for (int batch = 1; batch <= 1024; batch *= 2) {
+            start = now_ns();
+            for (int i = 0; i < probes; i += batch)
+                findBatch(root, probe_keys + i, batch, found + i);
+            end = now_ns();
+            double batch_ns = (double)(end - start) / probes;
+            printf("  batch %4d   %8.1f ns per lookup  %5.2fx%s\n", batch, batch_ns,
+                   find_ns / batch_ns,
+                   memcmp(found, expected, probes * sizeof(record *)) == 0 ? "" : "  (mismatch)");
+        }
+        destroyTree(&mem);
+    }
+    order = ORDER;
+
+    free(keys);
+    free(probe_keys);
+    free(expected);
+    free(found);
+    return 0;
+}
+
+// Keys and rows of every record, in key order
+void bench_tree_totals(node *root, long long *keys, long long *rows) {
+    *keys = *rows = 0;
+    if (root == NULL)
+        return;
+    node *leaf = findLeaf(root, INT_MIN, false);
+    while (leaf != NULL) {
+        for (int i = 0; i < leaf->num_keys; i++)
+            *rows += ((record *)leaf->pointers[i])->rows.count;
+        *keys += leaf->num_keys;
+        leaf = leaf->pointers[order - 1];
+    }
+}
+
+// main.exe bench-insert-batch [tree_keys]
+// Daily updates of 1k to 1M rows into a loaded tree, one insert() per row
+// against one insertBatch(). A quarter of the update rows belong to keys
+// already in the tree and new keys get several rows.
+int bench_insert_batch(int argc, char *argv[]) {
+    int tree_count = argc > 2 ? atoi(argv[2]) : 1000000;
+    int update_sizes[] = {1000, 10000, 100000, 1000000};
+    int update_count = sizeof(update_sizes) / sizeof(update_sizes[0]);
+    int max_update = update_sizes[update_count - 1];
+    static const CSVRecord row;
+    uint64_t start, end;
+    tree_memory mem = {0};
+
+    uint32_t *pool = bench_synthetic_keys(tree_count + max_update);
+    int *update = malloc(max_update * sizeof(int));
+    const CSVRecord **rows = malloc(max_update * sizeof(CSVRecord *));
+    if (update == NULL || rows == NULL) {
+        perror("Benchmark keys.");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < max_update; i++)
+        rows[i] = &row;
+    printf("tree of %d keys, order %d\n", tree_count, order);
+    printf("  update rows   insert() loop      insertBatch()     speedup  splits loop/batch\n");
+
+    for (int u = 0; u < update_count; u++) {
+        int n = update_sizes[u];
+        uint32_t state = 2463534242u;
+        for (int i = 0; i < n; i++) {
+            if (xorshift32(&state) % 4 == 0)
+                update[i] = (int)pool[xorshift32(&state) % tree_count];
+            else
+                update[i] = (int)pool[tree_count + xorshift32(&state) % (n / 4 + 1)];
+        }
+
+        long long totals[2][2];
+        double rows_per_s[2];
+        int splits[2];
+        for (int batched = 0; batched < 2; batched++) {
+            node *root = NULL;
+            for (int i = 0; i < tree_count; i++)
+                root = insert(&mem, root, (int)pool[i], &row);
+            number_of_splits = 0;
+            start = now_ns();
+            if (batched) {
+                root = insertBatch(&mem, root, update, rows, n);
+            } else {
+                for (int i = 0; i < n; i++)
+                    root = insert(&mem, root, update[i], rows[i]);
+            }
+            end = now_ns();
+            rows_per_s[batched] = n / ((end - start) / 1e9);
+            splits[batched] = number_of_splits;
+            bench_tree_totals(root, &totals[batched][0], &totals[batched][1]);
+            destroyTree(&mem);
+        }
+        printf("  %11d  %10.0f rows/s  %10.0f rows/s  %6.2fx  %7d / %d%s\n", n,
+               rows_per_s[0], rows_per_s[1], rows_per_s[1] / rows_per_s[0],
+               splits[0], splits[1],
+               totals[0][0] == totals[1][0] && totals[0][1] == totals[1][1] ? "" : "  (mismatch)");
+    }
+
+    free(pool);
+    free(update);
+    free(rows);
+    return 0;
+}
+
+// Keys in the leaves below n, -1 when the subtree breaks a rule of the
+// tree: keys sorted and inside the bounds the parent gives, at most
+// order - 1 keys per node, every leaf at the same depth
+long long fuzz_check_node(node *n, long long low, long long high, int depth, int *leaf_depth) {
+    if (n->num_keys > order - 1)
+        return -1;
+    for (int i = 0; i < n->num_keys; i++) {
+        if (n->keys[i] < low || n->keys[i] >= high || (i > 0 && n->keys[i - 1] >= n->keys[i]))
+            return -1;
+    }
+    if (n->is_leaf) {
+        if (*leaf_depth < 0)
+            *leaf_depth = depth;
+        return *leaf_depth == depth ? n->num_keys : -1;
+    }
+    long long keys = 0;
+    for (int i = 0; i <= n->num_keys; i++) {
+        long long child_low = i > 0 ? n->keys[i - 1] : low;
+        long long child_high = i < n->num_keys ? n->keys[i] : high;
+        long long child = fuzz_check_node(n->pointers[i], child_low, child_high, depth + 1,
+                                          leaf_depth);
+        if (child < 0)
+            return -1;
+        keys += child;
+    }
+    return keys;
+}
+
+long long fuzz_check_tree(node *root) {
+    int leaf_depth = -1;
+    return root == NULL ? 0 : fuzz_check_node(root, INT_MIN, (long long)INT_MAX + 1, 0, &leaf_depth);
+}
+
+#define FUZZ_MAX_KEYS 5000
+#define FUZZ_MAX_UPDATE 4000
+
+// The same rounds of updates go into one tree through insert() and into
+// another through insertBatch(), with lazy deletes in between. Both trees
+// must be valid and hold the same keys with the same rows in the same
+// order. Returns false on the first difference.
+bool fuzz_insert_batch_once(uint32_t *state) {
+    static const CSVRecord row_values[4] = {
+        {.id = 0, .score = 0}, {.id = 1, .score = 1}, {.id = 2, .score = 2}, {.id = 3, .score = 3}};
+    static int keys[FUZZ_MAX_UPDATE];
+    static const CSVRecord *rows[FUZZ_MAX_UPDATE];
+    static int found_keys[2][FUZZ_MAX_KEYS];
+    static void *found[2][FUZZ_MAX_KEYS];
+    tree_memory loop_mem = {0}, batch_mem = {0};
+    node *loop_root = NULL, *batch_root = NULL;
+    int range = 1 + xorshift32(state) % FUZZ_MAX_KEYS;
+    bool ok = true;
+
+    for (int round = 0; round < 6; round++) {
+        int n = xorshift32(state) % (round == 0 ? FUZZ_MAX_UPDATE : FUZZ_MAX_UPDATE / 2);
+        for (int i = 0; i < n; i++) {
+            keys[i] = (int)(xorshift32(state) % range) - range / 2;
+            // some keys come without a row
+            rows[i] = i % 5 ? &row_values[i % 4] : NULL;
+            loop_root = insert(&loop_mem, loop_root, keys[i], rows[i]);
+        }
+        batch_root = insertBatch(&batch_mem, batch_root, keys, rows, n);
+        if (round == 3) {
+            for (int i = 0; i < n; i += 3) {
+                deleteLazy(&loop_mem, loop_root, keys[i]);
+                deleteLazy(&batch_mem, batch_root, keys[i]);
+            }
+        }
+    }
+
+    long long loop_keys = fuzz_check_tree(loop_root);
+    long long batch_keys = fuzz_check_tree(batch_root);
+    int count[2] = {
+        findRange(loop_root, INT_MIN, INT_MAX, false, found_keys[0], found[0], FUZZ_MAX_KEYS),
+        findRange(batch_root, INT_MIN, INT_MAX, false, found_keys[1], found[1], FUZZ_MAX_KEYS)};
+    if (loop_keys < 0 || batch_keys != loop_keys || count[0] != count[1])
+        ok = false;
+    for (int i = 0; ok && i < count[0]; i++) {
+        postings *loop_rows = &((record *)found[0][i])->rows;
+        postings *batch_rows = &((record *)found[1][i])->rows;
+        if (found_keys[0][i] != found_keys[1][i] || loop_rows->count != batch_rows->count) {
+            ok = false;
+            break;
+        }
+        postingsSort(loop_rows);
+        postingsSort(batch_rows);
+        for (int r = 0; r < loop_rows->count; r++) {
+            if (loop_rows->rows[r].id != batch_rows->rows[r].id)
+                ok = false;
+        }
+    }
+    destroyTree(&loop_mem);
+    destroyTree(&batch_mem);
+    return ok;
+}
+
+// main.exe fuzz-insert-batch [iterations] [seed]
+// Random update rounds at orders 3 to 14, returns 1 on the first tree
+// that differs from the insert() loop
+int fuzz_insert_batch(int argc, char *argv[]) {
+    int iterations = argc > 2 ? atoi(argv[2]) : 300;
+    uint32_t seed = argc > 3 ? (uint32_t)strtoul(argv[3], NULL, 10) : 2463534242u;
+    uint32_t state = seed ? seed : 1;
+
+    for (int i = 0; i < iterations; i++) {
+        order = 3 + i % 12;
+        if (!fuzz_insert_batch_once(&state)) {
+            printf("iteration %d (order %d, seed %u): insertBatch() differs from insert()\n",
+                   i, order, seed);
+            order = ORDER;
+            return 1;
+        }
+    }
+    printf("%d iterations ok\n", iterations);
+    order = ORDER;
+    return 0;
+}
+
+// main.exe bench-range [tree_keys]
+// Full table and selective scans with findRange() into a caller sized
+// array against the range cursor at several batch sizes, forward and
+// reverse
+int bench_range(int argc, char *argv[]) {
+    int tree_count = argc > 2 ? atoi(argv[2]) : 2000000;
+    int batch_sizes[] = {16, 256, 4096};
+    int batch_count = sizeof(batch_sizes) / sizeof(batch_sizes[0]);
+    const int selective_scans = 100000;
+    const int selective_keys = 100;
+    int keys[4096];
+    record *records[4096];
+    range_cursor cursor;
+    uint64_t start, end;
+    tree_memory mem = {0};
+
+    uint32_t *pool = bench_synthetic_keys(tree_count);
+    node *root = NULL;
+    for (int i = 0; i < tree_count; i++)
+        root = insert(&mem, root, (int)pool[i], NULL);
+    printf("%d keys, order %d, cursor %zu bytes\n", tree_count, order, sizeof(range_cursor));
+
+    int *all_keys = malloc(tree_count * sizeof(int));
+    void **all_pointers = malloc(tree_count * sizeof(void *));
+    if (all_keys == NULL || all_pointers == NULL) {
+        perror("Benchmark keys.");
+        exit(EXIT_FAILURE);
+    }
+    start = now_ns();
+    int expected = findRange(root, INT_MIN, INT_MAX, false, all_keys, all_pointers, tree_count);
+    end = now_ns();
+    long long expected_sum = 0;
+    for (int i = 0; i < expected; i++)
+        expected_sum += all_keys[i];
+    printf("full scan\n");
+    printf("  findRange()            %8.2f ms  %5.2f ns/key  %6.1f MB of arrays\n",
+           (end - start) / 1e6, (double)(end - start) / expected,
+           (double)tree_count * (sizeof(int) + sizeof(void *)) / 1048576.0);
+    free(all_keys);
+    free(all_pointers);
+
+    for (int reverse = 0; reverse < 2; reverse++) {
+        for (int b = 0; b < batch_count; b++) {
+            long long count = 0, sum = 0;
+            int n;
+            start = now_ns();
+            rangeOpen(&cursor, root, INT_MIN, INT_MAX, reverse);
+            while ((n = rangeNextBatch(&cursor, keys, records, batch_sizes[b])) > 0) {
+                for (int i = 0; i < n; i++)
+                    sum += keys[i];
+                count += n;
+            }
+            rangeClose(&cursor);
+            end = now_ns();
+            printf("  cursor %-7s batch %4d  %8.2f ms  %5.2f ns/key%s\n",
+                   reverse ? "reverse" : "forward", batch_sizes[b], (end - start) / 1e6,
+                   (double)(end - start) / count,
+                   count == expected && sum == expected_sum ? "" : "  (mismatch)");
+        }
+    }
+
+    // ranges about selective_keys keys wide at random positions
+    uint32_t width = (uint32_t)(4294967296.0 * selective_keys / tree_count);
+    printf("%d selective scans of about %d keys\n", selective_scans, selective_keys);
+    long long first_sum = 0;
+    for (int method = 0; method < 3; method++) {
+        uint32_t state = 2463534242u;
+        long long count = 0, sum = 0;
+        start = now_ns();
+        for (int s = 0; s < selective_scans; s++) {
+            int from = (int)xorshift32(&state);
+            int to = from > INT_MAX - (int)width ? INT_MAX : from + (int)width;
+            int n;
+            if (method == 0) {
+                n = findRange(root, from, to, false, keys, (void **)records, 4096);
+                for (int i = 0; i < n; i++)
+                    sum += keys[i];
+                count += n;
+                continue;
+            }
+            rangeOpen(&cursor, root, from, to, method == 2);
+            while ((n = rangeNextBatch(&cursor, keys, records, 16)) > 0) {
+                for (int i = 0; i < n; i++)
+                    sum += keys[i];
+                count += n;
+            }
+            rangeClose(&cursor);
+        }
+        end = now_ns();
+        if (method == 0)
+            first_sum = sum;
+        printf("  %-26s %8.1f ns/scan  %lld keys%s\n",
+               method == 0 ? "findRange()" : method == 1 ? "cursor forward, batch 16"
+                                                         : "cursor reverse, batch 16",
+               (double)(end - start) / selective_scans, count,
+               sum == first_sum ? "" : "  (mismatch)");
+    }
+
+    // stop after the first 10 keys from a random position
+    for (int reverse = 0; reverse < 2; reverse++) {
+        uint32_t state = 2463534242u;
+        long long count = 0;
+        start = now_ns();
+        for (int s = 0; s < selective_scans; s++) {
+            int from = (int)xorshift32(&state);
+            rangeOpen(&cursor, root, reverse ? INT_MIN : from, reverse ? from : INT_MAX, reverse);
+            count += rangeNextBatch(&cursor, keys, records, 10);
+            rangeClose(&cursor);
+        }
+        end = now_ns();
+        printf("  first 10 keys, %-11s %8.1f ns/scan  %lld keys\n",
+               reverse ? "reverse" : "forward", (double)(end - start) / selective_scans, count);
+    }
+
+    destroyTree(&mem);
+    free(pool);
+    return 0;
+}
+
+#define FUZZ_RANGE_KEYS 3000
+
+// One random tree checked against a bitmap of its live keys: cursors in
+// both directions with small batches and findRange() with and without a
+// cap must return exactly the live keys of each range. Deletes are lazy
+// or eager depending on the caller. Returns false on the first difference.
+bool fuzz_range_once(uint32_t *state, bool lazy) {
+    static bool live[FUZZ_RANGE_KEYS];
+    static int expected[FUZZ_RANGE_KEYS], got[FUZZ_RANGE_KEYS], found_keys[FUZZ_RANGE_KEYS];
+    static void *found[FUZZ_RANGE_KEYS];
+    tree_memory mem = {0};
+    node *root = NULL;
+    int range = 1 + xorshift32(state) % FUZZ_RANGE_KEYS;
+    int n = xorshift32(state) % 2000;
+    bool ok = true;
+
+    memset(live, 0, sizeof(live));
+    for (int i = 0; i < n; i++) {
+        int key = xorshift32(state) % range;
+        root = insert(&mem, root, key, NULL);
+        live[key] = true;
     }
-    for (int i = 0; i < ORDER - 1; i++) {
-        node->values[i] = NULL;
+    for (int i = 0; i < n / 3; i++) {
+        int key = xorshift32(state) % range;
+        if (lazy) {
+            if (deleteLazy(&mem, root, key))
+                live[key] = false;
+        } else {
+            if (root != NULL)
+                root = delete(&mem, root, key);
+            live[key] = false;
+        }
     }
-    return node;
-}
 
-// Bulk load sorted keys into leaf nodes
-Node_bulkload* bulk_load(int* keys, int count) {
-    int i = 0;
-    Node_bulkload* head = NULL;
-    Node_bulkload* prev = NULL;
+    for (int q = 0; ok && q < 50; q++) {
+        // ranges reach a little past both ends, the first covers every int
+        int start = q == 0 ? INT_MIN : (int)(xorshift32(state) % (range + 20)) - 10;
+        int end = q == 0 ? INT_MAX : (int)(xorshift32(state) % (range + 20)) - 10;
+        bool reverse = q % 2;
+        int batch = 1 + xorshift32(state) % 9;
+        int expected_count = 0, got_count = 0, count;
+        for (long long key = start < 0 ? 0 : start; key <= end && key < range; key++) {
+            if (live[key])
+                expected[expected_count++] = (int)key;
+        }
 
-    while (i < count) {
-        Node_bulkload* leaf = create_node_bulkload(true);
-        for (int j = 0; j < ORDER - 1 && i < count; j++, i++) {
-            leaf->keys[j] = keys[i];
-            leaf->values[j] = NULL;  // Initialize to NULL
-            leaf->num_keys++;
+        int keys[9];
+        record *records[9];
+        range_cursor cursor;
+        rangeOpen(&cursor, root, start, end, reverse);
+        while ((count = rangeNextBatch(&cursor, keys, records, batch)) > 0) {
+            for (int i = 0; i < count && got_count < FUZZ_RANGE_KEYS; i++)
+                got[got_count++] = keys[i];
+        }
+        rangeClose(&cursor);
+        if (got_count != expected_count) {
+            ok = false;
+            break;
+        }
+        for (int i = 0; i < expected_count; i++) {
+            if (got[reverse ? expected_count - 1 - i : i] != expected[i])
+                ok = false;
         }
 
-        if (prev) {
-            prev->next = leaf;
-        } else {
-            head = leaf;
+        if (findRange(root, start, end, false, found_keys, found, FUZZ_RANGE_KEYS) != expected_count ||
+            findRange(root, start, end, false, found_keys, found, expected_count / 2) !=
+                expected_count / 2)
+            ok = false;
+    }
+    destroyTree(&mem);
+    return ok;
+}
+
+// main.exe fuzz-range [iterations] [seed]
+// Random trees at orders 3 to 12, returns 1 on the first range that
+// differs from the expected keys
+int fuzz_range(int argc, char *argv[]) {
+    int iterations = argc > 2 ? atoi(argv[2]) : 400;
+    uint32_t seed = argc > 3 ? (uint32_t)strtoul(argv[3], NULL, 10) : 99;
+    uint32_t state = seed ? seed : 1;
+
+    for (int i = 0; i < iterations; i++) {
+        order = 3 + i % 10;
+        if (!fuzz_range_once(&state, i % 2)) {
+            printf("iteration %d (order %d, seed %u): range scan differs from the live keys\n",
+                   i, order, seed);
+            order = ORDER;
+            return 1;
         }
+    }
+    printf("%d iterations ok\n", iterations);
+    order = ORDER;
+    return 0;
+}
 
-        prev = leaf;
+// Insert and lookup cost of one specialized variant, keys are widened to
+// the variant's key type with make_key
+#define BENCH_SPEC_VARIANT(NAME, KEY, make_key)                                 \
+    void bench_spec_##NAME(const uint32_t *pool, int count, int probes,         \
+                           double *insert_ns, double *lookup_ns, int *height) { \
+        tree_##NAME tree;                                                       \
+        init_##NAME(&tree);                                                     \
+        uint64_t start = now_ns();                                              \
+        for (int i = 0; i < count; i++)                                         \
+            insert_##NAME(&tree, make_key(pool[i]), (void *)&pool[i]);          \
+        uint64_t end = now_ns();                                                \
+        *insert_ns = (double)(end - start) / count;                             \
+        uint32_t state = 2463534242u;                                           \
+        int hits = 0;                                                           \
+        start = now_ns();                                                       \
+        for (int i = 0; i < probes; i++) {                                      \
+            const uint32_t *p = &pool[xorshift32(&state) % count];              \
+            hits += find_##NAME(&tree, make_key(*p)) == p;                      \
+        }                                                                       \
+        end = now_ns();                                                         \
+        *lookup_ns = (double)(end - start) / probes;                            \
+        *height = hits == probes ? height_##NAME(&tree) : -1;                   \
+        destroy_##NAME(&tree);                                                  \
     }
 
-    // No internal tree building for simplicity
-    return head;  // Return first leaf node
+#define BENCH_U32_KEY(k) (k)
+// odd multiplier, so distinct keys stay distinct and use all 64 bits
+#define BENCH_U64_KEY(k) ((uint64_t)(k) * 0x9E3779B97F4A7C15ull)
+
+fixed_key bench_fixed_key(uint32_t k) {
+    char name[FIXED_KEY_LEN + 1];
+    snprintf(name, sizeof(name), "dept-%08x", k);
+    return fixedKey(name, (int)strlen(name));
+}
+
+BENCH_SPEC_VARIANT(u32_8, uint32_t, BENCH_U32_KEY)
+BENCH_SPEC_VARIANT(u32_16, uint32_t, BENCH_U32_KEY)
+BENCH_SPEC_VARIANT(u32_32, uint32_t, BENCH_U32_KEY)
+BENCH_SPEC_VARIANT(u32_64, uint32_t, BENCH_U32_KEY)
+BENCH_SPEC_VARIANT(u32_128, uint32_t, BENCH_U32_KEY)
+BENCH_SPEC_VARIANT(u64_8, uint64_t, BENCH_U64_KEY)
+BENCH_SPEC_VARIANT(u64_16, uint64_t, BENCH_U64_KEY)
+BENCH_SPEC_VARIANT(u64_32, uint64_t, BENCH_U64_KEY)
+BENCH_SPEC_VARIANT(u64_64, uint64_t, BENCH_U64_KEY)
+BENCH_SPEC_VARIANT(u64_128, uint64_t, BENCH_U64_KEY)
+BENCH_SPEC_VARIANT(str16_32, fixed_key, bench_fixed_key)
+
+typedef void (*bench_spec_fn)(const uint32_t *, int, int, double *, double *, int *);
+
+// main.exe bench-spec [keys]
+// Inserts and lookups of the node tree (runtime order, int keys) against
+// the compile-time variants with u32 and u64 keys at orders 8 to 128, then
+// 16 byte string keys against the string keyed tree
+int bench_spec(int argc, char *argv[]) {
+    int count = argc > 2 ? atoi(argv[2]) : 2000000;
+    int orders[] = {8, 16, 32, 64, 128};
+    bench_spec_fn u32_variants[] = {bench_spec_u32_8, bench_spec_u32_16, bench_spec_u32_32,
+                                    bench_spec_u32_64, bench_spec_u32_128};
+    bench_spec_fn u64_variants[] = {bench_spec_u64_8, bench_spec_u64_16, bench_spec_u64_32,
+                                    bench_spec_u64_64, bench_spec_u64_128};
+    int order_count = sizeof(orders) / sizeof(orders[0]);
+    const int probes = 1000000;
+    double insert_ns, lookup_ns;
+    int h;
+    uint64_t start, end;
+    tree_memory mem = {0};
+
+    uint32_t *pool = bench_synthetic_keys(count);
+    printf("%d keys, %d lookups, ns per operation (insert / lookup)\n", count, probes);
+    printf("  order    generic int       u32 variant       u64 variant\n");
+    for (int o = 0; o < order_count; o++) {
+        order = orders[o];
+        node *root = NULL;
+        start = now_ns();
+        for (int i = 0; i < count; i++)
+            root = insert(&mem, root, (int)pool[i], NULL);
+        end = now_ns();
+        insert_ns = (double)(end - start) / count;
+        // the node search only, without reading the record behind the key
+        uint32_t state = 2463534242u;
+        int hits = 0;
+        start = now_ns();
+        for (int i = 0; i < probes; i++) {
+            int key = (int)pool[xorshift32(&state) % count];
+            node *leaf = findLeaf(root, key, false);
+            int slot = nodeLowerBound(leaf->keys, leaf->num_keys, key);
+            hits += slot < leaf->num_keys && leaf->keys[slot] == key;
+        }
+        end = now_ns();
+        lookup_ns = (double)(end - start) / probes;
+        destroyTree(&mem);
+        printf("  %5d  %7.1f / %5.1f%s", orders[o], insert_ns, lookup_ns,
+               hits == probes ? "" : " (mismatch)");
+
+        u32_variants[o](pool, count, probes, &insert_ns, &lookup_ns, &h);
+        printf("  %7.1f / %5.1f%s", insert_ns, lookup_ns, h < 0 ? " (mismatch)" : "");
+        u64_variants[o](pool, count, probes, &insert_ns, &lookup_ns, &h);
+        printf("  %7.1f / %5.1f%s\n", insert_ns, lookup_ns, h < 0 ? " (mismatch)" : "");
+    }
+    order = ORDER;
+
+    // string keys of 13 bytes
+    str_node *str_root = NULL;
+    char name[FIXED_KEY_LEN + 1];
+    record *r;
+    start = now_ns();
+    for (int i = 0; i < count; i++) {
+        snprintf(name, sizeof(name), "dept-%08x", pool[i]);
+        str_root = strUpsert(&mem, str_root, name, (int)strlen(name), &r);
+    }
+    end = now_ns();
+    insert_ns = (double)(end - start) / count;
+    uint32_t state = 2463534242u;
+    int hits = 0;
+    start = now_ns();
+    for (int i = 0; i < probes; i++) {
+        snprintf(name, sizeof(name), "dept-%08x", pool[xorshift32(&state) % count]);
+        hits += strFind(str_root, name, (int)strlen(name)) != NULL;
+    }
+    end = now_ns();
+    lookup_ns = (double)(end - start) / probes;
+    destroyTree(&mem);
+    printf("string keys, order 32 (key formatting included)\n");
+    printf("  string keyed tree  %7.1f / %5.1f%s\n", insert_ns, lookup_ns,
+           hits == probes ? "" : " (mismatch)");
+    bench_spec_str16_32(pool, count, probes, &insert_ns, &lookup_ns, &h);
+    printf("  str16 variant      %7.1f / %5.1f%s\n", insert_ns, lookup_ns,
+           h < 0 ? " (mismatch)" : "");
+
+    free(pool);
+    return 0;
 }
 
-// Search key in leaf nodes (simple linear scan)
-Node_bulkload* search_bulkload(Node_bulkload* leaf_head, int key) {
-    Node_bulkload* curr = leaf_head;
-    while (curr) {
-        for (int i = 0; i < curr->num_keys; i++) {
-            if (curr->keys[i] == key) {
-                return curr;  // Return the node containing the key
+// main.exe bench-search [tree_keys]
+// Per-node search cost for every kernel, then whole-tree lookups,
+// for node orders 4 to 512
+int bench_search(int argc, char *argv[]) {
+    int tree_count = argc > 2 ? atoi(argv[2]) : 1000000;
+    int orders[] = {4, 8, 16, 32, 64, 128, 256, 512};
+    int order_count = sizeof(orders) / sizeof(orders[0]);
+    const int probes = 1000000;
+    uint64_t start, end;
+    tree_memory mem = {0};
+
+    int *node_keys = malloc(orders[order_count - 1] * sizeof(int));
+    int *probe_keys = malloc(probes * sizeof(int));
+    if (node_keys == NULL || probe_keys == NULL) {
+        perror("Benchmark keys.");
+        exit(EXIT_FAILURE);
+    }
+
+    printf("node search (ns per search)\n%-6s", "order");
+    for (int k = 0; k < SEARCH_KERNEL_COUNT; k++)
+        printf("%10s", search_kernel_names[k]);
+    printf("\n");
+    for (int o = 0; o < order_count; o++) {
+        int n = orders[o] - 1;
+        uint32_t state = 88172645u;
+        int key = -(n * 8);
+        for (int i = 0; i < n; i++) {
+            key += 1 + xorshift32(&state) % 16;
+            node_keys[i] = key;
+        }
+        for (int i = 0; i < probes; i++)
+            probe_keys[i] = -(n * 8) + (int)(xorshift32(&state) % (n * 16 + 2));
+
+        printf("%-6d", orders[o]);
+        long long expected = -1;
+        for (int k = 0; k < SEARCH_KERNEL_COUNT; k++) {
+            if (!setNodeSearchKernel(k)) {
+                printf("%10s", "n/a");
+                continue;
+            }
+            long long checksum = 0;
+            start = now_ns();
+            for (int i = 0; i < probes; i++)
+                checksum += nodeLowerBound(node_keys, n, probe_keys[i]);
+            end = now_ns();
+            printf("%10.2f", (double)(end - start) / probes);
+            if (expected >= 0 && checksum != expected)
+                printf(" (mismatch)");
+            expected = checksum;
+        }
+        printf("\n");
+    }
+
+    uint32_t *keys = bench_synthetic_keys(tree_count);
+    printf("tree lookup, %d keys (ns per lookup)\n%-6s", tree_count, "order");
+    for (int k = 0; k < SEARCH_KERNEL_COUNT; k++)
+        printf("%10s", search_kernel_names[k]);
+    printf("\n");
+    for (int o = 0; o < order_count; o++) {
+        order = orders[o];
+        setNodeSearchKernel(bestNodeSearchKernel());
+        node *root = NULL;
+        for (int i = 0; i < tree_count; i++)
+            root = insert(&mem, root, (int)keys[i], NULL);
+
+        printf("%-6d", orders[o]);
+        for (int k = 0; k < SEARCH_KERNEL_COUNT; k++) {
+            if (!setNodeSearchKernel(k)) {
+                printf("%10s", "n/a");
+                continue;
+            }
+            uint32_t state = 2463534242u;
+            int hits = 0;
+            start = now_ns();
+            for (int i = 0; i < probes; i++) {
+                if (find(root, (int)keys[xorshift32(&state) % tree_count], false, NULL) != NULL)
+                    hits++;
             }
+            end = now_ns();
+            printf("%10.1f", (double)(end - start) / probes);
+            if (hits != probes)
+                printf(" (mismatch)");
         }
-        curr = curr->next;
+        printf("\n");
+        destroyTree(&mem);
     }
-    return NULL;  // Not found
+    order = ORDER;
+    setNodeSearchKernel(bestNodeSearchKernel());
+
+    free(keys);
+    free(probe_keys);
+    free(node_keys);
+    return 0;
 }
 
-// Comparison function for qsort
-int compare_uint32(const void* a, const void* b) {
-    uint32_t arg1 = *(const uint32_t*)a;
-    uint32_t arg2 = *(const uint32_t*)b;
-    return (arg1 > arg2) - (arg1 < arg2);
+#ifdef BENCH_DRIVER
+
+// Benchmark driver
+//
+// Built with -DBENCH_DRIVER, main() runs named workloads instead of the
+// interactive modes:
+//
+//   bench.exe <workload[,workload...]|all> [keys] [ops] [csv|json] [output_path]
+//
+// Each operation is timed on its own with the monotonic clock. The driver
+// reports the p50, p99 and p999 latencies and the throughput, one CSV row or
+// JSON object per workload, on stdout or in output_path. Keys and query
+// streams come from fixed seeds, so two runs do the same work and their
+// results can be diffed to catch regressions. Latencies and throughput
+// include one clock read per operation; timer_ns is the cost of that read.
+// The checksum counts what the queries found. A change in it means the run
+// did different work.
+
+#define BENCH_DRIVER_KEYS 1000000
+#define BENCH_DRIVER_OPS 1000000
+#define BENCH_LOAD_REPS 5 // a bulk-load sample is one whole load
+#define BENCH_RANGE_KEYS 100
+#define BENCH_RANK_ROWS 8 // rows per key of the rank tree
+#define BENCH_ZIPF_THETA 0.99
+
+typedef struct bench_context {
+    int key_count;
+    int ops;
+    uint32_t *pool; // distinct keys in insertion order
+    int *sorted; // the same keys in tree order
+    uint64_t *samples; // latency of every operation of the current workload
+    node *root; // tree of the pool, built by the first query workload
+    tree_memory mem;
+} bench_context;
+
+typedef struct bench_result {
+    const char *workload;
+    long long ops;
+    long long samples; // entries of bench_context.samples filled in
+    double seconds;
+    uint64_t p50, p99, p999, max; // ns
+    long long checksum;
+} bench_result;
+
+typedef void (*bench_workload_fn)(bench_context *ctx, bench_result *result);
+
+typedef struct bench_workload {
+    const char *name;
+    bench_workload_fn run;
+} bench_workload;
+
+int bench_compare_int(const void *a, const void *b) {
+    int x = *(const int *)a, y = *(const int *)b;
+    return (x > y) - (x < y);
 }
 
-// Sorts and removes duplicates in-place
-void sort_and_deduplicate(uint32_t* keys, int* count) {
-    if (*count <= 1) return;
+int bench_compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
 
-    // Step 1: Sort
-    qsort(keys, *count, sizeof(uint32_t), compare_uint32);
+// Cheapest back-to-back difference of two clock reads
+uint64_t bench_timer_cost(void) {
+    uint64_t best = UINT64_MAX;
+    for (int i = 0; i < 10000; i++) {
+        uint64_t start = now_ns();
+        uint64_t cost = now_ns() - start;
+        if (cost < best)
+            best = cost;
+    }
+    return best;
+}
 
-    // Step 2: Deduplicate
-    int unique_idx = 0;
-    for (int i = 1; i < *count; i++) {
-        if (keys[i] != keys[unique_idx]) {
-            unique_idx++;
-            keys[unique_idx] = keys[i];
-        }
+// Sort the samples and fill in the percentiles, nearest rank
+void bench_percentiles(uint64_t *samples, long long count, bench_result *result) {
+    qsort(samples, count, sizeof(uint64_t), bench_compare_u64);
+    result->p50 = samples[(long long)ceil(0.5 * count) - 1];
+    result->p99 = samples[(long long)ceil(0.99 * count) - 1];
+    result->p999 = samples[(long long)ceil(0.999 * count) - 1];
+    result->max = samples[count - 1];
+}
+
+// Uniform double in [0, 1)
+double bench_uniform(uint32_t *state) {
+    return xorshift32(state) / 4294967296.0;
+}
+
+// Zipfian ranks over [0, n) as in YCSB (Gray et al., "Quickly generating
+// billion-record synthetic databases"); rank 0 is the most popular
+typedef struct bench_zipf {
+    int n;
+    double theta, alpha, zetan, eta;
+} bench_zipf;
+
+void bench_zipf_init(bench_zipf *z, int n, double theta) {
+    double zeta2 = 1.0 + pow(0.5, theta);
+    z->n = n;
+    z->theta = theta;
+    z->zetan = 0;
+    for (int i = 1; i <= n; i++)
+        z->zetan += 1.0 / pow(i, theta);
+    z->alpha = 1.0 / (1.0 - theta);
+    z->eta = (1.0 - pow(2.0 / n, 1.0 - theta)) / (1.0 - zeta2 / z->zetan);
+}
+
+int bench_zipf_next(const bench_zipf *z, uint32_t *state) {
+    double u = bench_uniform(state);
+    double uz = u * z->zetan;
+    if (uz < 1.0)
+        return 0;
+    if (uz < 1.0 + pow(0.5, z->theta))
+        return 1;
+    int rank = (int)(z->n * pow(z->eta * u - z->eta + 1.0, z->alpha));
+    return rank < z->n ? rank : z->n - 1;
+}
+
+// Tree of the pool for the query workloads, built once and not timed
+node *bench_driver_tree(bench_context *ctx) {
+    if (ctx->root == NULL) {
+        for (int i = 0; i < ctx->key_count; i++)
+            ctx->root = insert(&ctx->mem, ctx->root, (int)ctx->pool[i], NULL);
+#ifdef TREE_METRICS
+        // the counters cover the workload, not building its tree
+        metricsReset();
+#endif
     }
+    return ctx->root;
+}
 
-    // Update count to number of unique elements
-    *count = unique_idx + 1;
+// insert() of every key in ascending order
+void bench_seq_insert(bench_context *ctx, bench_result *result) {
+    tree_memory mem = {0};
+    number_of_splits = 0;
+    node *root = NULL;
+    uint64_t begin = now_ns();
+    for (int i = 0; i < ctx->key_count; i++) {
+        uint64_t start = now_ns();
+        root = insert(&mem, root, ctx->sorted[i], NULL);
+        ctx->samples[i] = now_ns() - start;
+    }
+    result->seconds = (now_ns() - begin) / 1e9;
+    result->ops = result->samples = ctx->key_count;
+    result->checksum = number_of_splits;
+    destroyTree(&mem);
 }
 
+// sort_and_deduplicate() and bulk_load() of the pool, throughput in keys
+void bench_bulk_load(bench_context *ctx, bench_result *result) {
+    uint32_t *keys = malloc(ctx->key_count * sizeof(uint32_t));
+    if (keys == NULL) {
+        perror("Benchmark keys.");
+        exit(EXIT_FAILURE);
+    }
+    uint64_t total = 0;
+    for (int r = 0; r < BENCH_LOAD_REPS; r++) {
+        memcpy(keys, ctx->pool, ctx->key_count * sizeof(uint32_t));
+        size_t count = ctx->key_count;
+        uint64_t start = now_ns();
+        sort_and_deduplicate(keys, &count);
+        Node_bulkload *root = bulk_load(keys, count, BULKLOAD_FILL_FACTOR);
+        ctx->samples[r] = now_ns() - start;
+        total += ctx->samples[r];
+        result->checksum = height_bulkload(root);
+        free_bulkload(root);
+    }
+    result->seconds = total / 1e9;
+    result->ops = (long long)BENCH_LOAD_REPS * ctx->key_count;
+    result->samples = BENCH_LOAD_REPS;
+    free(keys);
+}
 
-// util functions
+// find() of present keys, picked by rank: uniformly or Zipfian
+void bench_point_lookups(bench_context *ctx, bench_result *result, bool zipf) {
+    node *root = bench_driver_tree(ctx);
+    int *probes = malloc(ctx->ops * sizeof(int));
+    if (probes == NULL) {
+        perror("Benchmark keys.");
+        exit(EXIT_FAILURE);
+    }
+    // the pool is in random order, so popular ranks are spread over the tree
+    uint32_t state = 2463534242u;
+    bench_zipf z;
+    if (zipf)
+        bench_zipf_init(&z, ctx->key_count, BENCH_ZIPF_THETA);
+    for (int i = 0; i < ctx->ops; i++) {
+        int rank = zipf ? bench_zipf_next(&z, &state)
+                        : (int)(xorshift32(&state) % ctx->key_count);
+        probes[i] = (int)ctx->pool[rank];
+    }
 
-int calculateHeight(node *root){
-  if (root == NULL) {
-      return 0;
-  }
-  int max_height = 0;
-  for(int i =0 ; i< root->num_keys; i++){
-    if(root->pointers[i] == NULL){
-      continue;
+    long long hits = 0;
+    uint64_t begin = now_ns();
+    for (int i = 0; i < ctx->ops; i++) {
+        uint64_t start = now_ns();
+        hits += find(root, probes[i], false, NULL) != NULL;
+        ctx->samples[i] = now_ns() - start;
     }
-    int cur_height = calculateHeight(root->pointers[i]) + 1;
-    max_height = max_height > cur_height ? max_height : cur_height;
+    result->seconds = (now_ns() - begin) / 1e9;
+    result->ops = result->samples = ctx->ops;
+    result->checksum = hits;
+    free(probes);
+}
 
-  }
-  return max_height;
+void bench_point_uniform(bench_context *ctx, bench_result *result) {
+    bench_point_lookups(ctx, result, false);
 }
 
-unsigned long long estimateMemoryUsage(node *root){
-    if (root == NULL) {
-      return 0;
+void bench_point_zipf(bench_context *ctx, bench_result *result) {
+    bench_point_lookups(ctx, result, true);
+}
+
+// findRange() over BENCH_RANGE_KEYS keys from a random present key
+void bench_range_scans(bench_context *ctx, bench_result *result) {
+    node *root = bench_driver_tree(ctx);
+    int keys[BENCH_RANGE_KEYS];
+    void *pointers[BENCH_RANGE_KEYS];
+    uint32_t state = 2463534242u;
+    long long found = 0;
+    uint64_t begin = now_ns();
+    for (int i = 0; i < ctx->ops; i++) {
+        int first = xorshift32(&state) % ctx->key_count;
+        int last = first + BENCH_RANGE_KEYS - 1 < ctx->key_count
+                       ? first + BENCH_RANGE_KEYS - 1 : ctx->key_count - 1;
+        uint64_t start = now_ns();
+        found += findRange(root, ctx->sorted[first], ctx->sorted[last], false,
+                           keys, pointers, BENCH_RANGE_KEYS);
+        ctx->samples[i] = now_ns() - start;
     }
-  unsigned long long memory_usage = sizeof(root->pointers) + sizeof(root->keys) + sizeof(root->parent) + sizeof(root->is_leaf) + sizeof(root->num_keys) + sizeof(root->next);
-  for(int i =0 ; i< root->num_keys; i++){
-    if(root->pointers[i] == NULL){
-      continue;
+    result->seconds = (now_ns() - begin) / 1e9;
+    result->ops = result->samples = ctx->ops;
+    result->checksum = found;
+}
+
+// find() plus postingsRank() on a tree whose keys hold BENCH_RANK_ROWS
+// rows each, the query of the interactive modes
+void bench_rank(bench_context *ctx, bench_result *result) {
+    tree_memory mem = {0};
+    int key_count = ctx->key_count / BENCH_RANK_ROWS > 0 ? ctx->key_count / BENCH_RANK_ROWS : 1;
+    CSVRecord row;
+    memset(&row, 0, sizeof(row));
+    node *root = NULL;
+    for (int i = 0; i < key_count * BENCH_RANK_ROWS; i++) {
+        record *found;
+        root = upsert(&mem, root, (int)ctx->pool[i % key_count], &found);
+        row.id = i;
+        row.score = 600.0f - 400.0f * i / (key_count * BENCH_RANK_ROWS);
+        postingsAppend(&mem, &found->rows, &row);
     }
-    if(root->is_leaf){
-        
-        // calculate linked list memory usage
-        record *r = (record *)root->pointers[i];
-        CSVRecordNode *linked_list_node = (CSVRecordNode *)r->value;
+#ifdef TREE_METRICS
+    metricsReset();
+#endif
+
+    uint32_t state = 2463534242u;
+    long long id_sum = 0;
+    uint64_t begin = now_ns();
+    for (int i = 0; i < ctx->ops; i++) {
+        int key = (int)ctx->pool[xorshift32(&state) % key_count];
+        int rank = 1 + xorshift32(&state) % BENCH_RANK_ROWS;
+        uint64_t start = now_ns();
+        record *r = find(root, key, false, NULL);
+        const CSVRecord *ranked = r != NULL ? postingsRank(&r->rows, rank) : NULL;
+        ctx->samples[i] = now_ns() - start;
+        if (ranked != NULL)
+            id_sum += ranked->id;
+    }
+    result->seconds = (now_ns() - begin) / 1e9;
+    result->ops = result->samples = ctx->ops;
+    result->checksum = id_sum;
+    destroyTree(&mem);
+}
 
-        while (linked_list_node) {
-            memory_usage += sizeof(CSVRecordNode);
-            linked_list_node = linked_list_node->next;
-        }
-      }
+bench_workload bench_workloads[] = {
+    {"seq-insert", bench_seq_insert},
+    {"bulk-load", bench_bulk_load},
+    {"point-uniform", bench_point_uniform},
+    {"point-zipf", bench_point_zipf},
+    {"range", bench_range_scans},
+    {"rank", bench_rank},
+};
+#define BENCH_WORKLOAD_COUNT (int)(sizeof(bench_workloads) / sizeof(bench_workloads[0]))
+
+void bench_print_usage(const char *program) {
+    printf("Usage: %s <workload[,workload...]|all> [keys] [ops] [csv|json] [output_path]\n"
+           "Workloads:", program);
+    for (int w = 0; w < BENCH_WORKLOAD_COUNT; w++)
+        printf(" %s", bench_workloads[w].name);
+    printf("\n");
+}
 
+// True when name is "all" or one of the comma separated names in list
+bool bench_selected(const char *list, const char *name) {
+    if (strcmp(list, "all") == 0)
+        return true;
+    size_t len = strlen(name);
+    for (const char *p = list; p != NULL; p = strchr(p, ',')) {
+        if (*p == ',')
+            p++;
+        if (strncmp(p, name, len) == 0 && (p[len] == ',' || p[len] == '\0'))
+            return true;
+    }
+    return false;
+}
 
-    memory_usage += estimateMemoryUsage(root->pointers[i]) + 1;
+int bench_driver(int argc, char *argv[]) {
+    if (argc < 2) {
+        bench_print_usage(argv[0]);
+        return 1;
+    }
+    const char *list = argv[1];
+    bench_context ctx = {0};
+    ctx.key_count = argc > 2 ? atoi(argv[2]) : BENCH_DRIVER_KEYS;
+    ctx.ops = argc > 3 ? atoi(argv[3]) : BENCH_DRIVER_OPS;
+    bool json = argc > 4 && strcmp(argv[4], "json") == 0;
+    if (argc > 4 && !json && strcmp(argv[4], "csv") != 0) {
+        bench_print_usage(argv[0]);
+        return 1;
+    }
+    if (ctx.key_count < 1 || ctx.ops < 1) {
+        bench_print_usage(argv[0]);
+        return 1;
+    }
+    int selected = 0;
+    for (int w = 0; w < BENCH_WORKLOAD_COUNT; w++)
+        selected += bench_selected(list, bench_workloads[w].name);
+    if (selected == 0) {
+        bench_print_usage(argv[0]);
+        return 1;
+    }
+    FILE *out = stdout;
+    if (argc > 5 && (out = fopen(argv[5], "w")) == NULL) {
+        perror("Benchmark output.");
+        exit(EXIT_FAILURE);
+    }
 
-  }
-  return memory_usage;
+#if NODE_CACHE_LINES > 0
+    order = orderForCacheLines(NODE_CACHE_LINES);
+#endif
+    ctx.pool = bench_synthetic_keys(ctx.key_count);
+    ctx.sorted = malloc(ctx.key_count * sizeof(int));
+    long long sample_count = ctx.ops > ctx.key_count ? ctx.ops : ctx.key_count;
+    if (sample_count < BENCH_LOAD_REPS)
+        sample_count = BENCH_LOAD_REPS;
+    ctx.samples = malloc(sample_count * sizeof(uint64_t));
+    if (ctx.sorted == NULL || ctx.samples == NULL) {
+        perror("Benchmark keys.");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < ctx.key_count; i++)
+        ctx.sorted[i] = (int)ctx.pool[i];
+    qsort(ctx.sorted, ctx.key_count, sizeof(int), bench_compare_int);
+    uint64_t timer = bench_timer_cost();
+
+    if (json)
+        fprintf(out, "{\"keys\": %d, \"ops\": %d, \"order\": %d, \"timer_ns\": %llu, "
+                "\"results\": [", ctx.key_count, ctx.ops, order, (unsigned long long)timer);
+    else
+        fprintf(out, "workload,keys,order,ops,seconds,ops_per_sec,p50_ns,p99_ns,p999_ns,"
+                "max_ns,timer_ns,checksum\n");
+    bool first = true;
+    for (int w = 0; w < BENCH_WORKLOAD_COUNT; w++) {
+        if (!bench_selected(list, bench_workloads[w].name))
+            continue;
+        bench_result result = {.workload = bench_workloads[w].name};
+#ifdef TREE_METRICS
+        metricsReset();
+#endif
+        bench_workloads[w].run(&ctx, &result);
+#ifdef TREE_METRICS
+        tree_metrics metrics;
+        metricsRead(&metrics);
+        printMetrics(stderr, result.workload, &metrics);
+#endif
+        bench_percentiles(ctx.samples, result.samples, &result);
+        double rate = result.ops / result.seconds;
+        if (json) {
+            fprintf(out, "%s\n  {\"workload\": \"%s\", \"ops\": %lld, \"seconds\": %.6f, "
+                    "\"ops_per_sec\": %.0f, \"p50_ns\": %llu, \"p99_ns\": %llu, "
+                    "\"p999_ns\": %llu, \"max_ns\": %llu, \"checksum\": %lld}",
+                    first ? "" : ",", result.workload, result.ops, result.seconds, rate,
+                    (unsigned long long)result.p50, (unsigned long long)result.p99,
+                    (unsigned long long)result.p999, (unsigned long long)result.max,
+                    result.checksum);
+        } else {
+            fprintf(out, "%s,%d,%d,%lld,%.6f,%.0f,%llu,%llu,%llu,%llu,%llu,%lld\n",
+                    result.workload, ctx.key_count, order, result.ops, result.seconds, rate,
+                    (unsigned long long)result.p50, (unsigned long long)result.p99,
+                    (unsigned long long)result.p999, (unsigned long long)result.max,
+                    (unsigned long long)timer, result.checksum);
+        }
+        fflush(out);
+        first = false;
+    }
+    if (json)
+        fprintf(out, "\n]}\n");
+
+    if (out != stdout)
+        fclose(out);
+    destroyTree(&ctx.mem);
+    free(ctx.pool);
+    free(ctx.sorted);
+    free(ctx.samples);
+    return 0;
 }
 
+#endif
 
 int main(int argc, char* argv[]) {
+    // before any thread can search a node
+    setNodeSearchKernel(bestNodeSearchKernel());
+#ifdef BENCH_DRIVER
+    return bench_driver(argc, argv);
+#endif
     if (argc < 2) {
         printf("Usage: %s <number>\n", argv[0]);
         return 1;
     }
-    read_file();
+    if (strcmp(argv[1], "bench-load") == 0)
+        return bench_load(argc, argv);
+    if (strcmp(argv[1], "bench-layout") == 0)
+        return bench_layout(argc, argv);
+    if (strcmp(argv[1], "bench-search") == 0)
+        return bench_search(argc, argv);
+    if (strcmp(argv[1], "bench-insert") == 0)
+        return bench_insert(argc, argv);
+    if (strcmp(argv[1], "bench-alloc") == 0)
+        return bench_alloc(argc, argv);
+    if (strcmp(argv[1], "bench-ingest") == 0)
+        return bench_ingest(argc, argv);
+    if (strcmp(argv[1], "bench-parallel") == 0)
+        return bench_parallel(argc, argv);
+    if (strcmp(argv[1], "bench-sort") == 0)
+        return bench_sort(argc, argv);
+    if (strcmp(argv[1], "bench-strkey") == 0)
+        return bench_strkey(argc, argv);
+    if (strcmp(argv[1], "bench-postings") == 0)
+        return bench_postings(argc, argv);
+    if (strcmp(argv[1], "bench-topk") == 0)
+        return bench_topk(argc, argv);
+    if (strcmp(argv[1], "bench-churn") == 0)
+        return bench_churn(argc, argv);
+    if (strcmp(argv[1], "bench-paged") == 0)
+        return bench_paged(argc, argv);
+    if (strcmp(argv[1], "bench-snapshot") == 0)
+        return bench_snapshot(argc, argv);
+    if (strcmp(argv[1], "bench-olc") == 0)
+        return bench_olc(argc, argv);
+    if (strcmp(argv[1], "stress-olc") == 0)
+        return stress_olc(argc, argv);
+    if (strcmp(argv[1], "bench-epoch") == 0)
+        return bench_epoch(argc, argv);
+    if (strcmp(argv[1], "stress-epoch") == 0)
+        return stress_epoch(argc, argv);
+    if (strcmp(argv[1], "bench-batch") == 0)
+        return bench_batch(argc, argv);
+    if (strcmp(argv[1], "bench-insert-batch") == 0)
+        return bench_insert_batch(argc, argv);
+    if (strcmp(argv[1], "fuzz-insert-batch") == 0)
+        return fuzz_insert_batch(argc, argv);
+    if (strcmp(argv[1], "bench-range") == 0)
+        return bench_range(argc, argv);
+    if (strcmp(argv[1], "fuzz-range") == 0)
+        return fuzz_range(argc, argv);
+    if (strcmp(argv[1], "bench-spec") == 0)
+        return bench_spec(argc, argv);
+#if NODE_CACHE_LINES > 0
+    order = orderForCacheLines(NODE_CACHE_LINES);
+#endif
+    if(atoi(argv[1]) == 7){
+        // headless queries from a file or stdin, answers on stdout
+        FILE *in = argc > 2 && strcmp(argv[2], "-") != 0 ? fopen(argv[2], "r") : stdin;
+        if (in == NULL) {
+            perror("Error opening queries");
+            return 1;
+        }
+        csv_file file;
+        csv_cursor cursor;
+        csv_row row;
+        if (!csvOpen(&file, CSV_PATH))
+            return 1;
+        tree_memory mem = {0};
+        node *root = NULL;
+        csvCursorInit(&cursor, &file);
+        cursor.drop_consumed = true;
+        while (csvNextRow(&cursor, &row)) {
+            record *found;
+            root = upsert(&mem, root, csvRowKey(&row), &found);
+            postingsAppendRow(&mem, &found->rows, &row);
+        }
+        csvClose(&file);
+
+        setvbuf(in, NULL, _IOFBF, QUERY_OUTPUT_BUFFER);
+        setvbuf(stdout, NULL, _IOFBF, QUERY_OUTPUT_BUFFER);
+        uint64_t start = now_ns();
+        long long queries = serveQueries(root, in, stdout);
+        fflush(stdout);
+        double seconds = (now_ns() - start) / 1e9;
+        fprintf(stderr, "%lld queries in %.3f s, %.0f queries/s\n", queries, seconds,
+                seconds > 0 ? queries / seconds : 0);
+        if (in != stdin)
+            fclose(in);
+        destroyTree(&mem);
+        return 0;
+    }
+    if(atoi(argv[1]) == 5){
+        // paged index saved next to the CSV, built on the first run
+        const char *index_path = argc > 2 ? argv[2] : PAGED_INDEX_PATH;
+        pager index;
+        uint64_t start = now_ns();
+        if (access(index_path, F_OK) == 0) {
+            if (!pagerOpen(&index, index_path, false, BUFFER_POOL_PAGES))
+                return 1;
+            printf("Opened %s in %.3f ms\n", index_path, (now_ns() - start) / 1e6);
+        } else {
+            csv_file file;
+            if (!csvOpen(&file, CSV_PATH))
+                return 1;
+            if (!pagerOpen(&index, index_path, true, BUFFER_POOL_PAGES))
+                return 1;
+            pagedBuildIndex(&index, &file);
+            csvClose(&file);
+            printf("Built %s in %.3f ms\n", index_path, (now_ns() - start) / 1e6);
+        }
+        printf("Keys: %u, rows: %u, pages: %u\n", index.header.key_count,
+               index.header.row_count, index.header.page_count);
+
+        while (true)
+        {
+            char departmentNameInput[100];
+            char rankInput[100];
+            printf("Please enter the department name to search: \n");
+            if (fgets(departmentNameInput, sizeof(departmentNameInput), stdin) == NULL)
+                break;
+            departmentNameInput[strcspn(departmentNameInput, "\n")] = '\0';
+
+            printf("Please enter the rank to search: \n");
+            if (fgets(rankInput, sizeof(rankInput), stdin) == NULL)
+                break;
+            rankInput[strcspn(rankInput, "\n")] = '\0';
+
+            CSVRecord ranked;
+            if (!pagedRank(&index, (int32_t)DJB2_hash((const uint8_t *)departmentNameInput),
+                           atoi(rankInput), &ranked)) {
+                printf("No records found for department: %s\n", departmentNameInput);
+                continue;
+            }
+            printf("ID: %d, University: %s, Department: %s, Score: %.2f\n",
+                   ranked.id, ranked.university, ranked.department, ranked.score);
+        }
+
+        pagerClose(&index);
+        return 0;
+    }
+    if(atoi(argv[1]) == 6){
+        // read-only snapshot of the bulk loaded tree, written on the first run
+        const char *snapshot_path = argc > 2 ? argv[2] : SNAPSHOT_PATH;
+        snapshot snap;
+        uint64_t start = now_ns();
+        struct stat source;
+        if (stat(CSV_PATH, &source) != 0) {
+            perror("Error opening file");
+            return 1;
+        }
+        // rebuilt when missing or older than the CSV it was built from
+        bool current = false;
+        if (access(snapshot_path, F_OK) == 0) {
+            if (!open_snapshot(&snap, snapshot_path))
+                return 1;
+            current = snapshot_matches_source(&snap, &source);
+            if (!current) {
+                close_snapshot(&snap);
+                printf("%s changed since %s was written\n", CSV_PATH, snapshot_path);
+            }
+        }
+        if (!current) {
+            csv_file file;
+            if (!csvOpen(&file, CSV_PATH))
+                return 1;
+            tree_memory rows_mem = {0};
+            Node_bulkload* bulk_root = bulk_load_csv(&file, BULKLOAD_FILL_FACTOR, &rows_mem);
+            csvClose(&file);
+            bool written = write_snapshot(bulk_root, snapshot_path, &source);
+            free_bulkload(bulk_root);
+            destroyTree(&rows_mem);
+            if (!written)
+                return 1;
+            printf("Wrote %s\n", snapshot_path);
+            if (!open_snapshot(&snap, snapshot_path))
+                return 1;
+        }
+        printf("Ready in %.3f ms, %llu nodes, %llu rows\n", (now_ns() - start) / 1e6,
+               (unsigned long long)snap.header->node_count,
+               (unsigned long long)snap.header->row_count);
+
+        while (true)
+        {
+            char departmentNameInput[100];
+            char rankInput[100];
+            printf("Please enter the department name to search: \n");
+            if (fgets(departmentNameInput, sizeof(departmentNameInput), stdin) == NULL)
+                break;
+            departmentNameInput[strcspn(departmentNameInput, "\n")] = '\0';
+
+            printf("Please enter the rank to search: \n");
+            if (fgets(rankInput, sizeof(rankInput), stdin) == NULL)
+                break;
+            rankInput[strcspn(rankInput, "\n")] = '\0';
+
+            const CSVRecord *ranked = rank_snapshot(&snap,
+                    DJB2_hash((const uint8_t *)departmentNameInput),
+                    departmentNameInput, atoi(rankInput));
+            if (ranked == NULL) {
+                printf("No records found for department: %s\n", departmentNameInput);
+                continue;
+            }
+            // the fields come from the file, which need not terminate them
+            printf("ID: %d, University: %.*s, Department: %.*s, Score: %.2f\n",
+                   ranked->id, MAX_KEY_LEN, ranked->university, MAX_KEY_LEN,
+                   ranked->department, ranked->score);
+        }
+
+        close_snapshot(&snap);
+        return 0;
+    }
+    csv_file file;
+    csv_cursor cursor;
+    csv_row row;
+    if (!csvOpen(&file, CSV_PATH))
+        return 1;
     bool is_bulk_load = atoi(argv[1]) == 2;
 
+    if(atoi(argv[1]) == 3){
+        // string keyed tree, no hashing and no collision filtering
+        tree_memory mem = {0};
+        str_node *root = NULL;
+
+        csvCursorInit(&cursor, &file);
+        cursor.drop_consumed = true;
+        while (csvNextRow(&cursor, &row)) {
+            record *found;
+            root = strUpsert(&mem, root, row.department.data, (int)row.department.len, &found);
+            postingsAppendRow(&mem, &found->rows, &row);
+        }
+        csvClose(&file);
+
+        printf("Number of splits: %d\n", number_of_splits);
+        printf("Height of the tree: %d\n", strHeight(root) + 1);
+
+        while (true)
+        {
+            char departmentNameInput[100];
+            char rankInput[100];
+            printf("Please enter the department name to search (end with * to list a prefix): \n");
+            if (fgets(departmentNameInput, sizeof(departmentNameInput), stdin) == NULL)
+                break;
+            departmentNameInput[strcspn(departmentNameInput, "\n")] = '\0';
+            int len = (int)strlen(departmentNameInput);
+
+            if (len > 0 && departmentNameInput[len - 1] == '*') {
+                record *matches[64];
+                str_key keys[64];
+                int found = strFindPrefix(root, departmentNameInput, len - 1, 64, matches, keys);
+                for (int i = 0; i < found; i++)
+                    printf("%.*s\n", keys[i].len, keys[i].bytes);
+                if (found == 0)
+                    printf("No departments start with: %.*s\n", len - 1, departmentNameInput);
+                continue;
+            }
+
+            printf("Please enter the rank to search: \n");
+            if (fgets(rankInput, sizeof(rankInput), stdin) == NULL)
+                break;
+            rankInput[strcspn(rankInput, "\n")] = '\0';
+
+            record *result = strFind(root, departmentNameInput, len);
+            const CSVRecord *ranked = result ? postingsRank(&result->rows, atoi(rankInput)) : NULL;
+            if (ranked == NULL) {
+                printf("No records found for department: %s\n", departmentNameInput);
+                continue;
+            }
+            printf("ID: %d, University: %s, Department: %s, Score: %.2f\n",
+                   ranked->id, ranked->university, ranked->department,
+                   ranked->score);
+        }
+
+        destroyTree(&mem);
+        return 0;
+    }
+
+    if(atoi(argv[1]) == 4){
+        // one entry per row keyed by (department, score descending, id)
+        tree_memory mem = {0};
+        str_node *root = NULL;
+
+        csvCursorInit(&cursor, &file);
+        cursor.drop_consumed = true;
+        while (csvNextRow(&cursor, &row)) {
+            CSVRecord csv_record;
+            csvRowToRecord(&row, &csv_record);
+            root = compositeInsert(&mem, root, &csv_record);
+        }
+        csvClose(&file);
+
+        printf("Number of splits: %d\n", number_of_splits);
+        printf("Height of the tree: %d\n", strHeight(root) + 1);
+
+        while (true)
+        {
+            char departmentNameInput[100];
+            char rankInput[100];
+            printf("Please enter the department name to search: \n");
+            if (fgets(departmentNameInput, sizeof(departmentNameInput), stdin) == NULL)
+                break;
+            departmentNameInput[strcspn(departmentNameInput, "\n")] = '\0';
+            int len = (int)strlen(departmentNameInput);
+
+            printf("Please enter the rank to search (or low-high for a score range): \n");
+            if (fgets(rankInput, sizeof(rankInput), stdin) == NULL)
+                break;
+            rankInput[strcspn(rankInput, "\n")] = '\0';
+
+            const CSVRecord *ranked[64];
+            int found;
+            float low, high;
+            if (sscanf(rankInput, "%f-%f", &low, &high) == 2) {
+                found = compositeScoreRange(root, departmentNameInput, len, low, high,
+                                            64, ranked);
+            } else {
+                ranked[0] = compositeRank(root, departmentNameInput, len, atoi(rankInput));
+                found = ranked[0] != NULL;
+            }
+            if (found == 0) {
+                printf("No records found for department: %s\n", departmentNameInput);
+                continue;
+            }
+            for (int i = 0; i < found; i++)
+                printf("ID: %d, University: %s, Department: %s, Score: %.2f\n",
+                       ranked[i]->id, ranked[i]->university, ranked[i]->department,
+                       ranked[i]->score);
+        }
+
+        destroyTree(&mem);
+        return 0;
+    }
+
     if(!is_bulk_load){
+          tree_memory mem = {0};
           node *root;
           root = NULL;
 
-         // sequentially insert records into the B+ tree
-         for (int i = 0; i < csv_record_count; i++) {
-             uint32_t key = DJB2_hash((const uint8_t *)records[i].department);
-             root = insert(root, key, NULL);
-         }
-       
-         // populate linked list 
-         for (int i = 0; i < csv_record_count; i++) {
-             uint32_t key = DJB2_hash((const uint8_t *)records[i].department);
-             record *found = find(root, key, false, NULL);
-             CSVRecordNode *linked_list_node = found->value;
-        
-        
-             CSVRecordNode *new_node = (CSVRecordNode*)malloc(sizeof(CSVRecordNode));
-             strcpy(new_node->record.department, records[i].department);
-             strcpy(new_node->record.university, records[i].university);
-             new_node->record.id = records[i].id;
-             new_node->record.score = records[i].score;
-             new_node->next = NULL;
-        
-             if(linked_list_node == NULL){
-                 found->value = new_node;
-             }
-             else{
-                 // go to last node in linked list
-                 while (linked_list_node->next != NULL) {
-                     linked_list_node = linked_list_node->next;
-                 }
-                 linked_list_node->next = new_node;
-             }
+         // sequentially insert records into the B+ tree and
+         // append them to the department's postings
+         csvCursorInit(&cursor, &file);
+         cursor.drop_consumed = true;
+         while (csvNextRow(&cursor, &row)) {
+             uint32_t key = csvRowKey(&row);
+             record *found;
+             root = upsert(&mem, root, key, &found);
+             postingsAppendRow(&mem, &found->rows, &row);
         }
+        csvClose(&file);
       
 
         // diplay split count
@@ -862,6 +8886,15 @@ int main(int argc, char* argv[]) {
         // display memory usage
         unsigned long long memory_usage = estimateMemoryUsage(root);
         printf("Estimated memory usage: %llu bytes\n", memory_usage);
+        tree_stats stats;
+        treeStats(root, &mem, &stats);
+        printTreeStats(&stats);
+#ifdef TREE_METRICS
+        tree_metrics metrics;
+        metricsRead(&metrics);
+        printMetrics(stdout, "Load", &metrics);
+        metricsReset();
+#endif
 
           bool flag = true;
         while (flag)
@@ -869,83 +8902,66 @@ int main(int argc, char* argv[]) {
             char departmentNameInput[100];
             char rankInput[100];
             printf("Please enter the department name to search: \n");
-            fgets(departmentNameInput, sizeof(departmentNameInput), stdin);
+            if (fgets(departmentNameInput, sizeof(departmentNameInput), stdin) == NULL)
+                break;
             departmentNameInput[strcspn(departmentNameInput, "\n")] = '\0';
         
             printf("Please enter the rank to search: \n");
-            fgets(rankInput, sizeof(rankInput), stdin);
+            if (fgets(rankInput, sizeof(rankInput), stdin) == NULL)
+                break;
             rankInput[strcspn(rankInput, "\n")] = '\0';
         
-            clock_t start_time = clock();
+            uint64_t start_time = now_ns();
             record* result = find(root, DJB2_hash((const uint8_t *)departmentNameInput), false, NULL);
-            clock_t end_time = clock();
-            double seek_time_ms = 1e3 * (double)(end_time - start_time) / CLOCKS_PER_SEC;
+            uint64_t end_time = now_ns();
+            double seek_time_us = (end_time - start_time) / 1e3;
 
             if (result == NULL) {
                 printf("No records found for department: %s\n", departmentNameInput);
                 continue;
             }
 
-            CSVRecordNode* linked_list_node = result->value;
+            const CSVRecord *ranked = postingsRank(&result->rows, atoi(rankInput));
         
-            if (linked_list_node == NULL) {
+            if (ranked == NULL) {
                 printf("No records found for department: %s\n", departmentNameInput);
             } else {
-                for(int i = 1 ; i < atoi(rankInput) && linked_list_node != NULL; i++) {
-                    linked_list_node = linked_list_node->next;
-                }
                 printf("ID: %d, University: %s, Department: %s, Score: %.2f\n",
-                       linked_list_node->record.id,
-                       linked_list_node->record.university,
-                       linked_list_node->record.department,
-                       linked_list_node->record.score);
+                       ranked->id, ranked->university, ranked->department,
+                       ranked->score);
                       
-                printf("Seek time: %.0f ms\n", seek_time_ms);
+                printf("Seek time: %.3f us\n", seek_time_us);
             }
           
         }
+
+#ifdef TREE_METRICS
+        metricsRead(&metrics);
+        printMetrics(stdout, "Queries", &metrics);
+#endif
+        destroyTree(&mem);
       
     }
     else{
       
 
-      uint32_t* keys = malloc(csv_record_count * sizeof(uint32_t));
-      for (int i = 0; i < csv_record_count; i++) {
-          uint32_t key = DJB2_hash((const uint8_t *)records[i].department);
-          keys[i] = key;
+      if (argc > 3 && !parse_key_sort_method(argv[3], &key_sort)) {
+          printf("Unknown sort method: %s\n", argv[3]);
+          return 1;
       }
-
-      sort_and_deduplicate(keys, &csv_record_count);
-
-      Node_bulkload* root = bulk_load(keys, csv_record_count);
-
-     for (int i = 0; i < csv_record_count; i++) {
-             uint32_t key = DJB2_hash((const uint8_t *)records[i].department);
-             Node_bulkload *found = search_bulkload(root, key);
-        
-                // populate linked list 
-  
-             CSVRecordNode *linked_list_node = found->linked_list_node;
-        
-        
-             CSVRecordNode *new_node = (CSVRecordNode*)malloc(sizeof(CSVRecordNode));
-             strcpy(new_node->record.department, records[i].department);
-             strcpy(new_node->record.university, records[i].university);
-             new_node->record.id = records[i].id;
-             new_node->record.score = records[i].score;
-             new_node->next = NULL;
-        
-             if(linked_list_node == NULL){
-                 found->linked_list_node = new_node;
-             }
-             else{
-                 // go to last node in linked list
-                 while (linked_list_node->next != NULL) {
-                     linked_list_node = linked_list_node->next;
-                 }
-                 linked_list_node->next = new_node;
-             }
-        }
+      double fill_factor = argc > 2 ? atof(argv[2]) : BULKLOAD_FILL_FACTOR;
+      tree_memory mem = {0};
+      Node_bulkload* root = bulk_load_csv(&file, fill_factor, &mem);
+        csvClose(&file);
+        tree_stats stats;
+        stats_bulkload(root, &mem, &stats);
+        printTreeStats(&stats);
+#ifdef TREE_METRICS
+        tree_metrics metrics;
+        metricsRead(&metrics);
+        printMetrics(stdout, "Load", &metrics);
+        metricsReset();
+#endif
       
 
         bool flag = true;
@@ -954,57 +8970,50 @@ int main(int argc, char* argv[]) {
             char departmentNameInput[100];
             char rankInput[100];
             printf("Please enter the department name to search: \n");
-            fgets(departmentNameInput, sizeof(departmentNameInput), stdin);
+            if (fgets(departmentNameInput, sizeof(departmentNameInput), stdin) == NULL)
+                break;
             departmentNameInput[strcspn(departmentNameInput, "\n")] = '\0';
         
             printf("Please enter the rank to search: \n");
-            fgets(rankInput, sizeof(rankInput), stdin);
+            if (fgets(rankInput, sizeof(rankInput), stdin) == NULL)
+                break;
             rankInput[strcspn(rankInput, "\n")] = '\0';
         
-            Node_bulkload* result = search_bulkload(root, DJB2_hash((const uint8_t *)departmentNameInput));
+            postings* result = find_bulkload(root, DJB2_hash((const uint8_t *)departmentNameInput));
         
             if (result == NULL) {
                 printf("No records found for department: %s\n", departmentNameInput);
                 continue;
             }
 
-            CSVRecordNode* linked_list_node = result->linked_list_node;
-        
-            int counter = 0;
-            if (linked_list_node == NULL) {
-                printf("No records found for department: %s\n", departmentNameInput);
-            } else {
-                for(int i = 1 ; i < atoi(rankInput) && linked_list_node != NULL; i++) {
-                  if(counter >= 1000) break;
-                  if(linked_list_node->record.department != NULL && strcmp(linked_list_node->record.department, departmentNameInput) != 0){
-                    i--;
-                    counter++;
-                    continue;
-                  }
-                  linked_list_node = linked_list_node->next;
-                }
-
-                if(counter >= 1000){
-                  printf("No records found for department: %s\n", departmentNameInput);
-                  continue;
+            // rows of departments whose names collide on the hash share the
+            // postings, so count only the rows of this department
+            const CSVRecord *ranked = NULL;
+            int rank = atoi(rankInput);
+            for (int i = 0, seen = 0; i < result->count; i++) {
+                if (strcmp(result->rows[i].department, departmentNameInput) == 0 &&
+                    ++seen == rank) {
+                    ranked = &result->rows[i];
+                    break;
                 }
-                else if(strcmp(linked_list_node->record.department, departmentNameInput) != 0){
-                  printf("No records found for department: %s\n", departmentNameInput);
-                  continue;
-                }
-                else{
-                  
-                  printf("ID: %d, University: %s, Department: %s, Score: %.2f\n",
-                         linked_list_node->record.id,
-                         linked_list_node->record.university,
-                         linked_list_node->record.department,
-                         linked_list_node->record.score);
-                }
-
+            }
 
+            if (ranked == NULL) {
+                printf("No records found for department: %s\n", departmentNameInput);
+            } else {
+                printf("ID: %d, University: %s, Department: %s, Score: %.2f\n",
+                       ranked->id, ranked->university, ranked->department,
+                       ranked->score);
             }
           
         }
+
+#ifdef TREE_METRICS
+        metricsRead(&metrics);
+        printMetrics(stdout, "Queries", &metrics);
+#endif
+        free_bulkload(root);
+        destroyTree(&mem);
       
         
       }
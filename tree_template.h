@@ -0,0 +1,255 @@
+// B + tree specialized at compile time
+//
+// main.c includes this header once per variant. Order and key type are
+// constants of each copy, so the node layout is fixed, the searches run a
+// known number of steps and the compiler unrolls and vectorizes them. The
+// includer defines:
+//
+//   BPT_NAME         suffix of the generated names: u32_64 gives the types
+//                    tree_u32_64 and node_u32_64 and the functions
+//                    init_u32_64(), insert_u32_64(), find_u32_64(),
+//                    height_u32_64() and destroy_u32_64()
+//   BPT_KEY          key type
+//   BPT_ORDER        maximum number of children of a node
+//   BPT_LESS(a, b)   true when key a sorts before key b
+//   BPT_KEY_MAX      largest key, fills the unused key slots of a node
+//   BPT_SEARCH_WINDOW  a node search narrows the keys down to this many
+//                    with a branchless binary search, then counts them with
+//                    plain compares that the compiler vectorizes for
+//                    integer keys
+//
+// Nodes are carved from the tree's own tree_memory, so main.c has to
+// include this after the tree memory section. Values are opaque pointers.
+// The parameters are undefined at the end, ready for the next variant.
+
+#ifndef BPT_CAT
+#define BPT_CAT2(a, b) a##_##b
+#define BPT_CAT(a, b) BPT_CAT2(a, b)
+#endif
+
+#define BPT_T(name) BPT_CAT(name, BPT_NAME)
+#define BPT_KEYS (BPT_ORDER - 1)
+
+typedef struct BPT_T(node) {
+  int num_keys;
+  bool is_leaf;
+  BPT_KEY keys[BPT_KEYS]; // slots from num_keys on hold BPT_KEY_MAX
+  void *pointers[BPT_ORDER]; // leaves link to the next leaf through pointers[BPT_ORDER - 1]
+} BPT_T(node);
+
+typedef struct BPT_T(tree) {
+  BPT_T(node) *root;
+  tree_memory mem;
+  long long splits;
+} BPT_T(tree);
+
+// Number of keys smaller than key. The padding never is, so the whole
+// node is searched without looking at num_keys, and every step of the
+// search is known at compile time.
+int BPT_T(lower_bound)(const BPT_KEY keys[BPT_KEYS], BPT_KEY key) {
+  const BPT_KEY *base = keys;
+  int n = BPT_KEYS;
+  while (n > BPT_SEARCH_WINDOW) {
+    int half = n / 2;
+    base += BPT_LESS(base[half - 1], key) * half;
+    n -= half;
+  }
+  int count = (int)(base - keys);
+  for (int i = 0; i < n; i++)
+    count += BPT_LESS(base[i], key);
+  return count;
+}
+
+// Number of keys smaller than or equal to key, the child to follow. The
+// padding equals key only when key is BPT_KEY_MAX, hence the clamp.
+int BPT_T(upper_bound)(const BPT_KEY keys[BPT_KEYS], int num_keys, BPT_KEY key) {
+  const BPT_KEY *base = keys;
+  int n = BPT_KEYS;
+  while (n > BPT_SEARCH_WINDOW) {
+    int half = n / 2;
+    base += !BPT_LESS(key, base[half - 1]) * half;
+    n -= half;
+  }
+  int count = (int)(base - keys);
+  for (int i = 0; i < n; i++)
+    count += !BPT_LESS(key, base[i]);
+  return count < num_keys ? count : num_keys;
+}
+
+BPT_T(node) *BPT_T(make_node)(BPT_T(tree) *t, bool is_leaf) {
+  BPT_T(node) *n = arenaAlloc(&t->mem, sizeof(BPT_T(node)), CACHE_LINE_SIZE);
+  memset(n, 0, sizeof(*n));
+  for (int i = 0; i < BPT_KEYS; i++)
+    n->keys[i] = BPT_KEY_MAX;
+  n->is_leaf = is_leaf;
+  return n;
+}
+
+void BPT_T(init)(BPT_T(tree) *t) {
+  memset(t, 0, sizeof(*t));
+}
+
+// Value of key, NULL when the key is not in the tree
+void *BPT_T(find)(const BPT_T(tree) *t, BPT_KEY key) {
+  const BPT_T(node) *c = t->root;
+  if (c == NULL)
+    return NULL;
+  while (!c->is_leaf)
+    c = c->pointers[BPT_T(upper_bound)(c->keys, c->num_keys, key)];
+  int i = BPT_T(lower_bound)(c->keys, key);
+  if (i < c->num_keys && !BPT_LESS(key, c->keys[i]))
+    return c->pointers[i];
+  return NULL;
+}
+
+// Insert key with value, or replace the value of an existing key
+void BPT_T(insert)(BPT_T(tree) *t, BPT_KEY key, void *value) {
+  BPT_T(node) *path[MAX_TREE_HEIGHT];
+  int indexes[MAX_TREE_HEIGHT];
+  BPT_KEY temp_keys[BPT_ORDER];
+  void *temp_pointers[BPT_ORDER + 1];
+  int depth = 0, i, j;
+
+  if (t->root == NULL)
+    t->root = BPT_T(make_node)(t, true);
+  BPT_T(node) *leaf = t->root;
+  while (!leaf->is_leaf) {
+    i = BPT_T(upper_bound)(leaf->keys, leaf->num_keys, key);
+    path[depth] = leaf;
+    indexes[depth++] = i;
+    leaf = leaf->pointers[i];
+  }
+
+  int slot = BPT_T(lower_bound)(leaf->keys, key);
+  if (slot < leaf->num_keys && !BPT_LESS(key, leaf->keys[slot])) {
+    leaf->pointers[slot] = value;
+    return;
+  }
+  if (leaf->num_keys < BPT_KEYS) {
+    for (i = leaf->num_keys; i > slot; i--) {
+      leaf->keys[i] = leaf->keys[i - 1];
+      leaf->pointers[i] = leaf->pointers[i - 1];
+    }
+    leaf->keys[slot] = key;
+    leaf->pointers[slot] = value;
+    leaf->num_keys++;
+    return;
+  }
+
+  // split the leaf, the right half starts at split
+  for (i = 0, j = 0; i < BPT_KEYS; i++, j++) {
+    if (j == slot)
+      j++;
+    temp_keys[j] = leaf->keys[i];
+    temp_pointers[j] = leaf->pointers[i];
+  }
+  temp_keys[slot] = key;
+  temp_pointers[slot] = value;
+  int split = (BPT_KEYS + 1) / 2;
+  BPT_T(node) *right = BPT_T(make_node)(t, true);
+  for (i = 0; i < BPT_ORDER; i++) {
+    if (i < split) {
+      leaf->keys[i] = temp_keys[i];
+      leaf->pointers[i] = temp_pointers[i];
+    } else {
+      right->keys[i - split] = temp_keys[i];
+      right->pointers[i - split] = temp_pointers[i];
+    }
+  }
+  for (i = split; i < BPT_KEYS; i++) {
+    leaf->keys[i] = BPT_KEY_MAX;
+    leaf->pointers[i] = NULL;
+  }
+  leaf->num_keys = split;
+  right->num_keys = BPT_ORDER - split;
+  right->pointers[BPT_ORDER - 1] = leaf->pointers[BPT_ORDER - 1];
+  leaf->pointers[BPT_ORDER - 1] = right;
+  t->splits++;
+
+  // carry the separator up until a parent has room
+  BPT_KEY separator = right->keys[0];
+  BPT_T(node) *left = leaf;
+  while (depth > 0) {
+    BPT_T(node) *parent = path[--depth];
+    int left_index = indexes[depth];
+    if (parent->num_keys < BPT_KEYS) {
+      for (i = parent->num_keys; i > left_index; i--) {
+        parent->keys[i] = parent->keys[i - 1];
+        parent->pointers[i + 1] = parent->pointers[i];
+      }
+      parent->keys[left_index] = separator;
+      parent->pointers[left_index + 1] = right;
+      parent->num_keys++;
+      return;
+    }
+
+    for (i = 0, j = 0; i < BPT_ORDER; i++, j++) {
+      if (j == left_index + 1)
+        j++;
+      temp_pointers[j] = parent->pointers[i];
+    }
+    for (i = 0, j = 0; i < BPT_KEYS; i++, j++) {
+      if (j == left_index)
+        j++;
+      temp_keys[j] = parent->keys[i];
+    }
+    temp_pointers[left_index + 1] = right;
+    temp_keys[left_index] = separator;
+
+    // the key at split - 1 moves up
+    split = (BPT_ORDER + 1) / 2;
+    right = BPT_T(make_node)(t, false);
+    for (i = 0; i < split - 1; i++) {
+      parent->keys[i] = temp_keys[i];
+      parent->pointers[i] = temp_pointers[i];
+    }
+    parent->pointers[i] = temp_pointers[i];
+    separator = temp_keys[split - 1];
+    for (++i, j = 0; i < BPT_ORDER; i++, j++) {
+      right->keys[j] = temp_keys[i];
+      right->pointers[j] = temp_pointers[i];
+    }
+    right->pointers[j] = temp_pointers[i];
+    right->num_keys = j;
+    for (i = split - 1; i < BPT_KEYS; i++) {
+      parent->keys[i] = BPT_KEY_MAX;
+      parent->pointers[i + 1] = NULL;
+    }
+    parent->num_keys = split - 1;
+    t->splits++;
+    left = parent;
+  }
+
+  BPT_T(node) *root = BPT_T(make_node)(t, false);
+  root->keys[0] = separator;
+  root->pointers[0] = left;
+  root->pointers[1] = right;
+  root->num_keys = 1;
+  t->root = root;
+}
+
+int BPT_T(height)(const BPT_T(tree) *t) {
+  int h = 0;
+  const BPT_T(node) *c = t->root;
+  while (c != NULL && !c->is_leaf) {
+    c = c->pointers[0];
+    h++;
+  }
+  return h;
+}
+
+// Release every node of the tree at once
+void BPT_T(destroy)(BPT_T(tree) *t) {
+  destroyTree(&t->mem);
+  t->root = NULL;
+  t->splits = 0;
+}
+
+#undef BPT_T
+#undef BPT_KEYS
+#undef BPT_NAME
+#undef BPT_KEY
+#undef BPT_ORDER
+#undef BPT_LESS
+#undef BPT_KEY_MAX
+#undef BPT_SEARCH_WINDOW